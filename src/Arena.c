@@ -0,0 +1,96 @@
+/**************************************/
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+/**************************************/
+#include "Arena.h"
+/**************************************/
+#define ALIGN2N(x,N) (((x) + (N)-1) &~ ((N)-1))
+#define DATA_ALIGNMENT 32
+#define DATA_ALIGN(x) ALIGN2N((uintptr_t)(x), DATA_ALIGNMENT) //! NOTE: Cast to uintptr_t
+/**************************************/
+
+struct Arena_t {
+	void   *Buffer;      //! Allocated block (unaligned)
+	uint8_t*Base;        //! Start of the block (aligned)
+	size_t  Size;        //! Size of the block
+	atomic_size_t Used;  //! Bytes requested since the last reset (may exceed Size)
+};
+
+/**************************************/
+
+//! Create arena
+struct Arena_t *Arena_Create(size_t Size) {
+	struct Arena_t *Arena = malloc(sizeof(struct Arena_t));
+	if(!Arena) return NULL;
+	Arena->Buffer = NULL;
+	Arena->Base   = NULL;
+	Arena->Size   = 0;
+	atomic_init(&Arena->Used, Size);
+	Arena_Reset(Arena);
+	return Arena;
+}
+
+/**************************************/
+
+//! Destroy arena
+void Arena_Destroy(struct Arena_t *Arena) {
+	if(!Arena) return;
+	free(Arena->Buffer);
+	free(Arena);
+}
+
+/**************************************/
+
+//! Release all allocations
+//! NOTE: When the last round did not fit, the block is replaced by
+//! one that fits everything that was requested. On failure, the old
+//! block is kept, and the next round simply falls back to malloc().
+void Arena_Reset(struct Arena_t *Arena) {
+	if(!Arena) return;
+	size_t Used = atomic_load(&Arena->Used);
+	if(Used > Arena->Size) {
+		void *Buffer = malloc(Used + DATA_ALIGNMENT-1);
+		if(Buffer) {
+			free(Arena->Buffer);
+			Arena->Buffer = Buffer;
+			Arena->Base   = (uint8_t*)DATA_ALIGN(Buffer);
+			Arena->Size   = Used;
+		}
+	}
+	atomic_store(&Arena->Used, 0);
+}
+
+/**************************************/
+
+//! Allocate memory
+void *Arena_Alloc(struct Arena_t *Arena, size_t Size) {
+	if(!Arena) return malloc(Size);
+	Size = DATA_ALIGN(Size);
+	size_t Offs = atomic_fetch_add(&Arena->Used, Size);
+	if(Offs + Size <= Arena->Size) return Arena->Base + Offs;
+	return malloc(Size);
+}
+
+//! Allocate zeroed memory
+void *Arena_Calloc(struct Arena_t *Arena, size_t n, size_t Size) {
+	if(!Arena) return calloc(n, Size);
+	if(Size && n > SIZE_MAX / Size) return NULL;
+	void *p = Arena_Alloc(Arena, n*Size);
+	if(p) memset(p, 0, n*Size);
+	return p;
+}
+
+/**************************************/
+
+//! Release memory
+void Arena_Free(struct Arena_t *Arena, void *p) {
+	if(Arena && (uintptr_t)p >= (uintptr_t)Arena->Base && (uintptr_t)p < (uintptr_t)Arena->Base + Arena->Size) return;
+	free(p);
+}
+
+/**************************************/
+//! EOF
+/**************************************/
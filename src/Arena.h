@@ -0,0 +1,47 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stddef.h>
+/**************************************/
+
+//! Growable memory arena
+//! Allocations are carved out of a single block, and are all released
+//! at once by Arena_Reset(). Allocations that don't fit fall back to
+//! malloc(), and the block is grown to the total size requested at the
+//! next reset, so that repeated work of a similar size eventually runs
+//! without touching the allocator at all.
+//! NOTE: Arena_Alloc() and Arena_Free() are thread-safe, but
+//! Arena_Reset() must not run concurrently with them.
+//! NOTE: All functions accept Arena=NULL, in which case allocations
+//! go straight to malloc() and free().
+struct Arena_t;
+
+/**************************************/
+
+//! Create arena
+//! Returns NULL on failure (out of memory).
+struct Arena_t *Arena_Create(size_t Size);
+
+//! Destroy arena
+void Arena_Destroy(struct Arena_t *Arena);
+
+//! Release all allocations, and grow the block if needed
+//! NOTE: Allocations that fell back to malloc() must have
+//! been released with Arena_Free() before calling this.
+void Arena_Reset(struct Arena_t *Arena);
+
+//! Allocate memory
+//! Returns NULL on failure (out of memory).
+//! NOTE: Memory is aligned to 32 bytes when taken from the block.
+void *Arena_Alloc(struct Arena_t *Arena, size_t Size);
+
+//! Allocate zeroed memory
+void *Arena_Calloc(struct Arena_t *Arena, size_t n, size_t Size);
+
+//! Release memory
+//! NOTE: Memory taken from the block is only released by Arena_Reset().
+void Arena_Free(struct Arena_t *Arena, void *p);
+
+/**************************************/
+//! EOF
+/**************************************/
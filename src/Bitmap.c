@@ -3,11 +3,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
 /**************************************/
 #include "Bitmap.h"
 #include "Colourspace.h"
 /**************************************/
 
+//! When not zero, input files are memory-mapped rather than read
+//! NOTE: Only available on POSIX systems.
+#if defined(__unix__) || defined(__APPLE__)
+# define BITMAP_USE_MMAP 1
+#else
+# define BITMAP_USE_MMAP 0
+#endif
+
+/**************************************/
+
 //! Clear context data
 #define CLEAR_CONTEXT(Ctx)  \
 	Ctx->Width  = 0,    \
@@ -51,6 +67,91 @@ struct BMIH_t {
 
 /**************************************/
 
+//! File contents, mapped (or read) into memory
+struct BmpFile_t {
+	const uint8_t *Data;
+	size_t Size;
+	int    Mapped; //! Data is mapped (else allocated)
+};
+
+//! Map a whole file into memory
+//! NOTE: When mapping is unavailable (or fails), the file is
+//! instead read into memory with a single read.
+static int BmpFile_Open(struct BmpFile_t *File, const char *Filename) {
+	File->Data   = NULL;
+	File->Size   = 0;
+	File->Mapped = 0;
+#if BITMAP_USE_MMAP
+	{
+		int fd = open(Filename, O_RDONLY);
+		if(fd < 0) return 0;
+		struct stat St;
+		if(fstat(fd, &St) == 0 && St.st_size > 0) {
+			void *Data = mmap(NULL, (size_t)St.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(Data != MAP_FAILED) {
+				File->Data   = Data;
+				File->Size   = (size_t)St.st_size;
+				File->Mapped = 1;
+			}
+		}
+		close(fd);
+		if(File->Mapped) return 1;
+	}
+#endif
+	FILE *f = fopen(Filename, "rb"); if(!f) return 0;
+	long Size;
+	uint8_t *Data = NULL;
+	if(fseek(f, 0, SEEK_END) == 0 && (Size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+		Data = malloc(Size);
+		if(Data && fread(Data, Size, 1, f) != 1) {
+			free(Data);
+			Data = NULL;
+		}
+	}
+	fclose(f);
+	if(!Data) return 0;
+	File->Data = Data;
+	File->Size = (size_t)Size;
+	return 1;
+}
+
+//! Unmap file
+static void BmpFile_Close(struct BmpFile_t *File) {
+#if BITMAP_USE_MMAP
+	if(File->Mapped) munmap((void*)File->Data, File->Size);
+	else
+#endif
+	free((void*)File->Data);
+	File->Data = NULL;
+}
+
+//! Convert a row of BGR pixels to BGRA
+//! NOTE: Four pixels (three words) are converted at a time. Like the
+//! header handling, this assumes a little-endian machine.
+static void Bmp_ConvertRowBGR(struct BGRA8_t *Dst, const uint8_t *Src, int w) {
+	int x;
+	for(x=0;x+4<=w;x+=4) {
+		uint32_t w0, w1, w2, p[4];
+		memcpy(&w0, Src+0, sizeof(w0));
+		memcpy(&w1, Src+4, sizeof(w1));
+		memcpy(&w2, Src+8, sizeof(w2));
+		p[0] = 0xFF000000u | w0;
+		p[1] = 0xFF000000u | (w0 >> 24) | (w1 <<  8);
+		p[2] = 0xFF000000u | (w1 >> 16) | (w2 << 16);
+		p[3] = 0xFF000000u | (w2 >>  8);
+		memcpy(Dst+x, p, sizeof(p));
+		Src += 12;
+	}
+	for(;x<w;x++) {
+		Dst[x].b = *Src++;
+		Dst[x].g = *Src++;
+		Dst[x].r = *Src++;
+		Dst[x].a = 255;
+	}
+}
+
+/**************************************/
+
 //! Create context
 int BmpCtx_Create(struct BmpCtx_t *Ctx, int w, int h, int PalCol) {
 	Ctx->Width  = w;
@@ -80,101 +181,299 @@ void BmpCtx_Destroy(struct BmpCtx_t *Ctx) {
 
 //! Load from file
 int BmpCtx_FromFile(struct BmpCtx_t *Ctx, const char *Filename) {
+	int y;
 	CLEAR_CONTEXT(Ctx);
 
-	//! Open file, read headers
-	FILE *File = fopen(Filename, "rb"); if(!File) return 0;
-	struct BMFH_t bmFH; fread(&bmFH, 1, sizeof(bmFH), File);
-	struct BMIH_t bmIH; fread(&bmIH, 1, sizeof(bmIH), File);
-	Ctx->Width  = bmIH.Width;
-	Ctx->Height = bmIH.Height;
+	//! Map file, check headers
+	struct BmpFile_t File;
+	struct BMFH_t bmFH;
+	struct BMIH_t bmIH;
+	if(!BmpFile_Open(&File, Filename)) return 0;
+	if(File.Size < sizeof(bmFH) + sizeof(bmIH)) {
+		BmpFile_Close(&File);
+		return 0;
+	}
+	memcpy(&bmFH, File.Data, sizeof(bmFH));
+	memcpy(&bmIH, File.Data + sizeof(bmFH), sizeof(bmIH));
+	int w = bmIH.Width;
+	int h = bmIH.Height;
+	size_t RowSize = ((size_t)w*bmIH.BitCnt + 31) / 32 * 4;
+	if(bmFH.Type != ('B'|'M'<<8) || (bmIH.BitCnt != 8 && bmIH.BitCnt != 24 && bmIH.BitCnt != 32) ||
+	   w <= 0 || h <= 0 || bmFH.Offs > File.Size || (File.Size - bmFH.Offs) / RowSize < (size_t)h) {
+		BmpFile_Close(&File);
+		return 0;
+	}
+	Ctx->Width  = w;
+	Ctx->Height = h;
 
 	//! Read pixels
-	int nPx = Ctx->Width*Ctx->Height;
-	if(bmFH.Type == ('B'|'M'<<8)) switch(bmIH.BitCnt) {
+	//! NOTE: Rows are padded to 4 bytes in the file; when there is
+	//! no padding, the pixels are copied over in a single block.
+	const uint8_t *Px = File.Data + bmFH.Offs;
+	switch(bmIH.BitCnt) {
 		//! 8bit palettized
 		case 8: {
 			//! Read palette
-			Ctx->ColPal = malloc(BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
+			size_t PalOffs = sizeof(struct BMFH_t) + bmIH.Size;
+			int nCol = (bmIH.ColUsed && bmIH.ColUsed < BMP_PALETTE_COLOURS) ? (int)bmIH.ColUsed : BMP_PALETTE_COLOURS;
+			if(PalOffs > File.Size || (File.Size - PalOffs) / sizeof(struct BGRA8_t) < (size_t)nCol) break;
+			Ctx->ColPal = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t));
 			if(!Ctx->ColPal) break;
-			fread(Ctx->ColPal, BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t), File);
+			memcpy(Ctx->ColPal, File.Data + PalOffs, nCol*sizeof(struct BGRA8_t));
 
 			//! Read pixels
-			fseek(File, bmFH.Offs, SEEK_SET);
-			Ctx->PxIdx = malloc(nPx * sizeof(uint8_t));
+			Ctx->PxIdx = malloc((size_t)w*h * sizeof(uint8_t));
 			if(!Ctx->PxIdx) break;
-			fread(Ctx->PxIdx, sizeof(uint8_t), nPx, File);
+			if(RowSize == (size_t)w) memcpy(Ctx->PxIdx, Px, (size_t)w*h);
+			else for(y=0;y<h;y++) memcpy(Ctx->PxIdx + (size_t)y*w, Px + y*RowSize, w);
 		} break;
 
 		//! BGR
 		case 24: {
-			struct BGRA8_t *PxBGR = Ctx->PxBGR = malloc(nPx * sizeof(struct BGRA8_t));
-			if(!PxBGR) break;
-
-			//! Convert pixels
-			int i;
-			for(i=0;i<nPx;i++) {
-				//! Read BGR
-				struct { uint8_t b, g, r; }  Col;
-				fread(&Col, 1, 3, File);
-
-				//! Store BGRA
-				PxBGR[i].b = Col.b;
-				PxBGR[i].g = Col.g;
-				PxBGR[i].r = Col.r;
-				PxBGR[i].a = 255;
-			}
+			Ctx->PxBGR = malloc((size_t)w*h * sizeof(struct BGRA8_t));
+			if(!Ctx->PxBGR) break;
+			for(y=0;y<h;y++) Bmp_ConvertRowBGR(Ctx->PxBGR + (size_t)y*w, Px + y*RowSize, w);
 		} break;
 
 		//! BGRA
+		//! NOTE: Rows are never padded.
 		case 32: {
-			//! Everything is prepared already, so straight read
-			Ctx->PxBGR = malloc(nPx * sizeof(struct BGRA8_t));
+			Ctx->PxBGR = malloc((size_t)w*h * sizeof(struct BGRA8_t));
 			if(!Ctx->PxBGR) break;
-			fread(Ctx->PxBGR, sizeof(struct BGRA8_t), nPx, File);
+			memcpy(Ctx->PxBGR, Px, (size_t)w*h * sizeof(struct BGRA8_t));
 		} break;
 	}
 
-	//! Close file, check success
-	fclose(File);
-	if(Ctx->PxBGR || (Ctx->ColPal && Ctx->PxIdx)) return 1;
+	//! Unmap file, check success
+	BmpFile_Close(&File);
+	if(Ctx->PxBGR && (bmIH.BitCnt != 8 || Ctx->ColPal)) return 1;
 	else DESTROY_AND_RETURN(Ctx, 0);
 }
+
+//! Hint that a file will be read soon
+void BmpCtx_Prefetch(const char *Filename) {
+#if BITMAP_USE_MMAP && defined(POSIX_FADV_WILLNEED)
+	int fd = open(Filename, O_RDONLY);
+	if(fd < 0) return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+#else
+	(void)Filename;
+#endif
+}
+
 /**************************************/
 
 //! Write to file
+//! NOTE: The whole file is built in memory and written at once.
 int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename) {
+	int y;
+
 	//! Check image is valid
-	int nPx = Ctx->Width*Ctx->Height;
-	if(!nPx || (!Ctx->PxBGR && !(Ctx->ColPal && Ctx->PxIdx))) return 0;
+	int w = Ctx->Width, h = Ctx->Height;
+	if(w <= 0 || h <= 0 || (!Ctx->PxBGR && !(Ctx->ColPal && Ctx->PxIdx))) return 0;
 
-	//! Open file, write headers
-	FILE *File = fopen(Filename, "wb"); if(!File) return 0;
+	//! Prepare file
+	//! NOTE: Rows are padded to 4 bytes, as per the specification
+	int    PxSize  = Ctx->ColPal ? sizeof(uint8_t) : sizeof(struct BGRA8_t);
+	size_t RowSize = ((size_t)w*PxSize + 3) &~ 3;
+	size_t PalSize = Ctx->ColPal ? BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t) : 0;
+	size_t Offs    = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + PalSize;
+	size_t Size    = Offs + RowSize*h;
+	uint8_t *Buffer = calloc(Size, sizeof(uint8_t));
+	if(!Buffer) return 0;
+
+	//! Write headers
 	struct BMFH_t bmFH; memset(&bmFH, 0, sizeof(bmFH));
 	struct BMIH_t bmIH; memset(&bmIH, 0, sizeof(bmIH));
 	bmFH.Type     = 'B'|'M'<<8;
-	bmFH.Size     = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + BMP_PALETTE_COLOURS*(Ctx->ColPal ? sizeof(struct BGRA8_t) : 0) + nPx*(Ctx->ColPal ? sizeof(uint8_t) : sizeof(struct BGRA8_t));
-	bmFH.Offs     = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + BMP_PALETTE_COLOURS*(Ctx->ColPal ? sizeof(struct BGRA8_t) : 0);
+	bmFH.Size     = Size;
+	bmFH.Offs     = Offs;
 	bmIH.Size     = sizeof(struct BMIH_t);
-	bmIH.Width    = Ctx->Width;
-	bmIH.Height   = Ctx->Height;
+	bmIH.Width    = w;
+	bmIH.Height   = h;
 	bmIH.nPlanes  = 1;
 	bmIH.BitCnt   = Ctx->ColPal ? 8 : 32;
-	fwrite(&bmFH, 1, sizeof(bmFH), File);
-	fwrite(&bmIH, 1, sizeof(bmIH), File);
+	memcpy(Buffer, &bmFH, sizeof(bmFH));
+	memcpy(Buffer + sizeof(bmFH), &bmIH, sizeof(bmIH));
 
 	//! Write palette
-	if(Ctx->ColPal) fwrite(Ctx->ColPal, BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t), File);
+	if(Ctx->ColPal) memcpy(Buffer + sizeof(bmFH) + sizeof(bmIH), Ctx->ColPal, PalSize);
 
 	//! Write pixels
-	if(Ctx->ColPal) fwrite(Ctx->PxIdx, nPx, sizeof(uint8_t), File);
-	else            fwrite(Ctx->PxBGR, nPx, sizeof(struct BGRA8_t), File);
+	const uint8_t *Px = Ctx->ColPal ? Ctx->PxIdx : (const uint8_t*)Ctx->PxBGR;
+	if(RowSize == (size_t)w*PxSize) memcpy(Buffer + Offs, Px, RowSize*h);
+	else for(y=0;y<h;y++) memcpy(Buffer + Offs + y*RowSize, Px + (size_t)y*w*PxSize, (size_t)w*PxSize);
+
+	//! Store file
+	int Ok = 0;
+	FILE *File = fopen(Filename, "wb");
+	if(File) {
+		Ok = (fwrite(Buffer, Size, 1, File) == 1);
+		if(fclose(File) != 0) Ok = 0;
+	}
+	free(Buffer);
+	return Ok;
+}
+
+/**************************************/
+
+//! Open file for streamed reading
+int BmpStream_Open(struct BmpStream_t *Stream, const char *Filename) {
+	memset(Stream, 0, sizeof(*Stream));
+
+	//! Open file, read headers
+	FILE *File = fopen(Filename, "rb"); if(!File) return 0;
+	struct BMFH_t bmFH;
+	struct BMIH_t bmIH;
+	if(fread(&bmFH, sizeof(bmFH), 1, File) != 1 || fread(&bmIH, sizeof(bmIH), 1, File) != 1 || bmFH.Type != ('B'|'M'<<8)) {
+		fclose(File);
+		return 0;
+	}
+	if(bmIH.BitCnt != 8 && bmIH.BitCnt != 24 && bmIH.BitCnt != 32) {
+		fclose(File);
+		return 0;
+	}
+	Stream->File    = File;
+	Stream->Width   = bmIH.Width;
+	Stream->Height  = bmIH.Height;
+	Stream->BitCnt  = bmIH.BitCnt;
+	Stream->RowSize = ((Stream->Width*Stream->BitCnt + 31) / 32) * 4;
+	Stream->PxOffs  = bmFH.Offs;
 
-	//! Done
-	fclose(File);
+	//! Read palette
+	if(bmIH.BitCnt == 8) {
+		int nCol = (bmIH.ColUsed && bmIH.ColUsed < BMP_PALETTE_COLOURS) ? (int)bmIH.ColUsed : BMP_PALETTE_COLOURS;
+		Stream->ColPal = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t));
+		if(!Stream->ColPal) {
+			BmpStream_Close(Stream);
+			return 0;
+		}
+		fseek(File, sizeof(struct BMFH_t) + bmIH.Size, SEEK_SET);
+		if(fread(Stream->ColPal, sizeof(struct BGRA8_t), nCol, File) != (size_t)nCol) {
+			BmpStream_Close(Stream);
+			return 0;
+		}
+	}
+
+	//! Prepare for reading rows
+	Stream->RowBuffer = malloc(Stream->RowSize);
+	if(!Stream->RowBuffer || !BmpStream_Rewind(Stream)) {
+		BmpStream_Close(Stream);
+		return 0;
+	}
+	return 1;
+}
+
+/**************************************/
+
+//! Create file for streamed writing
+int BmpStream_Create(struct BmpStream_t *Stream, const char *Filename, int w, int h, const struct BGRA8_t *ColPal) {
+	memset(Stream, 0, sizeof(*Stream));
+	Stream->Width   = w;
+	Stream->Height  = h;
+	Stream->BitCnt  = 8;
+	Stream->RowSize = (w + 3) &~ 3;
+	Stream->PxOffs  = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t);
+
+	//! Open file, write headers
+	//! NOTE: Rows are padded to 4 bytes, as per the specification
+	Stream->RowBuffer = calloc(Stream->RowSize, sizeof(uint8_t));
+	if(!Stream->RowBuffer) return 0;
+	FILE *File = Stream->File = fopen(Filename, "wb");
+	if(!File) {
+		BmpStream_Close(Stream);
+		return 0;
+	}
+	struct BMFH_t bmFH; memset(&bmFH, 0, sizeof(bmFH));
+	struct BMIH_t bmIH; memset(&bmIH, 0, sizeof(bmIH));
+	bmFH.Type     = 'B'|'M'<<8;
+	bmFH.Size     = Stream->PxOffs + (long)Stream->RowSize*h;
+	bmFH.Offs     = Stream->PxOffs;
+	bmIH.Size     = sizeof(struct BMIH_t);
+	bmIH.Width    = w;
+	bmIH.Height   = h;
+	bmIH.nPlanes  = 1;
+	bmIH.BitCnt   = 8;
+	if(fwrite(&bmFH, sizeof(bmFH), 1, File) != 1 ||
+	   fwrite(&bmIH, sizeof(bmIH), 1, File) != 1 ||
+	   fwrite(ColPal, sizeof(struct BGRA8_t), BMP_PALETTE_COLOURS, File) != BMP_PALETTE_COLOURS) {
+		BmpStream_Close(Stream);
+		return 0;
+	}
+	return 1;
+}
+
+/**************************************/
+
+//! Create a context to read bands into
+int BmpStream_CreateBand(const struct BmpStream_t *Stream, struct BmpCtx_t *Band, int h) {
+	if(!BmpCtx_Create(Band, Stream->Width, h, Stream->ColPal ? BMP_PALETTE_COLOURS : 0)) return 0;
+	if(Stream->ColPal) memcpy(Band->ColPal, Stream->ColPal, BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t));
 	return 1;
 }
 
+/**************************************/
+
+//! Seek back to the first row
+int BmpStream_Rewind(struct BmpStream_t *Stream) {
+	return fseek(Stream->File, Stream->PxOffs, SEEK_SET) == 0;
+}
+
+/**************************************/
+
+//! Read rows
+int BmpStream_ReadRows(struct BmpStream_t *Stream, struct BmpCtx_t *Band, int nRows) {
+	int y;
+	int w = Stream->Width;
+	Band->Height = nRows;
+	for(y=0;y<nRows;y++) {
+		const uint8_t *Src = Stream->RowBuffer;
+		if(fread(Stream->RowBuffer, Stream->RowSize, 1, Stream->File) != 1) return 0;
+		switch(Stream->BitCnt) {
+			//! 8bit palettized
+			case 8: {
+				memcpy(Band->PxIdx + y*w, Src, w);
+			} break;
+
+			//! BGR
+			case 24: {
+				Bmp_ConvertRowBGR(Band->PxBGR + y*w, Src, w);
+			} break;
+
+			//! BGRA
+			case 32: {
+				memcpy(Band->PxBGR + y*w, Src, w*sizeof(struct BGRA8_t));
+			} break;
+		}
+	}
+	return 1;
+}
+
+/**************************************/
+
+//! Write rows
+int BmpStream_WriteRows(struct BmpStream_t *Stream, const uint8_t *PxIdx, int nRows) {
+	int y;
+	for(y=0;y<nRows;y++) {
+		memcpy(Stream->RowBuffer, PxIdx + y*Stream->Width, Stream->Width);
+		if(fwrite(Stream->RowBuffer, Stream->RowSize, 1, Stream->File) != 1) return 0;
+	}
+	return 1;
+}
+
+/**************************************/
+
+//! Close file
+int BmpStream_Close(struct BmpStream_t *Stream) {
+	int Ok = 1;
+	if(Stream->File && fclose(Stream->File) != 0) Ok = 0;
+	free(Stream->ColPal);
+	free(Stream->RowBuffer);
+	memset(Stream, 0, sizeof(*Stream));
+	return Ok;
+}
+
 /**************************************/
 //! EOF
 /**************************************/
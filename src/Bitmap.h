@@ -2,6 +2,7 @@
 #pragma once
 /**************************************/
 #include <stdint.h>
+#include <stdio.h>
 /**************************************/
 #include "Colourspace.h"
 /**************************************/
@@ -17,6 +18,19 @@ struct BmpCtx_t {
 	};
 };
 
+//! Streamed file
+//! This reads or writes an image a few rows at a time, so that
+//! images larger than memory can be processed in bands.
+struct BmpStream_t {
+	FILE *File;
+	int   Width, Height;
+	int   BitCnt;
+	int   RowSize;              //! Bytes per row (including padding)
+	long  PxOffs;               //! File offset of the pixel data
+	struct BGRA8_t *ColPal;     //! Palette (8bit only)
+	uint8_t        *RowBuffer;  //! Row being read/written
+};
+
 /**************************************/
 
 //! Create context
@@ -31,11 +45,42 @@ void BmpCtx_Destroy(struct BmpCtx_t *Ctx);
 //! NOTE: This internally creates the context
 int BmpCtx_FromFile(struct BmpCtx_t *Ctx, const char *Filename);
 
+//! Hint that a file will be read soon
+//! The system may then start reading it in the background (eg. while
+//! processing another image), so that the later load doesn't wait on
+//! the disk. Does nothing where this is not supported.
+void BmpCtx_Prefetch(const char *Filename);
+
 //! Write to file
 //! To write a BGRA image, set ColPal=nullptr
 //! NOTE: Always 32bit BGRA; 24bit BGR is never used for output
 int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename);
 
+//! Open file for streamed reading
+//! NOTE: 8bit palettized, 24bit BGR and 32bit BGRA are supported.
+int BmpStream_Open(struct BmpStream_t *Stream, const char *Filename);
+
+//! Create file for streamed writing
+//! NOTE: Always 8bit palettized, with BMP_PALETTE_COLOURS colours.
+int BmpStream_Create(struct BmpStream_t *Stream, const char *Filename, int w, int h, const struct BGRA8_t *ColPal);
+
+//! Create a context to read bands of (up to) h rows into
+//! NOTE: The palette is copied for 8bit files.
+int BmpStream_CreateBand(const struct BmpStream_t *Stream, struct BmpCtx_t *Band, int h);
+
+//! Seek back to the first row
+int BmpStream_Rewind(struct BmpStream_t *Stream);
+
+//! Read the next nRows rows into Band (setting Band->Height)
+int BmpStream_ReadRows(struct BmpStream_t *Stream, struct BmpCtx_t *Band, int nRows);
+
+//! Write the next nRows rows of palette indices
+int BmpStream_WriteRows(struct BmpStream_t *Stream, const uint8_t *PxIdx, int nRows);
+
+//! Close file
+//! Returns 0 if the file could not be finalized (eg. write error).
+int BmpStream_Close(struct BmpStream_t *Stream);
+
 /**************************************/
 //! EOF
 /**************************************/
@@ -1,19 +1,69 @@
 /**************************************/
 #include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 /**************************************/
 #include "Colourspace.h"
 #include "Dither.h"
 #include "Qualetize.h"
+#include "Quantize.h"
+#include "Threads.h"
 /**************************************/
 
+//! When not zero, ordered dithering and range reduction of runs
+//! of pixels use SSE2. Setting this to 0 forces the plain scalar
+//! code (which gives exactly the same results).
+#ifndef DITHER_USE_SIMD
+# define DITHER_USE_SIMD 1
+#endif
+
+/**************************************/
+#if DITHER_USE_SIMD && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+# define DITHER_SSE2 1
+# include <emmintrin.h>
+#endif
+/**************************************/
+#define ALIGN2N(x,N) (((x) + (N)-1) &~ ((N)-1))
+#define DATA_ALIGNMENT 32
+#define DATA_ALIGN(x) ALIGN2N((uintptr_t)(x), DATA_ALIGNMENT) //! NOTE: Cast to uintptr_t
+/**************************************/
+
+//! Palette match cache
+//! Without dithering (and with ordered dithering), the colour that is
+//! matched against a tile palette depends only on the source colour, the
+//! palette, and the dither threshold, so the results are cached in a
+//! direct-mapped table keyed on these. This is only used once at least
+//! MATCHCACHE_MIN_PIXELS pixels have been processed, so that small images
+//! don't pay for clearing the table.
+//! Entries are stored as {Colour:32, 0:4, Palette:8, Threshold:12, Index:8},
+//! so the empty marker (all bits set) never matches a valid key.
+#define MATCHCACHE_SIZE_LOG2  14
+#define MATCHCACHE_MIN_PIXELS 65536
+#define MATCHCACHE_EMPTY      (~(uint64_t)0)
+
+//! Maximum number of pixels processed by the run kernels at once
+#define DITHER_RUN_LENGTH 64
+
+/**************************************/
+
+//! Get the first palette entry considered for matching
+//! NOTE: With unused entries, the last of these (usually a transparent
+//! entry) can still be matched, so that transparent pixels map to it.
+static inline int GetPaletteMatchStart(int PalUnused) {
+	return (PalUnused > 0) ? (PalUnused-1) : 0;
+}
+
 //! Palette entry matching
+//! NOTE: This is the reference implementation, used when the YUVA palette
+//! table could not be allocated; the table search returns the same index.
 static int FindPaletteEntry(const struct BGRAf_t *Px, const struct BGRAf_t *Pal, int MaxPalSize, int PalUnused) {
 	int   i;
 	int   MinIdx = 0;
 	float MinDst = INFINITY;
 	struct BGRAf_t PxYUV = BGRAf_AsYUV(Px), PalYUV;
-	for(i=PalUnused-1;i<MaxPalSize;i++) {
+	for(i=GetPaletteMatchStart(PalUnused);i<MaxPalSize;i++) {
 		PalYUV = BGRAf_AsYUV(&Pal[i]);
 		float Dst = BGRAf_ColDistance(&PxYUV, &PalYUV);
 		if(Dst < MinDst) MinIdx = i, MinDst = Dst;
@@ -21,55 +71,294 @@ static int FindPaletteEntry(const struct BGRAf_t *Px, const struct BGRAf_t *Pal,
 	return MinIdx;
 }
 
+//! Get the ordered dithering threshold index of a pixel
+static inline int GetDitherThreshold(int x, int y, int DitherType) {
+	int Threshold = 0, xKey = x, yKey = x^y;
+	int Bit = DitherType-1; do {
+		Threshold = Threshold*2 + (yKey & 1), yKey >>= 1; //! <- Hopefully turned into "SHR, ADC"
+		Threshold = Threshold*2 + (xKey & 1), xKey >>= 1;
+	} while(--Bit >= 0);
+	return Threshold;
+}
+
+//! Get the ordered dithering threshold indices of a run of pixels
+static inline void GetDitherThresholds(const struct DitherState_t *State, int *Dst, int x, int y, int n) {
+	int DitherType = State->DitherType;
+	if(State->DitherMatrix) {
+		int Mask = (1 << DitherType) - 1;
+		const uint16_t *Row = State->DitherMatrix + ((y & Mask) << DitherType);
+		while(n--) *Dst++ = Row[x++ & Mask];
+	} else {
+		while(n--) *Dst++ = GetDitherThreshold(x++, y, DitherType);
+	}
+}
+
 /**************************************/
 
-//! Handle conversion of image with given palette, return RMS error
-struct BGRAf_t DitherImage(
-	const struct BmpCtx_t *Image,
+//! Check if a dither mode uses error diffusion
+static inline int DitherIsDiffusion(int DitherType) {
+	return DitherType == DITHER_FLOYDSTEINBERG || DitherType == DITHER_FLOYDSTEINBERG_TILE;
+}
+
+//! Apply diffusion error to a pixel
+static inline struct BGRAf_t DiffusePixel(const struct BGRAf_t *Px, const struct BGRAf_t *Diffusion, float DitherLevel) {
+	struct BGRAf_t t = *Diffusion;
+#ifdef DITHER_NO_ALPHA
+	t.a = 0.0f;
+#endif
+	t = BGRAf_Muli(&t, DitherLevel);
+	return BGRAf_Add(Px, &t);
+}
+
+//! Distribute the error of pixel x to its neighbours
+//! NOTE: With tile-local diffusion, Left/Right/Down are 0 when the
+//! respective neighbours lie in another tile (and are skipped).
+static inline void DiffuseError(
+	struct BGRAf_t *DiffuseThisLine,
+	struct BGRAf_t *DiffuseNextLine,
+	int x,
+	const struct BGRAf_t *Error,
+	int Left,
+	int Right,
+	int Down
+) {
+	struct BGRAf_t t;
+
+	//! {x+1,y} @ 7/16
+	if(Right) {
+		t = BGRAf_Muli(Error, 7.0f/16);
+		DiffuseThisLine[x+1] = BGRAf_Add(&DiffuseThisLine[x+1], &t);
+	}
+	if(Down) {
+		//! {x-1,y+1} @ 3/16
+		if(Left) {
+			t = BGRAf_Muli(Error, 3.0f/16);
+			DiffuseNextLine[x-1] = BGRAf_Add(&DiffuseNextLine[x-1], &t);
+		}
+
+		//! {x+0,y+1} @ 5/16
+		t = BGRAf_Muli(Error, 5.0f/16);
+		DiffuseNextLine[x+0] = BGRAf_Add(&DiffuseNextLine[x+0], &t);
+
+		//! {x+1,y+1} @ 1/16
+		if(Right) {
+			t = BGRAf_Muli(Error, 1.0f/16);
+			DiffuseNextLine[x+1] = BGRAf_Add(&DiffuseNextLine[x+1], &t);
+		}
+	}
+}
+
+/**************************************/
+
+//! Apply ordered dithering to a run of pixels
+//! Dst[i] = Src[i] + Spread*(Threshold[i]/2^(2*DitherType) - 0.5)
+//! NOTE: Passing Threshold=NULL converts the pixels without dithering.
+#ifdef DITHER_SSE2
+static inline __m128 DitherImage_LoadBGRA8(const struct BGRA8_t *x) {
+	uint32_t v;
+	memcpy(&v, x, sizeof(v));
+	__m128i Zero = _mm_setzero_si128();
+	__m128i i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)v), Zero), Zero);
+	return _mm_cvtepi32_ps(i);
+}
+#endif
+static void DitherImage_OrderedRun(
+	struct BGRAf_t *Dst,
+	const struct BGRA8_t *Src,
+	const int *Threshold,
+	const struct BGRAf_t *Spread,
+	int DitherType,
+	int n
+) {
+	int i;
+	float Scale = 1.0f / (1 << (2*DitherType));
+#ifdef DITHER_SSE2
+	const __m128 Max = _mm_set1_ps(255.0f);
+	const __m128 s   = Threshold ? _mm_loadu_ps(&Spread->b) : _mm_setzero_ps();
+	for(i=0;i<n;i++) {
+		__m128 Px = _mm_div_ps(DitherImage_LoadBGRA8(&Src[i]), Max);
+		if(Threshold) {
+			float fThres = Threshold[i] * Scale - 0.5f;
+			Px = _mm_add_ps(Px, _mm_mul_ps(s, _mm_set1_ps(fThres)));
+		}
+		_mm_storeu_ps(&Dst[i].b, Px);
+	}
+#else
+	for(i=0;i<n;i++) {
+		Dst[i] = BGRAf_FromBGRA8(&Src[i]);
+		if(Threshold) {
+			float fThres = Threshold[i] * Scale - 0.5f;
+			struct BGRAf_t DitherVal = BGRAf_Muli(Spread, fThres);
+			Dst[i] = BGRAf_Add(&Dst[i], &DitherVal);
+		}
+	}
+#endif
+}
+
+//! Range-reduce a run of dithered pixels, and accumulate their error
+//! Px[] is replaced with the reduced pixels, which are also stored to
+//! PxBGRA8[] (as range-reduced values) when this is not NULL.
+static struct BGRAf_t DitherImage_ReduceRun(
+	struct BGRAf_t *Px,
+	struct BGRA8_t *PxBGRA8,
+	const struct BGRA8_t *Src,
 	const struct BGRA8_t *BitRange,
-	struct BGRAf_t *RawPxOutput,
+	int n,
+	struct BGRAf_t RMSE
+) {
+	int i;
+#ifdef DITHER_SSE2
+	const __m128 Max   = _mm_set1_ps(255.0f);
+	const __m128 Half  = _mm_set1_ps(0.5f);
+	const __m128 Zero  = _mm_setzero_ps();
+	const __m128 Range = DitherImage_LoadBGRA8(BitRange);
+	__m128 Sum = _mm_loadu_ps(&RMSE.b);
+	for(i=0;i<n;i++) {
+		__m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&Px[i].b), Range), Half);
+		v = _mm_min_ps(_mm_max_ps(v, Zero), Range);
+		__m128i q = _mm_cvttps_epi32(v);
+		if(PxBGRA8) {
+			__m128i w = _mm_packs_epi32(q, q);
+			uint32_t t = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+			memcpy(&PxBGRA8[i], &t, sizeof(t));
+		}
+		v = _mm_div_ps(_mm_cvtepi32_ps(q), Range);
+		_mm_storeu_ps(&Px[i].b, v);
+		__m128 e = _mm_sub_ps(_mm_div_ps(DitherImage_LoadBGRA8(&Src[i]), Max), v);
+		Sum = _mm_add_ps(Sum, _mm_mul_ps(e, e));
+	}
+	_mm_storeu_ps(&RMSE.b, Sum);
+#else
+	for(i=0;i<n;i++) {
+		struct BGRA8_t t = BGRA_FromBGRAf(&Px[i], BitRange);
+		Px[i] = BGRAf_FromBGRA(&t, BitRange);
+		if(PxBGRA8) PxBGRA8[i] = t;
+		struct BGRAf_t Error = BGRAf_FromBGRA8(&Src[i]);
+		Error = BGRAf_Sub(&Error, &Px[i]);
+		Error = BGRAf_Mul(&Error, &Error);
+		RMSE  = BGRAf_Add(&RMSE, &Error);
+	}
+#endif
+	return RMSE;
+}
+
+//! Match a (dithered) pixel against a tile palette, returning the palette-relative index
+//! p is the source pixel and Threshold the dithering threshold index, used for
+//! the match cache (MatchCache may be NULL).
+static inline int MatchPaletteEntry(
+	const struct DitherState_t *State,
+	const struct BGRAf_t *Px,
+	struct BGRA8_t p,
+	int Threshold,
+	int TilePalIdx,
+	uint64_t *MatchCache
+) {
+	int PalIdx = -1;
+	uint64_t CacheKey = 0, *CacheEntry = NULL;
+	if(MatchCache) {
+		uint32_t Col = (uint32_t)p.b | (uint32_t)p.g<<8 | (uint32_t)p.r<<16 | (uint32_t)p.a<<24;
+		uint32_t Aux = (uint32_t)TilePalIdx<<20 | (uint32_t)Threshold<<8;
+		uint32_t h = (Col ^ (Aux * 0x85EBCA77u)) * 0x9E3779B1u;
+		CacheKey   = (uint64_t)Col<<32 | Aux;
+		CacheEntry = &MatchCache[h >> (32-MATCHCACHE_SIZE_LOG2)];
+		if((*CacheEntry &~ (uint64_t)0xFF) == CacheKey) return (int)(*CacheEntry & 0xFF);
+	}
+	if(State->PalMatch) {
+		struct BGRAf_t PxYUV = BGRAf_AsYUV(Px);
+		PalIdx = State->FindNearest(&PxYUV, &State->PalMatch[TilePalIdx]);
+		PalIdx = (PalIdx < 0) ? 0 : (State->PalMatchStart + PalIdx); //! <- Same as FindPaletteEntry() when nothing matches
+	} else PalIdx = FindPaletteEntry(Px, State->TilePalettes + TilePalIdx*State->MaxPalSize, State->MaxPalSize, State->PalUnused);
+	if(CacheEntry) *CacheEntry = CacheKey | (uint64_t)PalIdx;
+	return PalIdx;
+}
+
+/**************************************/
 
+//! Begin dithering an image in bands of rows
+void DitherImage_Begin(
+	struct DitherState_t *State,
+	int ImgW,
+	const struct BGRA8_t *BitRange,
 	int TileW,
 	int TileH,
 	int MaxTilePals,
 	int MaxPalSize,
 	int PalUnused,
-	const int32_t *TilePalIndices,
 	const struct BGRAf_t *TilePalettes,
-	uint8_t *TilePxOutput,
-
 	int   DitherType,
 	float DitherLevel,
-	struct BGRAf_t *DiffusionBuffer
+	struct BGRAf_t *DiffusionBuffer,
+	struct ThreadPool_t *Pool,
+	struct Arena_t *Arena
 ) {
 	int i;
 
-	//! Get parameters, pointers, etc.
-	int x, y;
-	int ImgW = Image->Width;
-	int ImgH = Image->Height;
-#if MEASURE_PSNR
-	      struct BGRAf_t  RMSE     = (struct BGRAf_t){0,0,0,0};
-#endif
-	const        uint8_t *PxSrcIdx = Image->ColPal ? Image->PxIdx  : NULL;
-	const struct BGRA8_t *PxSrcBGR = Image->ColPal ? Image->ColPal : Image->PxBGR;
+	//! Store parameters
+	State->BitRange     = BitRange;
+	State->ImgW         = ImgW;
+	State->TileW        = TileW;
+	State->TileH        = TileH;
+	State->nTilePals    = MaxTilePals;
+	State->MaxPalSize   = MaxPalSize;
+	State->PalUnused    = PalUnused;
+	State->TilePalettes = TilePalettes;
+	State->DitherType   = DitherType;
+	State->DitherLevel  = DitherLevel;
+	if(DitherType == DITHER_FLOYDSTEINBERG_TILE && (TileW <= 0 || TileH <= 0)) {
+		State->DitherType = DitherType = DITHER_FLOYDSTEINBERG; //! <- No tiles to confine diffusion to
+	}
+	State->Pool         = Pool;
+	State->Arena        = Arena;
+	State->y            = 0;
+	State->ErrorSum     = (struct BGRAf_t){0,0,0,0};
+	State->PalMatchStart  = 0;
+	State->PalMatch       = NULL;
+	State->FindNearest    = NULL;
+	State->PalMatchBuffer = NULL;
+	State->MatchCache     = NULL;
+	State->DitherMatrix   = NULL;
+
+	//! Convert the tile palettes to YUVA in structure-of-arrays layout
+	//! NOTE: On failure, we fall back to FindPaletteEntry().
+	if(TilePalettes) {
+		int Start = GetPaletteMatchStart(PalUnused);
+		int nCol  = MaxPalSize - Start;
+		int nSize = QuantCluster_CentroidsGetSize(nCol);
+		State->PalMatchBuffer = Arena_Alloc(State->Arena,
+			DATA_ALIGNMENT-1                                                + //! Rounding
+			DATA_ALIGN(MaxTilePals*sizeof(struct QuantCluster_Centroids_t)) + //! PalMatch
+			DATA_ALIGN(nCol*sizeof(struct BGRAf_t))                         + //! PalYUV
+			MaxTilePals*DATA_ALIGN(nSize*sizeof(float))                       //! Centroid data
+		);
+		if(State->PalMatchBuffer) {
+			struct QuantCluster_Centroids_t *PalMatch = (struct QuantCluster_Centroids_t*)DATA_ALIGN(State->PalMatchBuffer);
+			struct BGRAf_t *PalYUV = (struct BGRAf_t*)DATA_ALIGN(PalMatch + MaxTilePals);
+			float *Data = (float*)DATA_ALIGN(PalYUV + nCol);
+			for(i=0;i<MaxTilePals;i++) {
+				int n;
+				for(n=0;n<nCol;n++) PalYUV[n] = BGRAf_AsYUV(&TilePalettes[i*MaxPalSize + Start+n]);
+				QuantCluster_CentroidsFromColours(&PalMatch[i], Data, PalYUV, nCol);
+				Data = (float*)DATA_ALIGN(Data + nSize);
+			}
+			State->PalMatch      = PalMatch;
+			State->PalMatchStart = Start;
+			State->FindNearest   = QuantCluster_GetFindNearest();
+		}
+	}
 
 	//! Initialize dither patterns
 	//! For Floyd-Steinberg dithering, we only keep track of two scanlines
 	//! of diffusion error (the current line and the next), and just swap
 	//! back-and-forth between them to avoid a memcpy(). We also append an
 	//! extra 2 pixels at the end of each line to avoid extra comparisons.
-	union {
-		struct BGRAf_t *DiffuseError;  //! DITHER_FLOYDSTEINBERG only
-		struct BGRAf_t *PaletteSpread; //! DITHER_ORDERED only
-		void *DataPtr;
-	} Dither;
-	Dither.DataPtr = DiffusionBuffer;
+	State->PaletteSpread   = DiffusionBuffer;
+	State->DiffuseThisLine = DiffusionBuffer + 1;                       //! <- 1px padding on left
+	State->DiffuseNextLine = State->DiffuseThisLine + (ImgW+1);         //! <- 1px padding on right
 	if(DitherType != DITHER_NONE) {
-		if(DitherType == DITHER_FLOYDSTEINBERG) {
+		if(DitherIsDiffusion(DitherType)) {
 			//! Error diffusion dithering
-			for(i=0;i<(ImgW+2)*2;i++) Dither.DiffuseError[i] = (struct BGRAf_t){0,0,0,0};
-		} else if(TilePxOutput) {
+			for(i=0;i<(ImgW+2)*2;i++) DiffusionBuffer[i] = (struct BGRAf_t){0,0,0,0};
+		} else if(TilePalettes) {
 			//! Ordered dithering (with tile palettes)
 			for(i=0;i<MaxTilePals;i++) {
 				//! Find the mean values of this palette
@@ -96,114 +385,542 @@ struct BGRAf_t DitherImage(
 #ifdef DITHER_NO_ALPHA
 				Spread.a = 0.0f;
 #endif
-				Dither.PaletteSpread[i] = BGRAf_Muli(&Spread, DitherLevel);
+				State->PaletteSpread[i] = BGRAf_Muli(&Spread, DitherLevel);
 			}
 		} else {
 			//! "Real" ordered dithering (without tile palettes)
 			static const struct BGRA8_t MinValue = {1,1,1,1};
 			struct BGRAf_t Spread = BGRAf_FromBGRA(&MinValue, BitRange);
-			Dither.PaletteSpread[0] = BGRAf_Muli(&Spread, DitherLevel);
+			State->PaletteSpread[0] = BGRAf_Muli(&Spread, DitherLevel);
+		}
+
+		//! Build the threshold matrix for ordered dithering
+		//! NOTE: On failure, thresholds are computed per pixel.
+		if(!DitherIsDiffusion(DitherType)) {
+			int x, y, Size = 1 << DitherType;
+			State->DitherMatrix = Arena_Alloc(State->Arena, Size*Size*sizeof(uint16_t));
+			if(State->DitherMatrix) for(y=0;y<Size;y++) for(x=0;x<Size;x++) {
+				State->DitherMatrix[y*Size+x] = GetDitherThreshold(x, y, DitherType);
+			}
 		}
 	}
+}
+
+/**************************************/
+
+//! Tile-major processing of a band (without error diffusion)
+//! Tiles are split into tasks of a fixed size, and the error of every
+//! task is summed separately and then reduced in order, so that results
+//! don't depend on the number of threads.
+#define TILES_PER_TASK 16
+struct DitherImage_TilePass_t {
+	const struct DitherState_t *State;
+	const struct BmpCtx_t *Band;
+	const int32_t *TilePalIndices;
+	uint8_t       *TilePxOutput;
+	const int32_t *TileCount;
+	int nTiles;
+	struct BGRAf_t *TaskError; //! [nTasks]
+	struct BGRAf_t *Diffusion; //! [nThreads][2][TileW+2] (tile-local diffusion only)
+};
+
+//! Dither a tile with tile-local error diffusion, returning its error
+static struct BGRAf_t DitherImage_DiffuseTile(
+	const struct DitherImage_TilePass_t *Pass,
+	int t,
+	int ThreadIdx
+) {
+	int x, y;
+	const struct DitherState_t *State = Pass->State;
+	int ImgW  = State->ImgW;
+	int TileW = State->TileW;
+	int TileH = State->TileH;
+	int MaxPalSize = State->MaxPalSize;
+	int TilePalIdx = Pass->TilePalIndices[t];
+	const        uint8_t *PxSrcIdx = Pass->Band->ColPal ? Pass->Band->PxIdx  : NULL;
+	const struct BGRA8_t *PxSrcBGR = Pass->Band->ColPal ? Pass->Band->ColPal : Pass->Band->PxBGR;
+	const struct BGRAf_t *Palette  = State->TilePalettes + TilePalIdx*MaxPalSize;
+	int Count = Pass->TileCount ? Pass->TileCount[t] : 1;
+	int x0 = (t % (ImgW / TileW)) * TileW;
+	int y0 = (t / (ImgW / TileW)) * TileH;
+
+	//! Clear diffusion lines
+	struct BGRAf_t *DiffuseThisLine = Pass->Diffusion + ThreadIdx*(TileW+2)*2 + 1;
+	struct BGRAf_t *DiffuseNextLine = DiffuseThisLine + (TileW+2);
+	for(x=-1;x<=TileW;x++) {
+		DiffuseThisLine[x] = DiffuseNextLine[x] = (struct BGRAf_t){0,0,0,0};
+	}
 
-	//! Begin processing of pixels
-	int TileHeightCounter = TileH;
-	struct BGRAf_t *DiffuseThisLine = Dither.DiffuseError + 1;    //! <- 1px padding on left
-	struct BGRAf_t *DiffuseNextLine = DiffuseThisLine + (ImgW+1); //! <- 1px padding on right
 	struct BGRAf_t RMSE = (struct BGRAf_t){0,0,0,0};
-	for(y=0;y<ImgH;y++) {
-		int TilePalIdx = 0;
-		int TileWidthCounter = 0;
-		for(x=0;x<ImgW;x++) {
-			//! Advance tile palette index
-			if(TilePxOutput && --TileWidthCounter <= 0) {
-				TilePalIdx = *TilePalIndices++;
-				TileWidthCounter = TileW;
-			}
+	for(y=0;y<TileH;y++) {
+		for(x=0;x<TileW;x++) {
+			//! Read original pixel data, and adjust for diffusion error
+			int Offs = (y0+y)*ImgW + (x0+x);
+			struct BGRA8_t p = PxSrcIdx ? PxSrcBGR[PxSrcIdx[Offs]] : PxSrcBGR[Offs];
+			struct BGRAf_t Px_Original = BGRAf_FromBGRA8(&p);
+			struct BGRAf_t Px = DiffusePixel(&Px_Original, &DiffuseThisLine[x], State->DitherLevel);
 
-			//! Get pixel and apply dithering
-			struct BGRAf_t Px, Px_Original; {
-				//! Read original pixel data
-				struct BGRA8_t p;
-				if(PxSrcIdx) p = PxSrcBGR[*PxSrcIdx++];
-				else         p = *PxSrcBGR++;
-				Px = Px_Original = BGRAf_FromBGRA8(&p);
-			}
-			if(DitherType != DITHER_NONE) {
-				if(DitherType == DITHER_FLOYDSTEINBERG) {
-					//! Adjust for diffusion error
-					struct BGRAf_t t = DiffuseThisLine[x];
-#ifdef DITHER_NO_ALPHA
-					t.a = 0.0f;
-#endif
-					t  = BGRAf_Muli(&t, DitherLevel);
-					Px = BGRAf_Add (&Px, &t);
-				} else {
-					//! Adjust for dither matrix
-					int Threshold = 0, xKey = x, yKey = x^y;
-					int Bit = DitherType-1; do {
-						Threshold = Threshold*2 + (yKey & 1), yKey >>= 1; //! <- Hopefully turned into "SHR, ADC"
-						Threshold = Threshold*2 + (xKey & 1), xKey >>= 1;
-					} while(--Bit >= 0);
-					float fThres = Threshold * (1.0f / (1 << (2*DitherType))) - 0.5f;
-					struct BGRAf_t DitherVal = BGRAf_Muli(&Dither.PaletteSpread[TilePalIdx], fThres);
-					Px = BGRAf_Add(&Px, &DitherVal);
-				}
-			}
+			//! Find matching palette entry, store to output, and diffuse error
+			int PalIdx = MatchPaletteEntry(State, &Px, p, 0, TilePalIdx, NULL);
+			Pass->TilePxOutput[Offs] = PalIdx + TilePalIdx*MaxPalSize;
+			struct BGRAf_t Error = BGRAf_Sub(&Px_Original, &Palette[PalIdx]);
+			DiffuseError(DiffuseThisLine, DiffuseNextLine, x, &Error, x > 0, x+1 < TileW, y+1 < TileH);
+
+			//! Accumulate error for RMS calculation
+			Error = BGRAf_Mul(&Error, &Error);
+			if(Count != 1) Error = BGRAf_Muli(&Error, (float)Count);
+			RMSE  = BGRAf_Add(&RMSE, &Error);
+		}
+
+		//! Swap diffusion lines and clear the next one
+		struct BGRAf_t *Tmp = DiffuseThisLine;
+		DiffuseThisLine = DiffuseNextLine;
+		DiffuseNextLine = Tmp;
+		for(x=-1;x<=TileW;x++) DiffuseNextLine[x] = (struct BGRAf_t){0,0,0,0};
+	}
+	return RMSE;
+}
+
+static void DitherImage_TileTask(void *Arg, int TaskIdx, int ThreadIdx) {
+	int t, x, y;
+	const struct DitherImage_TilePass_t *Pass = Arg;
+	const struct DitherState_t *State = Pass->State;
+	int ImgW   = State->ImgW;
+	int TileW  = State->TileW;
+	int TileH  = State->TileH;
+	int TilesX = ImgW / TileW;
+	int MaxPalSize = State->MaxPalSize;
+	int DitherType = State->DitherType;
+	const        uint8_t *PxSrcIdx = Pass->Band->ColPal ? Pass->Band->PxIdx  : NULL;
+	const struct BGRA8_t *PxSrcBGR = Pass->Band->ColPal ? Pass->Band->ColPal : Pass->Band->PxBGR;
+	uint64_t *MatchCache = State->MatchCache ? State->MatchCache + ((size_t)ThreadIdx << MATCHCACHE_SIZE_LOG2) : NULL;
+
+	struct BGRAf_t RMSE = (struct BGRAf_t){0,0,0,0};
+	int TileEnd = (TaskIdx+1)*TILES_PER_TASK; if(TileEnd > Pass->nTiles) TileEnd = Pass->nTiles;
+	for(t=TaskIdx*TILES_PER_TASK;t<TileEnd;t++) {
+		//! Skip duplicate tiles
+		int Count = Pass->TileCount ? Pass->TileCount[t] : 1;
+		if(!Count) continue;
+
+		//! Tile-local diffusion is handled separately
+		if(DitherType == DITHER_FLOYDSTEINBERG_TILE) {
+			struct BGRAf_t Error = DitherImage_DiffuseTile(Pass, t, ThreadIdx);
+			RMSE = BGRAf_Add(&RMSE, &Error);
+			continue;
+		}
+
+		int TilePalIdx = Pass->TilePalIndices[t];
+		const struct BGRAf_t *Palette = State->TilePalettes + TilePalIdx*MaxPalSize;
+		int x0 = (t % TilesX) * TileW;
+		int y0 = (t / TilesX) * TileH;
+		for(y=y0;y<y0+TileH;y++) for(x=x0;x<x0+TileW;x+=DITHER_RUN_LENGTH) {
+			int i, n = x0+TileW - x; if(n > DITHER_RUN_LENGTH) n = DITHER_RUN_LENGTH;
+			struct BGRA8_t p[DITHER_RUN_LENGTH];
+			struct BGRAf_t Px[DITHER_RUN_LENGTH];
+			int Threshold[DITHER_RUN_LENGTH];
 
-			//! Find matching palette entry, store to output, and get error
-			if(TilePxOutput) {
-				int PalIdx  = FindPaletteEntry(&Px, TilePalettes + TilePalIdx*MaxPalSize, MaxPalSize, PalUnused);
-				    PalIdx += TilePalIdx*MaxPalSize;
-				*TilePxOutput++ = PalIdx;
-				Px = TilePalettes[PalIdx];
+			//! Read original pixel data, and apply dither matrix
+			int Offs = y*ImgW + x;
+			if(PxSrcIdx) for(i=0;i<n;i++) p[i] = PxSrcBGR[PxSrcIdx[Offs+i]];
+			else         for(i=0;i<n;i++) p[i] = PxSrcBGR[Offs+i];
+			if(DitherType != DITHER_NONE) {
+				GetDitherThresholds(State, Threshold, x, State->y+y, n);
+				DitherImage_OrderedRun(Px, p, Threshold, &State->PaletteSpread[TilePalIdx], DitherType, n);
 			} else {
-				//! Reduce range when not using tile output
-				struct BGRA8_t t = BGRA_FromBGRAf(&Px, BitRange);
-				Px = BGRAf_FromBGRA(&t, BitRange);
+				for(i=0;i<n;i++) Threshold[i] = 0;
+				DitherImage_OrderedRun(Px, p, NULL, NULL, DitherType, n);
 			}
-			if(RawPxOutput) {
-				*RawPxOutput++ = Px;
+
+			//! Find matching palette entries, store to output, and accumulate error
+			for(i=0;i<n;i++) {
+				int PalIdx = MatchPaletteEntry(State, &Px[i], p[i], Threshold[i], TilePalIdx, MatchCache);
+				Pass->TilePxOutput[Offs+i] = PalIdx + TilePalIdx*MaxPalSize;
+				struct BGRAf_t Error = BGRAf_FromBGRA8(&p[i]);
+				Error = BGRAf_Sub(&Error, &Palette[PalIdx]);
+				Error = BGRAf_Mul(&Error, &Error);
+				if(Count != 1) Error = BGRAf_Muli(&Error, (float)Count);
+				RMSE  = BGRAf_Add(&RMSE, &Error);
 			}
-			struct BGRAf_t Error = BGRAf_Sub(&Px_Original, &Px);
+		}
+	}
+	Pass->TaskError[TaskIdx] = RMSE;
+}
 
-			//! Add to error diffusion
-			if(DitherType == DITHER_FLOYDSTEINBERG) {
-				struct BGRAf_t t;
+//! Process a band tile-by-tile (across the thread pool)
+//! Returns 0 on failure (out of memory), leaving the band unprocessed.
+static int DitherImage_RowsByTile(
+	struct DitherState_t *State,
+	const struct BmpCtx_t *Band,
+	const int32_t *TilePalIndices,
+	uint8_t *TilePxOutput,
+	const int32_t *TileCount
+) {
+	int i;
+	int nTiles = (State->ImgW / State->TileW) * (Band->Height / State->TileH);
+	int nTasks = (nTiles + TILES_PER_TASK-1) / TILES_PER_TASK;
+	int nDiffusion = 0;
+	if(State->DitherType == DITHER_FLOYDSTEINBERG_TILE) {
+		nDiffusion = ThreadPool_GetThreadCount(State->Pool) * (State->TileW+2)*2;
+	}
+	struct DitherImage_TilePass_t Pass = {
+		.State          = State,
+		.Band           = Band,
+		.TilePalIndices = TilePalIndices,
+		.TilePxOutput   = TilePxOutput,
+		.TileCount      = TileCount,
+		.nTiles         = nTiles,
+		.TaskError      = Arena_Alloc(State->Arena, (nTasks + nDiffusion) * sizeof(struct BGRAf_t)),
+	};
+	if(!Pass.TaskError) return 0;
+	Pass.Diffusion = Pass.TaskError + nTasks;
+	ThreadPool_Run(State->Pool, DitherImage_TileTask, &Pass, nTasks);
+	for(i=0;i<nTasks;i++) State->ErrorSum = BGRAf_Add(&State->ErrorSum, &Pass.TaskError[i]);
+	Arena_Free(State->Arena, Pass.TaskError);
+	State->y += Band->Height;
+	return 1;
+}
 
-				//! {x+1,y} @ 7/16
-				t = BGRAf_Muli(&Error, 7.0f/16);
-				DiffuseThisLine[x+1] = BGRAf_Add(&DiffuseThisLine[x+1], &t);
+/**************************************/
 
-				//! {x-1,y+1} @ 3/16
-				t = BGRAf_Muli(&Error, 3.0f/16);
-				DiffuseNextLine[x-1] = BGRAf_Add(&DiffuseNextLine[x-1], &t);
+//! Dither a single row of a band without error diffusion or tile output
+//! The row is processed in runs of pixels, with the same results as
+//! DitherImage_Row().
+static struct BGRAf_t DitherImage_RowRun(
+	const struct DitherState_t *State,
+	const struct BmpCtx_t *Band,
+	int y,
+	struct BGRAf_t *RawPxOutput,
+	struct BGRA8_t *RawPxOutputBGRA8
+) {
+	int x, i;
+	int ImgW = State->ImgW;
+	const        uint8_t *PxSrcIdx = Band->ColPal ? (Band->PxIdx + y*ImgW) : NULL;
+	const struct BGRA8_t *PxSrcBGR = Band->ColPal ?  Band->ColPal : (Band->PxBGR + y*ImgW);
 
-				//! {x+0,y+1} @ 5/16
-				t = BGRAf_Muli(&Error, 5.0f/16);
-				DiffuseNextLine[x+0] = BGRAf_Add(&DiffuseNextLine[x+0], &t);
+	struct BGRAf_t RMSE = (struct BGRAf_t){0,0,0,0};
+	for(x=0;x<ImgW;x+=DITHER_RUN_LENGTH) {
+		int n = ImgW - x; if(n > DITHER_RUN_LENGTH) n = DITHER_RUN_LENGTH;
+		struct BGRA8_t p[DITHER_RUN_LENGTH];
+		struct BGRAf_t Px[DITHER_RUN_LENGTH];
+		int Threshold[DITHER_RUN_LENGTH];
 
-				//! {x+1,y+1} @ 1/16
-				t = BGRAf_Muli(&Error, 1.0f/16);
-				DiffuseNextLine[x+1] = BGRAf_Add(&DiffuseNextLine[x+1], &t);
-			}
+		//! Read original pixel data, apply dither matrix, and reduce range
+		if(PxSrcIdx) for(i=0;i<n;i++) p[i] = PxSrcBGR[PxSrcIdx[x+i]];
+		else         for(i=0;i<n;i++) p[i] = PxSrcBGR[x+i];
+		if(State->DitherType != DITHER_NONE) {
+			GetDitherThresholds(State, Threshold, x, State->y+y, n);
+			DitherImage_OrderedRun(Px, p, Threshold, &State->PaletteSpread[0], State->DitherType, n);
+		} else DitherImage_OrderedRun(Px, p, NULL, NULL, State->DitherType, n);
+		RMSE = DitherImage_ReduceRun(Px, RawPxOutputBGRA8 ? (RawPxOutputBGRA8 + x) : NULL, p, State->BitRange, n, RMSE);
+		if(RawPxOutput) for(i=0;i<n;i++) RawPxOutput[x+i] = Px[i];
+	}
+	return RMSE;
+}
 
-			//! Accumulate error for RMS calculation
-			Error = BGRAf_Mul(&Error, &Error);
-			RMSE  = BGRAf_Add(&RMSE, &Error);
+/**************************************/
+
+//! Dither a single row of a band
+//! All pointers point to the start of the row (TilePalIndices and
+//! TileCount to the start of its row of tiles), and the error of the
+//! row is returned.
+//! For wavefront processing, Above and Progress point to the progress
+//! counters (number of completed pixels) of the row above and of this
+//! row. Every pixel then waits until the row above is far enough ahead
+//! that all of its diffusion error has been added (ie. the row above
+//! has completed pixel x+1), and until it has also added to the same
+//! entry that this pixel adds to (pixel x+2), so the error is summed
+//! in the same order as when processing rows serially.
+#define WAVEFRONT_LAG            3
+#define WAVEFRONT_PUBLISH_PERIOD 16 //! Publish progress every N pixels
+static struct BGRAf_t DitherImage_Row(
+	const struct DitherState_t *State,
+	const struct BmpCtx_t *Band,
+	int y,
+	struct BGRAf_t *DiffuseThisLine,
+	struct BGRAf_t *DiffuseNextLine,
+	struct BGRAf_t *RawPxOutput,
+	struct BGRA8_t *RawPxOutputBGRA8,
+	const int32_t *TilePalIndices,
+	uint8_t *TilePxOutput,
+	const int32_t *TileCount,
+	const atomic_int *Above,
+	      atomic_int *Progress
+) {
+	int x;
+	int ImgW  = State->ImgW;
+	int TileW = State->TileW;
+	int MaxPalSize = State->MaxPalSize;
+	int   DitherType  = State->DitherType;
+	float DitherLevel = State->DitherLevel;
+	const struct BGRA8_t *BitRange      = State->BitRange;
+	const struct BGRAf_t *TilePalettes  = State->TilePalettes;
+	const struct BGRAf_t *PaletteSpread = State->PaletteSpread;
+	uint64_t *MatchCache = State->MatchCache;
+	const        uint8_t *PxSrcIdx = Band->ColPal ? (Band->PxIdx + y*ImgW) : NULL;
+	const struct BGRA8_t *PxSrcBGR = Band->ColPal ?  Band->ColPal : (Band->PxBGR + y*ImgW);
+	if(!DitherIsDiffusion(DitherType) && !TilePxOutput) {
+		return DitherImage_RowRun(State, Band, y, RawPxOutput, RawPxOutputBGRA8);
+	}
+
+	//! With tile-local diffusion, the last row of a tile does not diffuse downwards
+	int TileDown = (DitherType != DITHER_FLOYDSTEINBERG_TILE) || ((State->y+y+1) % State->TileH != 0);
+
+	int AboveDone = Above ? 0 : ImgW+WAVEFRONT_LAG;
+	int TilePalIdx = 0;
+	int TileWidthCounter = 0;
+	struct BGRAf_t RMSE = (struct BGRAf_t){0,0,0,0};
+	for(x=0;x<ImgW;x++) {
+		//! Wait for the row above
+		if(AboveDone < x+WAVEFRONT_LAG) {
+			int Need = (x+WAVEFRONT_LAG < ImgW) ? (x+WAVEFRONT_LAG) : ImgW;
+			while((AboveDone = atomic_load_explicit(Above, memory_order_acquire)) < Need) ThreadPool_Yield();
+			if(AboveDone == ImgW) AboveDone = ImgW+WAVEFRONT_LAG;
+		}
+
+		//! Publish progress
+		if(Progress && x % WAVEFRONT_PUBLISH_PERIOD == 0) {
+			atomic_store_explicit(Progress, x, memory_order_release);
+		}
+
+		//! Advance tile palette index
+		if(TilePxOutput && --TileWidthCounter <= 0) {
+			TilePalIdx = *TilePalIndices++;
+			TileWidthCounter = TileW;
+		}
+
+		//! Get pixel and apply dithering
+		struct BGRA8_t p;
+		struct BGRAf_t Px, Px_Original; {
+			//! Read original pixel data
+			if(PxSrcIdx) p = PxSrcBGR[*PxSrcIdx++];
+			else         p = *PxSrcBGR++;
+			Px = Px_Original = BGRAf_FromBGRA8(&p);
+		}
+
+		//! Skip duplicate tiles
+		int Count = 1;
+		if(TileCount) {
+			Count = TileCount[x/TileW];
+			if(!Count) {
+				TilePxOutput++;
+				continue;
+			}
+		}
+		int Threshold = 0;
+		if(DitherType != DITHER_NONE) {
+			if(DitherIsDiffusion(DitherType)) {
+				//! Adjust for diffusion error
+				Px = DiffusePixel(&Px, &DiffuseThisLine[x], DitherLevel);
+			} else {
+				//! Adjust for dither matrix
+				GetDitherThresholds(State, &Threshold, x, State->y+y, 1);
+				float fThres = Threshold * (1.0f / (1 << (2*DitherType))) - 0.5f;
+				struct BGRAf_t DitherVal = BGRAf_Muli(&PaletteSpread[TilePalIdx], fThres);
+				Px = BGRAf_Add(&Px, &DitherVal);
+			}
 		}
 
-		//! Advance tile palette index pointer
-		//! At this point, we're already pointing to the next row of tiles,
-		//! so we only need to either update the counter, or rewind the pointer.
+		//! Find matching palette entry, store to output, and get error
 		if(TilePxOutput) {
-			if(--TileHeightCounter <= 0) {
-				TileHeightCounter = TileH;
-			} else TilePalIndices -= (ImgW/TileW);
+			int PalIdx  = MatchPaletteEntry(State, &Px, p, Threshold, TilePalIdx, MatchCache);
+			    PalIdx += TilePalIdx*MaxPalSize;
+			*TilePxOutput++ = PalIdx;
+			Px = TilePalettes[PalIdx];
+		} else {
+			//! Reduce range when not using tile output
+			struct BGRA8_t t = BGRA_FromBGRAf(&Px, BitRange);
+			Px = BGRAf_FromBGRA(&t, BitRange);
+			if(RawPxOutputBGRA8) *RawPxOutputBGRA8++ = t;
 		}
+		if(RawPxOutput) {
+			*RawPxOutput++ = Px;
+		}
+		struct BGRAf_t Error = BGRAf_Sub(&Px_Original, &Px);
 
-		//! Swap diffusion dithering pointers and clear buffer for next line
+		//! Add to error diffusion
 		if(DitherType == DITHER_FLOYDSTEINBERG) {
+			DiffuseError(DiffuseThisLine, DiffuseNextLine, x, &Error, 1, 1, 1);
+		} else if(DitherType == DITHER_FLOYDSTEINBERG_TILE) {
+			int tx = x % TileW;
+			DiffuseError(DiffuseThisLine, DiffuseNextLine, x, &Error, tx > 0, tx+1 < TileW, TileDown);
+		}
+
+		//! Accumulate error for RMS calculation
+		Error = BGRAf_Mul(&Error, &Error);
+		if(Count != 1) Error = BGRAf_Muli(&Error, (float)Count);
+		RMSE  = BGRAf_Add(&RMSE, &Error);
+	}
+	if(Progress) atomic_store_explicit(Progress, ImgW, memory_order_release);
+	return RMSE;
+}
+
+/**************************************/
+
+//! Wavefront processing of a band (Floyd-Steinberg)
+//! Every row is a task, and rows are started in order (see
+//! ThreadPool_Run()), so a row only ever waits on rows that are already
+//! being processed. Diffusion lines are kept in a ring buffer; before
+//! reusing a line, a row waits until the row that last read it is done.
+struct DitherImage_Wavefront_t {
+	const struct DitherState_t *State;
+	const struct BmpCtx_t *Band;
+	struct BGRAf_t *RawPxOutput;
+	struct BGRA8_t *RawPxOutputBGRA8;
+	const int32_t  *TilePalIndices;
+	uint8_t        *TilePxOutput;
+	struct BGRAf_t *Lines;     //! [nLines][ImgW+2]
+	int             nLines;
+	atomic_int     *Progress;  //! [BandH]
+	struct BGRAf_t *RowError;  //! [BandH]
+};
+static void DitherImage_WavefrontTask(void *Arg, int y, int ThreadIdx) {
+	int x;
+	const struct DitherImage_Wavefront_t *Pass = Arg;
+	const struct DitherState_t *State = Pass->State;
+	int ImgW  = State->ImgW;
+	int TileW = State->TileW;
+	int TileH = State->TileH;
+	int Offs  = y*ImgW;
+	(void)ThreadIdx;
+
+	//! Wait until the next line is no longer in use, and clear it
+	struct BGRAf_t *DiffuseThisLine = Pass->Lines + ( y   %Pass->nLines)*(ImgW+2) + 1;
+	struct BGRAf_t *DiffuseNextLine = Pass->Lines + ((y+1)%Pass->nLines)*(ImgW+2) + 1;
+	if(y+1 >= Pass->nLines) {
+		const atomic_int *Prev = &Pass->Progress[y+1-Pass->nLines];
+		while(atomic_load_explicit(Prev, memory_order_acquire) < ImgW) ThreadPool_Yield();
+	}
+	for(x=-1;x<=ImgW;x++) DiffuseNextLine[x] = (struct BGRAf_t){0,0,0,0};
+
+	//! Process row
+	Pass->RowError[y] = DitherImage_Row(
+		State, Pass->Band, y,
+		DiffuseThisLine,
+		DiffuseNextLine,
+		Pass->RawPxOutput      ? Pass->RawPxOutput      + Offs : NULL,
+		Pass->RawPxOutputBGRA8 ? Pass->RawPxOutputBGRA8 + Offs : NULL,
+		Pass->TilePxOutput     ? Pass->TilePalIndices + (y/TileH)*(ImgW/TileW) : NULL,
+		Pass->TilePxOutput     ? Pass->TilePxOutput     + Offs : NULL,
+		NULL,
+		y ? &Pass->Progress[y-1] : NULL,
+		&Pass->Progress[y]
+	);
+}
+
+//! Process a band as a wavefront (across the thread pool)
+//! Returns 0 on failure (out of memory), leaving the band unprocessed.
+static int DitherImage_RowsWavefront(
+	struct DitherState_t *State,
+	const struct BmpCtx_t *Band,
+	struct BGRAf_t *RawPxOutput,
+	struct BGRA8_t *RawPxOutputBGRA8,
+	const int32_t *TilePalIndices,
+	uint8_t *TilePxOutput
+) {
+	int x, y;
+	int ImgW   = State->ImgW;
+	int BandH  = Band->Height;
+	int nLines = 2*ThreadPool_GetThreadCount(State->Pool) + 2;
+	if(nLines > BandH+1) nLines = BandH+1;
+
+	//! Allocate ring buffer, progress counters, and row errors
+	void *Buffer = Arena_Alloc(State->Arena,
+		DATA_ALIGNMENT-1                                 + //! Rounding
+		DATA_ALIGN(nLines*(ImgW+2)*sizeof(struct BGRAf_t)) + //! Lines
+		DATA_ALIGN(BandH*sizeof(atomic_int))               + //! Progress
+		DATA_ALIGN(BandH*sizeof(struct BGRAf_t))             //! RowError
+	);
+	if(!Buffer) return 0;
+	struct DitherImage_Wavefront_t Pass = {
+		.State            = State,
+		.Band             = Band,
+		.RawPxOutput      = RawPxOutput,
+		.RawPxOutputBGRA8 = RawPxOutputBGRA8,
+		.TilePalIndices   = TilePalIndices,
+		.TilePxOutput     = TilePxOutput,
+		.nLines           = nLines,
+	};
+	Pass.Lines    = (struct BGRAf_t*)DATA_ALIGN(Buffer);
+	Pass.Progress = (atomic_int    *)DATA_ALIGN(Pass.Lines + nLines*(ImgW+2));
+	Pass.RowError = (struct BGRAf_t*)DATA_ALIGN(Pass.Progress + BandH);
+	for(y=0;y<BandH;y++) atomic_init(&Pass.Progress[y], 0);
+
+	//! Carry the diffusion error over from the previous band
+	for(x=0;x<ImgW;x++) Pass.Lines[1+x] = State->DiffuseThisLine[x];
+
+	//! Process rows, then reduce errors in order and store
+	//! the diffusion error for the next band
+	ThreadPool_Run(State->Pool, DitherImage_WavefrontTask, &Pass, BandH);
+	for(y=0;y<BandH;y++) State->ErrorSum = BGRAf_Add(&State->ErrorSum, &Pass.RowError[y]);
+	const struct BGRAf_t *LastLine = Pass.Lines + (BandH%nLines)*(ImgW+2) + 1;
+	for(x=0;x<ImgW;x++) State->DiffuseThisLine[x] = LastLine[x];
+	State->y += BandH;
+	Arena_Free(State->Arena, Buffer);
+	return 1;
+}
+
+/**************************************/
+
+//! Dither the next band of rows
+void DitherImage_Rows(
+	struct DitherState_t *State,
+	const struct BmpCtx_t *Band,
+	struct BGRAf_t *RawPxOutput,
+	struct BGRA8_t *RawPxOutputBGRA8,
+	const int32_t *TilePalIndices,
+	uint8_t *TilePxOutput,
+	const int32_t *TileCount
+) {
+	//! Get parameters, pointers, etc.
+	int x, y;
+	int ImgW  = State->ImgW;
+	int BandH = Band->Height;
+	int TileW = State->TileW;
+	int TileH = State->TileH;
+	int MaxPalSize = State->MaxPalSize;
+	int DitherType = State->DitherType;
+
+	//! Create the palette match cache (one per thread) once the image is large enough
+	//! NOTE: Keys only have room for 256 palettes and thresholds of up to
+	//! 12 bits (DITHER_ORDERED(6)); larger values are not cached.
+	if(!State->MatchCache && TilePxOutput && !DitherIsDiffusion(DitherType) && DitherType <= 6 &&
+	   State->nTilePals <= 256 && MaxPalSize <= 256 && (State->y + BandH) * ImgW >= MATCHCACHE_MIN_PIXELS) {
+		int n = ThreadPool_GetThreadCount(State->Pool) << MATCHCACHE_SIZE_LOG2;
+		State->MatchCache = Arena_Alloc(State->Arena, n * sizeof(uint64_t));
+		if(State->MatchCache) for(x=0;x<n;x++) State->MatchCache[x] = MATCHCACHE_EMPTY;
+	}
+
+	//! Without error diffusion, every tile can be processed independently
+	if(TilePxOutput && DitherType != DITHER_FLOYDSTEINBERG && !RawPxOutput && !RawPxOutputBGRA8 && BandH % TileH == 0 && ImgW % TileW == 0) {
+		if(DitherImage_RowsByTile(State, Band, TilePalIndices, TilePxOutput, TileCount)) return;
+	}
+
+	//! Floyd-Steinberg dithering is processed as a wavefront when threads are available
+	if(DitherIsDiffusion(DitherType) && !TileCount && BandH > 1 && ThreadPool_GetThreadCount(State->Pool) > 1) {
+		if(DitherImage_RowsWavefront(State, Band, RawPxOutput, RawPxOutputBGRA8, TilePalIndices, TilePxOutput)) return;
+	}
+
+	//! Process rows in order
+	struct BGRAf_t *DiffuseThisLine = State->DiffuseThisLine;
+	struct BGRAf_t *DiffuseNextLine = State->DiffuseNextLine;
+	for(y=0;y<BandH;y++) {
+		int Offs = y*ImgW;
+		struct BGRAf_t RowError = DitherImage_Row(
+			State, Band, y,
+			DiffuseThisLine,
+			DiffuseNextLine,
+			RawPxOutput      ? RawPxOutput      + Offs : NULL,
+			RawPxOutputBGRA8 ? RawPxOutputBGRA8 + Offs : NULL,
+			TilePxOutput     ? TilePalIndices + (y/TileH)*(ImgW/TileW) : NULL,
+			TilePxOutput     ? TilePxOutput     + Offs : NULL,
+			TileCount        ? TileCount      + (y/TileH)*(ImgW/TileW) : NULL,
+			NULL,
+			NULL
+		);
+		State->ErrorSum = BGRAf_Add(&State->ErrorSum, &RowError);
+
+		//! Swap diffusion dithering pointers and clear buffer for next line
+		if(DitherIsDiffusion(DitherType)) {
 			struct BGRAf_t *t = DiffuseThisLine;
 			DiffuseThisLine = DiffuseNextLine;
 			DiffuseNextLine = t;
@@ -211,10 +928,71 @@ struct BGRAf_t DitherImage(
 		}
 	}
 
-	//! Return error
-	RMSE = BGRAf_Divi(&RMSE, ImgW*ImgH);
-	RMSE = BGRAf_Sqrt(&RMSE);
-	return RMSE;
+	//! Store state for the next band
+	State->y += BandH;
+	State->DiffuseThisLine = DiffuseThisLine;
+	State->DiffuseNextLine = DiffuseNextLine;
+}
+
+/**************************************/
+
+//! Finish dithering, return RMS error
+struct BGRAf_t DitherImage_End(struct DitherState_t *State) {
+	Arena_Free(State->Arena, State->PalMatchBuffer);
+	Arena_Free(State->Arena, State->MatchCache);
+	Arena_Free(State->Arena, State->DitherMatrix);
+	State->DitherMatrix   = NULL;
+	State->PalMatch       = NULL;
+	State->PalMatchBuffer = NULL;
+	State->MatchCache     = NULL;
+	struct BGRAf_t RMSE = BGRAf_Divi(&State->ErrorSum, State->ImgW*State->y);
+	return BGRAf_Sqrt(&RMSE);
+}
+
+/**************************************/
+
+//! Handle conversion of image with given palette, return RMS error
+struct BGRAf_t DitherImage(
+	const struct BmpCtx_t *Image,
+	const struct BGRA8_t *BitRange,
+	struct BGRAf_t *RawPxOutput,
+	struct BGRA8_t *RawPxOutputBGRA8,
+
+	int TileW,
+	int TileH,
+	int MaxTilePals,
+	int MaxPalSize,
+	int PalUnused,
+	const int32_t *TilePalIndices,
+	const struct BGRAf_t *TilePalettes,
+	uint8_t *TilePxOutput,
+	const int32_t *TileCount,
+
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *DiffusionBuffer,
+	struct ThreadPool_t *Pool,
+	struct Arena_t *Arena
+) {
+	struct DitherState_t State;
+	DitherImage_Begin(
+		&State,
+		Image->Width,
+		BitRange,
+		TileW,
+		TileH,
+		MaxTilePals,
+		MaxPalSize,
+		PalUnused,
+		TilePxOutput ? TilePalettes : NULL,
+		DitherType,
+		DitherLevel,
+		DiffusionBuffer,
+		Pool,
+		Arena
+	);
+	DitherImage_Rows(&State, Image, RawPxOutput, RawPxOutputBGRA8, TilePalIndices, TilePxOutput, TileCount);
+	return DitherImage_End(&State);
 }
 
 /**************************************/
@@ -2,19 +2,64 @@
 #pragma once
 /**************************************/
 #include "Bitmap.h"
+#include "Arena.h"
 #include "Colourspace.h"
+#include "Quantize.h"
+#include "Threads.h"
+/**************************************/
+
+//! Dithering state
+//! This allows processing an image in bands of rows (see DitherImage_Begin()).
+struct DitherState_t {
+	const struct BGRA8_t *BitRange;
+	int ImgW;
+	int TileW, TileH;
+	int nTilePals, MaxPalSize, PalUnused;
+	const struct BGRAf_t *TilePalettes;
+	int   DitherType;
+	float DitherLevel;
+	int   y;                         //! Absolute index of the next row
+	struct BGRAf_t *PaletteSpread;   //! DITHER_ORDERED only
+	uint16_t       *DitherMatrix;    //! DITHER_ORDERED only: Threshold indices (NULL = computed per pixel)
+	struct BGRAf_t *DiffuseThisLine; //! DITHER_FLOYDSTEINBERG(_TILE) only
+	struct BGRAf_t *DiffuseNextLine; //! DITHER_FLOYDSTEINBERG(_TILE) only
+	struct BGRAf_t  ErrorSum;        //! Sum of squared errors so far
+	int PalMatchStart;               //! First palette entry considered for matching
+	struct QuantCluster_Centroids_t *PalMatch; //! Tile palettes as YUVA (NULL = not available)
+	QuantCluster_FindNearest_t FindNearest;
+	void *PalMatchBuffer;
+	uint64_t *MatchCache;            //! Palette match cache, per thread (NULL = not used)
+	struct ThreadPool_t *Pool;       //! Thread pool for tiled output (NULL = no threading)
+	struct Arena_t *Arena;           //! Scratch memory (NULL = use malloc())
+};
+
 /**************************************/
 
 //! Handle conversion of image, return RMS error.
 //! Notes:
 //!  -Passing RawPxOutput != NULL will store the dithered image there.
+//!  -Passing RawPxOutputBGRA8 != NULL will store the dithered image there
+//!   as range-reduced values (ie. before scaling by 1/BitRange); this is
+//!   only valid when TilePxOutput == NULL.
 //!  -Passing TilePxOutput != NULL will store the output image there,
 //!   using TilePalettes as a reference.
+//!  -Passing TileCount != NULL (with TilePxOutput != NULL) skips all tiles
+//!   with a count of 0 (leaving their output untouched), and counts the
+//!   error of all other tiles TileCount[] times. This is only valid when
+//!   the output of a tile does not depend on its position (DITHER_NONE,
+//!   DITHER_FLOYDSTEINBERG_TILE).
+//!  -DITHER_FLOYDSTEINBERG_TILE needs TileW,TileH (even without tile output),
+//!   and falls back to DITHER_FLOYDSTEINBERG without these.
 //!  -DiffusionBuffer[] needs to be (Image->Width+2)*2 elements in size.
+//!  -Pool may be NULL. It is only used for tiled output without error
+//!   diffusion, which is then processed tile-by-tile across threads;
+//!   the output does not depend on the number of threads.
+//!  -Arena may be NULL. Scratch memory is then taken from malloc().
 struct BGRAf_t DitherImage(
 	const struct BmpCtx_t *Image,
 	const struct BGRA8_t *BitRange,
 	struct BGRAf_t *RawPxOutput,
+	struct BGRA8_t *RawPxOutputBGRA8,
 
 	int TileW,
 	int TileH,
@@ -24,12 +69,60 @@ struct BGRAf_t DitherImage(
 	const int32_t *TilePalIndices,
 	const struct BGRAf_t *TilePalettes,
 	uint8_t *TilePxOutput,
+	const int32_t *TileCount,
 
 	int   DitherType,
 	float DitherLevel,
-	struct BGRAf_t *DiffusionBuffer
+	struct BGRAf_t *DiffusionBuffer,
+	struct ThreadPool_t *Pool,
+	struct Arena_t *Arena
 );
 
+//! Begin dithering an image in bands of rows
+//! This is the same as DitherImage(), split into DitherImage_Begin(),
+//! any number of calls to DitherImage_Rows() (each processing the next
+//! Band->Height rows of the image), and DitherImage_End(), and gives the
+//! same results regardless of how the image is split.
+//! Notes:
+//!  -TilePalettes must be passed here when the output is tiled (ie.
+//!   when passing TilePxOutput to DitherImage_Rows()).
+//!  -DiffusionBuffer[] is used for the entire image, and must not be
+//!   modified until DitherImage_End().
+//!  -With TilePalettes, the palettes are converted to YUVA once (if
+//!   memory allows), so TilePalettes must not change until DitherImage_End().
+void DitherImage_Begin(
+	struct DitherState_t *State,
+	int ImgW,
+	const struct BGRA8_t *BitRange,
+	int TileW,
+	int TileH,
+	int MaxTilePals,
+	int MaxPalSize,
+	int PalUnused,
+	const struct BGRAf_t *TilePalettes,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *DiffusionBuffer,
+	struct ThreadPool_t *Pool,
+	struct Arena_t *Arena
+);
+
+//! Dither the next band of rows
+//! NOTE: When TilePxOutput != NULL, the band must start on a row of tiles,
+//! and TilePalIndices and TileCount point to the data of that row of tiles.
+void DitherImage_Rows(
+	struct DitherState_t *State,
+	const struct BmpCtx_t *Band,
+	struct BGRAf_t *RawPxOutput,
+	struct BGRA8_t *RawPxOutputBGRA8,
+	const int32_t *TilePalIndices,
+	uint8_t *TilePxOutput,
+	const int32_t *TileCount
+);
+
+//! Finish dithering, return RMS error
+struct BGRAf_t DitherImage_End(struct DitherState_t *State);
+
 /**************************************/
 //! EOF
 /**************************************/
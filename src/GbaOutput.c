@@ -0,0 +1,236 @@
+/**************************************/
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+/**************************************/
+#include "GbaOutput.h"
+/**************************************/
+
+//! Store a buffer to file in a single write
+static int GbaOutput_WriteFile(const char *Filename, const void *Data, size_t Size) {
+	FILE *File = fopen(Filename, "wb");
+	if(!File) return 0;
+	int Ok = (Size == 0 || fwrite(Data, Size, 1, File) == 1);
+	if(fclose(File) != 0) Ok = 0;
+	return Ok;
+}
+
+//! Load a file of 16-bit entries in a single read
+//! Returns NULL on failure (out of memory, or read error), or
+//! when the file holds fewer than nEntries entries.
+static uint8_t *GbaOutput_ReadFile(const char *Filename, size_t nEntries) {
+	FILE *File = fopen(Filename, "rb");
+	if(!File) return NULL;
+	uint8_t *Buffer = malloc(nEntries*sizeof(uint16_t) + 1);
+	if(Buffer && nEntries && fread(Buffer, nEntries*sizeof(uint16_t), 1, File) != 1) {
+		free(Buffer);
+		Buffer = NULL;
+	}
+	fclose(File);
+	return Buffer;
+}
+
+//! Store a 16-bit value (little endian)
+static inline uint8_t *GbaOutput_Put16(uint8_t *Dst, uint16_t x) {
+	*Dst++ = x & 0xFF;
+	*Dst++ = x >> 8;
+	return Dst;
+}
+
+//! Get a 16-bit value (little endian)
+static inline uint16_t GbaOutput_Get16(const uint8_t *Src) {
+	return (uint16_t)(Src[0] | Src[1] << 8);
+}
+
+//! Get the row of tiles in memory for an output row
+static inline int GbaOutput_TileRow(const struct TilesData_t *TilesData, int ty, int BottomUp) {
+	return BottomUp ? (TilesData->TilesY-1 - ty) : ty;
+}
+
+//! Widen a level in [0,Range] to 5bit
+static inline uint16_t GbaOutput_Widen5(int Level, int Range) {
+	return Range ? (uint16_t)((Level*31 + Range/2) / Range) : 0;
+}
+
+//! Narrow a 5bit value to a level in [0,Range]
+//! NOTE: This recovers the level given to GbaOutput_Widen5().
+static inline uint8_t GbaOutput_Narrow5(int x, int Range) {
+	return (uint8_t)((x*Range + 15) / 31);
+}
+
+//! Get the level in [0,Range] of an 8bit colour channel
+//! NOTE: Final palette colours are always exact levels of BitRange,
+//! so this recovers them exactly.
+static inline int GbaOutput_Level(int x, int Range) {
+	return (x*Range + 127) / 255;
+}
+
+/**************************************/
+
+//! Write tile characters
+int GbaOutput_WriteChars(
+	const char *Filename,
+	const struct TilesData_t *TilesData,
+	const uint8_t *PxIdx,
+	const struct TileMapEntry_t *TileMap,
+	int nUniqueTiles,
+	int MaxPalSize,
+	int BitDepth,
+	int BottomUp
+) {
+	int tx, ty, px, py;
+	int TileW = TilesData->TileW;
+	int TileH = TilesData->TileH;
+	int ImgW  = TilesData->TilesX * TileW;
+	int nPx   = TileW * TileH;
+	size_t CharSize = (BitDepth == GBAOUTPUT_CHARS_4BPP) ? (size_t)(nPx+1)/2 : (size_t)nPx;
+	uint8_t *Buffer = calloc((size_t)nUniqueTiles*CharSize + 1, sizeof(uint8_t));
+	if(!Buffer) return 0;
+
+	//! Pack the first appearance of every unique tile
+	//! NOTE: The first appearance is never flipped, so no flips are needed.
+	int nStored = 0;
+	for(ty=0;ty<TilesData->TilesY;ty++) for(tx=0;tx<TilesData->TilesX;tx++) {
+		int Tile = ty*TilesData->TilesX + tx;
+		if(TileMap[Tile].TileIdx != nStored) continue;
+		uint8_t *Dst = Buffer + nStored++*CharSize;
+		int n = 0;
+		for(py=0;py<TileH;py++) {
+			int y = BottomUp ? (TileH-1 - py) : py;
+			const uint8_t *Src = PxIdx + (ty*TileH + y)*ImgW + tx*TileW;
+			for(px=0;px<TileW;px++,n++) {
+				if(BitDepth == GBAOUTPUT_CHARS_4BPP) {
+					Dst[n/2] |= (Src[px] % MaxPalSize & 0xF) << (n%2 * 4);
+				} else Dst[n] = Src[px];
+			}
+		}
+	}
+
+	//! Store file
+	int Ok = GbaOutput_WriteFile(Filename, Buffer, (size_t)nStored*CharSize);
+	free(Buffer);
+	return Ok;
+}
+
+/**************************************/
+
+//! Write palette
+int GbaOutput_WritePalette(
+	const char *Filename,
+	const struct BGRA8_t *Palette,
+	int nPalettes,
+	int nColoursPerPalette,
+	int PalStride,
+	const struct BGRA8_t *BitRange
+) {
+	int i, j;
+	size_t Size = (size_t)nPalettes*PalStride*sizeof(uint16_t);
+	uint8_t *Buffer = calloc(Size + 1, sizeof(uint8_t));
+	if(!Buffer) return 0;
+
+	//! Convert colours
+	for(i=0;i<nPalettes;i++) for(j=0;j<nColoursPerPalette && j<PalStride;j++) {
+		struct BGRA8_t p = Palette[i*nColoursPerPalette + j];
+		uint16_t x = GbaOutput_Widen5(GbaOutput_Level(p.r, BitRange->r), BitRange->r) <<  0 |
+		             GbaOutput_Widen5(GbaOutput_Level(p.g, BitRange->g), BitRange->g) <<  5 |
+		             GbaOutput_Widen5(GbaOutput_Level(p.b, BitRange->b), BitRange->b) << 10;
+		if(BitRange->a && GbaOutput_Level(p.a, BitRange->a)*2 >= BitRange->a) x |= 0x8000;
+		GbaOutput_Put16(Buffer + (i*PalStride + j)*sizeof(uint16_t), x);
+	}
+
+	//! Store file
+	int Ok = GbaOutput_WriteFile(Filename, Buffer, Size);
+	free(Buffer);
+	return Ok;
+}
+
+//! Read palette
+int GbaOutput_ReadPalette(
+	const char *Filename,
+	struct BGRA8_t *Palette,
+	int nPalettes,
+	int nColoursPerPalette,
+	int PalStride,
+	const struct BGRA8_t *BitRange
+) {
+	int i, j;
+	uint8_t *Buffer = GbaOutput_ReadFile(Filename, (size_t)nPalettes*PalStride);
+	if(!Buffer) return 0;
+
+	//! Convert colours
+	//! NOTE: Entries past PalStride (when palettes were truncated) are blank.
+	for(i=0;i<nPalettes;i++) for(j=0;j<nColoursPerPalette;j++) {
+		struct BGRA8_t p = {0,0,0,0};
+		if(j < PalStride) {
+			uint16_t x = GbaOutput_Get16(Buffer + (i*PalStride + j)*sizeof(uint16_t));
+			struct BGRA8_t Level = {
+				.b = GbaOutput_Narrow5(x >> 10 & 0x1F, BitRange->b),
+				.g = GbaOutput_Narrow5(x >>  5 & 0x1F, BitRange->g),
+				.r = GbaOutput_Narrow5(x >>  0 & 0x1F, BitRange->r),
+				.a = (x & 0x8000) ? BitRange->a : 0,
+			};
+			struct BGRAf_t f = BGRAf_FromBGRA(&Level, BitRange);
+			p = BGRA8_FromBGRAf(&f);
+		}
+		Palette[i*nColoursPerPalette + j] = p;
+	}
+	free(Buffer);
+	return 1;
+}
+
+/**************************************/
+
+//! Write tilemap
+int GbaOutput_WriteTileMap(
+	const char *Filename,
+	const struct TilesData_t *TilesData,
+	const struct TileMapEntry_t *TileMap,
+	int  BottomUp,
+	int *nOverflow
+) {
+	int tx, ty;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+	uint8_t *Buffer = malloc((size_t)nTiles*sizeof(uint16_t) + 1);
+	if(!Buffer) return 0;
+
+	//! Build screen entries
+	uint8_t *Dst = Buffer;
+	*nOverflow = 0;
+	for(ty=0;ty<TilesData->TilesY;ty++) for(tx=0;tx<TilesData->TilesX;tx++) {
+		const struct TileMapEntry_t *x = &TileMap[GbaOutput_TileRow(TilesData, ty, BottomUp)*TilesData->TilesX + tx];
+		if(x->TileIdx > 0x3FF || x->PalIdx > 0xF) (*nOverflow)++;
+		Dst = GbaOutput_Put16(Dst, (x->TileIdx & 0x3FF) | (x->Flip << 10) | ((x->PalIdx & 0xF) << 12));
+	}
+
+	//! Store file
+	int Ok = GbaOutput_WriteFile(Filename, Buffer, (size_t)nTiles*sizeof(uint16_t));
+	free(Buffer);
+	return Ok;
+}
+
+//! Read tilemap palette indices
+int GbaOutput_ReadTileMapPalettes(
+	const char *Filename,
+	const struct TilesData_t *TilesData,
+	int32_t *TilePalIdx,
+	int BottomUp
+) {
+	int tx, ty;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+	uint8_t *Buffer = GbaOutput_ReadFile(Filename, nTiles);
+	if(!Buffer) return 0;
+
+	//! Extract palette indices
+	const uint8_t *Src = Buffer;
+	for(ty=0;ty<TilesData->TilesY;ty++) for(tx=0;tx<TilesData->TilesX;tx++) {
+		TilePalIdx[GbaOutput_TileRow(TilesData, ty, BottomUp)*TilesData->TilesX + tx] = GbaOutput_Get16(Src) >> 12;
+		Src += sizeof(uint16_t);
+	}
+	free(Buffer);
+	return 1;
+}
+
+/**************************************/
+//! EOF
+/**************************************/
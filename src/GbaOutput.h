@@ -0,0 +1,102 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stdint.h>
+/**************************************/
+#include "Colourspace.h"
+#include "Tiles.h"
+/**************************************/
+
+//! Tile character depths
+//!  GBAOUTPUT_CHARS_4BPP packs two palette-relative indices per byte
+//!  (left pixel in the low nibble), for use with 16-colour palettes.
+//!  GBAOUTPUT_CHARS_8BPP stores the absolute palette index of every
+//!  pixel, for use with a single 256-colour palette.
+#define GBAOUTPUT_CHARS_4BPP 4
+#define GBAOUTPUT_CHARS_8BPP 8
+
+/**************************************/
+
+//! Write tile characters
+//! The unique tiles of TileMap[] (built by TilesData_BuildTileMap()
+//! with MaxPalSize for 4bpp, or 256 for 8bpp) are stored in order of
+//! their TileIdx, with the pixels of each tile in row-major order.
+//! Returns 0 on failure (out of memory, or write error).
+//! NOTE: When BottomUp is not zero, PxIdx[] is vertically inverted
+//! (as loaded by BmpCtx_FromFile()), and tiles are stored upright.
+//! NOTE: Tiles other than 8x8 are stored as a single character of
+//! TileW*TileH pixels.
+int GbaOutput_WriteChars(
+	const char *Filename,
+	const struct TilesData_t *TilesData,
+	const uint8_t *PxIdx,
+	const struct TileMapEntry_t *TileMap,
+	int nUniqueTiles,
+	int MaxPalSize,
+	int BitDepth,
+	int BottomUp
+);
+
+//! Write palette as BGR555 (16-bit, little endian):
+//!  Bit0..4:   Red
+//!  Bit5..9:   Green
+//!  Bit10..14: Blue
+//!  Bit15:     Alpha (only when BitRange has an alpha bit)
+//! Palette i is stored at entry i*PalStride, and unused entries are
+//! left blank (eg. to pad palettes to 16 colours for 4bpp tiles).
+//! Returns 0 on failure (out of memory, or write error).
+//! NOTE: Palette[] holds the final BGRA colours (as output by Qualetize()),
+//! and these are converted back to BitRange levels before widening to 5bit.
+int GbaOutput_WritePalette(
+	const char *Filename,
+	const struct BGRA8_t *Palette,
+	int nPalettes,
+	int nColoursPerPalette,
+	int PalStride,
+	const struct BGRA8_t *BitRange
+);
+
+//! Read palette as BGR555 (as written by GbaOutput_WritePalette())
+//! Palette i is read from entry i*PalStride, and stored to Palette[] as
+//! nColoursPerPalette final BGRA colours (ie. exact levels of BitRange).
+//! Returns 0 on failure (out of memory, read error, or file too short).
+int GbaOutput_ReadPalette(
+	const char *Filename,
+	struct BGRA8_t *Palette,
+	int nPalettes,
+	int nColoursPerPalette,
+	int PalStride,
+	const struct BGRA8_t *BitRange
+);
+
+//! Write tilemap as screen entries (16-bit, little endian):
+//!  Bit0..9:   Tile index
+//!  Bit10:     Horizontal flip
+//!  Bit11:     Vertical flip
+//!  Bit12..15: Palette index
+//! Returns 0 on failure (out of memory, or write error).
+//! NOTE: Entries that don't fit are truncated, and counted in nOverflow.
+//! NOTE: Rows are stored from the top of the image (see GbaOutput_WriteChars()).
+int GbaOutput_WriteTileMap(
+	const char *Filename,
+	const struct TilesData_t *TilesData,
+	const struct TileMapEntry_t *TileMap,
+	int  BottomUp,
+	int *nOverflow
+);
+
+//! Read the palette index of every tile from a tilemap
+//! (as written by GbaOutput_WriteTileMap()), to TilePalIdx[]
+//! Returns 0 on failure (out of memory, read error, or file too short).
+//! NOTE: When BottomUp is not zero, tiles are stored as per a vertically
+//! inverted image (see GbaOutput_WriteChars()).
+int GbaOutput_ReadTileMapPalettes(
+	const char *Filename,
+	const struct TilesData_t *TilesData,
+	int32_t *TilePalIdx,
+	int BottomUp
+);
+
+/**************************************/
+//! EOF
+/**************************************/
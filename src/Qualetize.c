@@ -1,5 +1,6 @@
 /**************************************/
 #include <stdlib.h>
+#include <string.h>
 /**************************************/
 #include "Bitmap.h"
 #include "Colourspace.h"
@@ -8,6 +9,108 @@
 #include "Tiles.h"
 /**************************************/
 
+//! Convert palette to BGRA and reduce range
+static void Qualetize_ReducePalette(struct BGRAf_t *Palette, int nColours, const struct BGRA8_t *BitRange) {
+	int i;
+	for(i=0;i<nColours;i++) {
+		struct BGRAf_t p = BGRAf_FromYUV(&Palette[i]);
+		struct BGRA8_t p2 = BGRA_FromBGRAf(&p, BitRange);
+		Palette[i] = BGRAf_FromBGRA(&p2, BitRange);
+	}
+}
+
+//! Store the final palette, return it
+//! NOTE: This aliases over the original palette, but is
+//! safe because BGRA8_t is smaller than BGRAf_t
+static struct BGRA8_t *Qualetize_StorePalette(struct BGRAf_t *Palette) {
+	int i;
+	struct BGRA8_t *PalBGR = (struct BGRA8_t*)Palette;
+	for(i=0;i<BMP_PALETTE_COLOURS;i++) {
+		PalBGR[i] = BGRA8_FromBGRAf(&Palette[i]);
+	}
+	return PalBGR;
+}
+
+//! Store new image data
+static void Qualetize_ReplaceImage(struct BmpCtx_t *Image, uint8_t *PxData, struct BGRA8_t *PalBGR) {
+	if(Image->ColPal) {
+		free(Image->ColPal);
+		free(Image->PxIdx);
+	} else free(Image->PxBGR);
+	Image->ColPal = PalBGR;
+	Image->PxIdx  = PxData;
+}
+
+//! Do final dithering+palette processing, return RMS error
+//! NOTE: Without dithering (or with tile-local diffusion), the output
+//! of a tile depends only on its content and palette, so duplicate tiles
+//! are only processed once, and then copied over from the tile they
+//! duplicate (flipped duplicates receive the flipped output).
+static struct BGRAf_t Qualetize_Remap(
+	const struct BmpCtx_t *Image,
+	struct TilesData_t *TilesData,
+	uint8_t *PxData,
+	const struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	struct ThreadPool_t *Pool,
+	struct Arena_t *Arena
+) {
+	int i;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+	const int32_t *TileCount = NULL;
+	if((DitherType == DITHER_NONE || DitherType == DITHER_FLOYDSTEINBERG_TILE) && TilesData->nUniqueTiles < nTiles) {
+		TileCount = TilesData->TileCount;
+	}
+	struct Stats_Timer_t Timer = Stats_Begin(TilesData->Stats);
+	struct BGRAf_t RMSE = DitherImage(
+		Image,
+		BitRange,
+		NULL,
+		NULL,
+		TilesData->TileW,
+		TilesData->TileH,
+		MaxTilePals,
+		MaxPalSize,
+		PalUnused,
+		TilesData->TilePalIdx,
+		Palette,
+		PxData,
+		TileCount,
+		DitherType,
+		DitherLevel,
+		TilesData->PxTemp,
+		Pool,
+		Arena
+	);
+
+	if(TileCount) {
+		int x, y;
+		int TileW = TilesData->TileW;
+		int TileH = TilesData->TileH;
+		int ImgW  = Image->Width;
+		for(i=0;i<nTiles;i++) if(!TileCount[i]) {
+			int Ref  = TilesData->TileRef [i];
+			int Flip = TilesData->TileFlip[i];
+			uint8_t       *Dst = PxData + (i  /TilesData->TilesX)*TileH*ImgW + (i  %TilesData->TilesX)*TileW;
+			const uint8_t *Src = PxData + (Ref/TilesData->TilesX)*TileH*ImgW + (Ref%TilesData->TilesX)*TileW;
+			for(y=0;y<TileH;y++) for(x=0;x<TileW;x++) {
+				int sx = (Flip & TILE_FLIP_H) ? (TileW-1 - x) : x;
+				int sy = (Flip & TILE_FLIP_V) ? (TileH-1 - y) : y;
+				Dst[y*ImgW + x] = Src[sy*ImgW + sx];
+			}
+		}
+	}
+	Stats_End(TilesData->Stats, STATS_STAGE_REMAP, &Timer, (uint64_t)Image->Width*Image->Height);
+	return RMSE;
+}
+
+/**************************************/
+
 //! Handle conversion of image with given palette, return RMS error
 //! NOTE: Lots of pointer aliasing to avoid even more memory consumption
 struct BGRAf_t Qualetize(
@@ -18,15 +121,13 @@ struct BGRAf_t Qualetize(
 	int   MaxTilePals,
 	int   MaxPalSize,
 	int   PalUnused,
-	int   nTileClusterPasses,
-	int   nColourClusterPasses,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams,
 	const struct BGRA8_t *BitRange,
 	int   DitherType,
 	float DitherLevel,
 	int   ReplaceImage
 ) {
-	int i;
-
 	//! Do palette allocation and colour clustering
 	TilesData_QuantizePalettes(
 		TilesData,
@@ -34,55 +135,273 @@ struct BGRAf_t Qualetize(
 		MaxTilePals,
 		MaxPalSize,
 		PalUnused,
-		nTileClusterPasses,
-		nColourClusterPasses
+		TileClusterParams,
+		ColourClusterParams
 	);
+	Qualetize_ReducePalette(Palette, MaxTilePals*MaxPalSize, BitRange);
 
-	//! Convert palette to BGRA and reduce range
+	//! Do final dithering+palette processing
+	struct BGRAf_t RMSE = Qualetize_Remap(
+		Image,
+		TilesData,
+		PxData,
+		Palette,
+		MaxTilePals,
+		MaxPalSize,
+		PalUnused,
+		BitRange,
+		DitherType,
+		DitherLevel,
+		ColourClusterParams->Pool,
+		ColourClusterParams->Arena
+	);
+
+	//! Store the final palette and new image data
+	struct BGRA8_t *PalBGR = Qualetize_StorePalette(Palette);
+	if(ReplaceImage) Qualetize_ReplaceImage(Image, PxData, PalBGR);
+
+	//! Return error
+	return RMSE;
+}
+
+/**************************************/
+
+//! Handle conversion of image with given palettes
+int QualetizeWithPalettes(
+	struct BmpCtx_t *Image,
+	struct TilesData_t *TilesData,
+	uint8_t *PxData,
+	struct BGRAf_t *Palette,
+	const struct BGRA8_t *SrcPalette,
+	const int32_t *TilePalIdx,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	int   ReplaceImage,
+	struct ThreadPool_t *Pool,
+	struct BGRAf_t *RMSE
+) {
+	//! Reduce the given palettes to BitRange, as if they were quantized
+	int i;
 	for(i=0;i<MaxTilePals*MaxPalSize;i++) {
-		struct BGRAf_t p = BGRAf_FromYUV(&Palette[i]);
+		struct BGRAf_t p  = BGRAf_FromBGRA8(&SrcPalette[i]);
 		struct BGRA8_t p2 = BGRA_FromBGRAf(&p, BitRange);
 		Palette[i] = BGRAf_FromBGRA(&p2, BitRange);
 	}
 
+	//! Pick the palette of every tile (in place of clustering)
+	if(!TilesData_AssignPalettes(
+		TilesData,
+		Palette,
+		MaxTilePals,
+		MaxPalSize,
+		PalUnused,
+		TilePalIdx,
+		Pool
+	)) return 0;
+
 	//! Do final dithering+palette processing
-	struct BGRAf_t RMSE = DitherImage(
+	*RMSE = Qualetize_Remap(
 		Image,
-		BitRange,
-		NULL,
-		TilesData->TileW,
-		TilesData->TileH,
+		TilesData,
+		PxData,
+		Palette,
 		MaxTilePals,
 		MaxPalSize,
 		PalUnused,
-		TilesData->TilePalIdx,
-		Palette,
-		PxData,
+		BitRange,
 		DitherType,
 		DitherLevel,
-		TilesData->PxTemp
+		Pool,
+		TilesData->Arena
 	);
 
+	//! Store the final palette and new image data
+	struct BGRA8_t *PalBGR = Qualetize_StorePalette(Palette);
+	if(ReplaceImage) Qualetize_ReplaceImage(Image, PxData, PalBGR);
+	return 1;
+}
+
+/**************************************/
+
+//! Handle conversion of several images with shared palettes
+int QualetizeShared(
+	struct BmpCtx_t *const *Images,
+	struct TilesData_t *const *TilesData,
+	uint8_t *const *PxData,
+	int   nImages,
+	struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	int   ReplaceImage,
+	struct BGRAf_t *RMSE
+) {
+	int i;
+	if(nImages <= 0) return 0;
+
+	//! Do palette allocation and colour clustering over all images
+	if(!TilesData_QuantizeSharedPalettes(
+		TilesData,
+		nImages,
+		Palette,
+		MaxTilePals,
+		MaxPalSize,
+		PalUnused,
+		TileClusterParams,
+		ColourClusterParams
+	)) return 0;
+	Qualetize_ReducePalette(Palette, MaxTilePals*MaxPalSize, BitRange);
+
+	//! Do final dithering+palette processing of every image
+	for(i=0;i<nImages;i++) {
+		RMSE[i] = Qualetize_Remap(
+			Images[i],
+			TilesData[i],
+			PxData[i],
+			Palette,
+			MaxTilePals,
+			MaxPalSize,
+			PalUnused,
+			BitRange,
+			DitherType,
+			DitherLevel,
+			ColourClusterParams->Pool,
+			ColourClusterParams->Arena
+		);
+	}
+
 	//! Store the final palette
-	//! NOTE: This aliases over the original palette, but is
-	//! safe because BGRA8_t is smaller than BGRAf_t
-	struct BGRA8_t *PalBGR = (struct BGRA8_t*)Palette;
+	struct BGRA8_t *PalBGR = Qualetize_StorePalette(Palette);
+
+	//! Store new image data
+	//! NOTE: Every image receives its own copy of the palette,
+	//! and all copies are made before any image is modified.
+	if(ReplaceImage) {
+		struct BGRA8_t **PalCopy = calloc(nImages, sizeof(struct BGRA8_t*));
+		int Ok = (PalCopy != NULL);
+		for(i=0;i<nImages && Ok;i++) {
+			PalCopy[i] = malloc(BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
+			if(PalCopy[i]) memcpy(PalCopy[i], PalBGR, BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
+			else Ok = 0;
+		}
+		if(Ok) for(i=0;i<nImages;i++) Qualetize_ReplaceImage(Images[i], PxData[i], PalCopy[i]);
+		else if(PalCopy) for(i=0;i<nImages;i++) free(PalCopy[i]);
+		free(PalCopy);
+		if(!Ok) return 0;
+	}
+	return 1;
+}
+
+/**************************************/
+
+//! Handle conversion of a streamed image
+int QualetizeStream(
+	struct TilesData_t *TilesData,
+	const char *OutFilename,
+	struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *RMSE
+) {
+	int i;
+	struct BmpStream_t *Src = TilesData->Stream;
+
+	//! Do palette allocation and colour clustering
+	if(!TilesData_QuantizePalettes(
+		TilesData,
+		Palette,
+		MaxTilePals,
+		MaxPalSize,
+		PalUnused,
+		TileClusterParams,
+		ColourClusterParams
+	)) return 0;
+
+	//! Convert palette to BGRA and reduce range
+	//! NOTE: The output file needs the final palette before any
+	//! pixels are written, so this is stored separately for now.
+	struct BGRA8_t PalBGR[BMP_PALETTE_COLOURS];
+	Qualetize_ReducePalette(Palette, MaxTilePals*MaxPalSize, BitRange);
 	for(i=0;i<BMP_PALETTE_COLOURS;i++) {
 		PalBGR[i] = BGRA8_FromBGRAf(&Palette[i]);
 	}
 
-	//! Store new image data
-	if(ReplaceImage) {
-		if(Image->ColPal) {
-			free(Image->ColPal);
-			free(Image->PxIdx);
-		} else free(Image->PxBGR);
-		Image->ColPal = PalBGR;
-		Image->PxIdx  = PxData;
+	//! Create the output file and band buffers
+	int ImgW  = TilesData->TilesX * TilesData->TileW;
+	int ImgH  = TilesData->TilesY * TilesData->TileH;
+	int BandH = TilesData->BandTileRows * TilesData->TileH;
+	struct BmpStream_t Dst;
+	struct BmpCtx_t Band;
+	if(!BmpStream_Create(&Dst, OutFilename, ImgW, ImgH, PalBGR)) return 0;
+	if(!BmpStream_CreateBand(Src, &Band, BandH)) {
+		BmpStream_Close(&Dst);
+		return 0;
 	}
+	uint8_t *PxData = malloc(ImgW * BandH * sizeof(uint8_t));
+	int Ok = (PxData && BmpStream_Rewind(Src));
 
-	//! Return error
-	return RMSE;
+	//! Do final dithering+palette processing, one band at a time
+	struct DitherState_t Dither;
+	DitherImage_Begin(
+		&Dither,
+		ImgW,
+		BitRange,
+		TilesData->TileW,
+		TilesData->TileH,
+		MaxTilePals,
+		MaxPalSize,
+		PalUnused,
+		Palette,
+		DitherType,
+		DitherLevel,
+		TilesData->PxTemp,
+		ColourClusterParams->Pool,
+		ColourClusterParams->Arena
+	);
+	int TileY;
+	for(TileY=0;TileY<TilesData->TilesY && Ok;TileY+=TilesData->BandTileRows) {
+		int nRows = TilesData->TilesY - TileY;
+		if(nRows > TilesData->BandTileRows) nRows = TilesData->BandTileRows;
+		nRows *= TilesData->TileH;
+		struct Stats_Timer_t Timer = Stats_Begin(TilesData->Stats);
+		Ok = BmpStream_ReadRows(Src, &Band, nRows);
+		Stats_End(TilesData->Stats, STATS_STAGE_LOAD, &Timer, (uint64_t)nRows*ImgW);
+		if(Ok) {
+			Timer = Stats_Begin(TilesData->Stats);
+			DitherImage_Rows(&Dither, &Band, NULL, NULL, TilesData->TilePalIdx + TileY*TilesData->TilesX, PxData, NULL);
+			Stats_End(TilesData->Stats, STATS_STAGE_REMAP, &Timer, (uint64_t)nRows*ImgW);
+			Timer = Stats_Begin(TilesData->Stats);
+			Ok = BmpStream_WriteRows(&Dst, PxData, nRows);
+			Stats_End(TilesData->Stats, STATS_STAGE_WRITE, &Timer, (uint64_t)nRows*ImgW);
+		}
+	}
+	*RMSE = DitherImage_End(&Dither);
+
+	//! Clean up
+	free(PxData);
+	BmpCtx_Destroy(&Band);
+	if(!BmpStream_Close(&Dst)) Ok = 0;
+
+	//! Store the final palette
+	//! NOTE: This aliases over the original palette, as per Qualetize()
+	struct BGRA8_t *PalOut = (struct BGRA8_t*)Palette;
+	for(i=0;i<BMP_PALETTE_COLOURS;i++) PalOut[i] = PalBGR[i];
+	return Ok;
 }
 
 /**************************************/
@@ -3,6 +3,7 @@
 /**************************************/
 #include "Bitmap.h"
 #include "Colourspace.h"
+#include "Quantize.h"
 #include "Tiles.h"
 /**************************************/
 
@@ -13,6 +14,7 @@
 #define DITHER_NONE           ( 0) //! No dither
 #define DITHER_ORDERED(n)     ( n) //! Ordered dithering (Kernel size: (2^n) x (2^n))
 #define DITHER_FLOYDSTEINBERG (-1) //! Floyd-Steinberg (diffusion)
+#define DITHER_FLOYDSTEINBERG_TILE (-2) //! Floyd-Steinberg, with diffusion confined to each tile
 #define DITHER_NO_ALPHA
 
 /**************************************/
@@ -29,14 +31,94 @@ struct BGRAf_t Qualetize(
 	int   MaxTilePals,
 	int   MaxPalSize,
 	int   PalUnused,
-	int   nTileClusterPasses,
-	int   nColourClusterPasses,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams,
 	const struct BGRA8_t *BitRange,
 	int   DitherType,
 	float DitherLevel,
 	int   ReplaceImage
 );
 
+//! Handle conversion of image with given palettes, return RMS error
+//! This skips clustering entirely: every tile is given the palette that
+//! fits it best (see TilesData_AssignPalettes()), or that of TilePalIdx[]
+//! when this is not NULL, and the image is then remapped as per Qualetize().
+//! Returns 0 on failure (out of memory, or palette indices out of range),
+//! else 1, and stores the RMS error to RMSE.
+//! NOTE: SrcPalette[] holds MaxTilePals*MaxPalSize colours (palette i at
+//! SrcPalette[i*MaxPalSize]), which are reduced to BitRange. Palette[]
+//! needs BMP_PALETTE_COLOURS elements, and receives the final palette as
+//! BGRA8_t[] (as per Qualetize()).
+//! NOTE: Pool may be NULL; scratch memory is taken from TilesData->Arena.
+int QualetizeWithPalettes(
+	struct BmpCtx_t *Image,
+	struct TilesData_t *TilesData,
+	uint8_t *PxData,
+	struct BGRAf_t *Palette,
+	const struct BGRA8_t *SrcPalette,
+	const int32_t *TilePalIdx,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	int   ReplaceImage,
+	struct ThreadPool_t *Pool,
+	struct BGRAf_t *RMSE
+);
+
+//! Handle conversion of several images with shared palettes
+//! The palettes are quantized over the tiles of all images (see
+//! TilesData_QuantizeSharedPalettes()), and every image is then
+//! processed with these, as per Qualetize(). The RMS error of each
+//! image is stored to RMSE[nImages].
+//! Returns 0 on failure (out of memory, or images that don't match).
+//! NOTE: Palette[] receives the shared palette as BGRA8_t[] (as per
+//! Qualetize()). With ReplaceImage != 0, each image receives its own
+//! copy of this palette, and PxData[i] for its pixels.
+int QualetizeShared(
+	struct BmpCtx_t *const *Images,
+	struct TilesData_t *const *TilesData,
+	uint8_t *const *PxData,
+	int   nImages,
+	struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	int   ReplaceImage,
+	struct BGRAf_t *RMSE
+);
+
+//! Handle conversion of a streamed image (see TilesData_FromStream()),
+//! writing the output to OutFilename as it is produced
+//! Returns 0 on failure (out of memory, or read/write error), else 1,
+//! and stores the RMS error to RMSE.
+//! NOTE: Palette[] needs BMP_PALETTE_COLOURS elements, and receives
+//! the final palette as BGRA8_t[] (as per Qualetize()).
+//! NOTE: Colours are always clustered from a histogram, so the output
+//! matches Qualetize() only with ColourClusterParams->Histogram set
+//! (see TILESDATA_STORAGE_STREAM).
+int QualetizeStream(
+	struct TilesData_t *TilesData,
+	const char *OutFilename,
+	struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *RMSE
+);
+
 /**************************************/
 //! EOF
 /**************************************/
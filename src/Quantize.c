@@ -1,10 +1,51 @@
 /**************************************/
 #include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 /**************************************/
 #include "Colourspace.h"
 #include "Quantize.h"
 /**************************************/
 
+//! When not zero, the nearest-centroid search in the refinement
+//! passes will use SSE2 (and AVX2, when the CPU supports it).
+//! Setting this to 0 forces the plain scalar search.
+#ifndef QUANTCLUSTER_USE_SIMD
+# define QUANTCLUSTER_USE_SIMD 1
+#endif
+
+/**************************************/
+#if QUANTCLUSTER_USE_SIMD && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+# define QUANTCLUSTER_SSE2 1
+# include <emmintrin.h>
+# if defined(__AVX2__)
+#  define QUANTCLUSTER_AVX2 1 //! Always available
+#  include <immintrin.h>
+# elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define QUANTCLUSTER_AVX2 2 //! Available via runtime dispatch
+#  include <immintrin.h>
+# endif
+#endif
+/**************************************/
+#define ALIGN2N(x,N) (((x) + (N)-1) &~ ((N)-1))
+#define DATA_ALIGNMENT 32
+#define DATA_ALIGN(x) ALIGN2N((uintptr_t)(x), DATA_ALIGNMENT) //! NOTE: Cast to uintptr_t
+
+//! Refinement passes process Data[] in chunks of at least
+//! CHUNK_MIN_SIZE points, and at most MAX_CHUNKS chunks.
+//! NOTE: The chunk layout must only depend on nData, as the
+//! training accumulators are summed per chunk.
+#define CHUNK_MIN_SIZE 4096
+#define MAX_CHUNKS      256
+
+//! Safety margin for distance bounds (QUANTCLUSTER_ENGINE_HAMERLY)
+//! This is far larger than the rounding error of the bounds, so that
+//! skipped points are guaranteed to match the brute-force search.
+#define BOUND_TOLERANCE_REL 1.0e-4f
+#define BOUND_TOLERANCE_ABS 1.0e-7f
+/**************************************/
+
 //! Clear training data (NOTE: Do NOT destroy the centroid or linked list position)
 static inline void QuantCluster_ClearTraining(struct QuantCluster_t *x) {
 	x->nPoints = 0;
@@ -12,14 +53,18 @@ static inline void QuantCluster_ClearTraining(struct QuantCluster_t *x) {
 	x->Train = x->Dist = (struct BGRAf_t){0,0,0,0};
 }
 
-//! Add data to training
-static inline void QuantCluster_Train(struct QuantCluster_t *Dst, const struct BGRAf_t *Data) {
-	struct BGRAf_t Dist = BGRAf_Sub(Data, &Dst->Centroid);
+//! Add data to training, relative to a given centroid
+//! NOTE: Weight scales the contribution of the point, so that a point
+//! of weight N trains the same as N copies of it (up to rounding).
+static inline void QuantCluster_TrainAt(struct QuantCluster_t *Dst, const struct BGRAf_t *Centroid, const struct BGRAf_t *Data, float Weight) {
+	struct BGRAf_t Dist = BGRAf_Sub(Data, Centroid);
 	Dist = BGRAf_Abs(&Dist);
 
 	float DistW  = BGRAf_Len2(&Dist);
 	float TrainW = 0.001f + DistW; //! <- This will help outliers pop out more often (must not be 0.0!)
 	DistW *= 1.0f + Dist.b*Dist.b; //! <- Further penalize distortion by luma distortion
+	TrainW *= Weight;
+	DistW  *= Weight;
 	struct BGRAf_t TrainData = BGRAf_Muli( Data, TrainW);
 	struct BGRAf_t DistData  = BGRAf_Muli(&Dist, DistW);
 	Dst->TrainWeight += TrainW, Dst->Train = BGRAf_Add(&Dst->Train, &TrainData);
@@ -27,6 +72,21 @@ static inline void QuantCluster_Train(struct QuantCluster_t *Dst, const struct B
 	Dst->nPoints++;
 }
 
+//! Add data to training
+static inline void QuantCluster_Train(struct QuantCluster_t *Dst, const struct BGRAf_t *Data, float Weight) {
+	QuantCluster_TrainAt(Dst, &Dst->Centroid, Data, Weight);
+}
+
+//! Get weight of a data point
+#define DATA_WEIGHT(DataWeight, n) ((DataWeight) ? (DataWeight)[n] : 1.0f)
+
+//! Merge training data
+static inline void QuantCluster_MergeTraining(struct QuantCluster_t *Dst, const struct QuantCluster_t *Src) {
+	Dst->nPoints     += Src->nPoints;
+	Dst->TrainWeight += Src->TrainWeight, Dst->Train = BGRAf_Add(&Dst->Train, &Src->Train);
+	Dst->DistWeight  += Src->DistWeight,  Dst->Dist  = BGRAf_Add(&Dst->Dist,  &Src->Dist);
+}
+
 //! Resolve the centroid from training data
 static inline int QuantCluster_Resolve(struct QuantCluster_t *x) {
 	if(x->nPoints) x->Centroid = BGRAf_Divi(&x->Train, x->TrainWeight);
@@ -34,24 +94,31 @@ static inline int QuantCluster_Resolve(struct QuantCluster_t *x) {
 }
 
 //! Split a quantization cluster
-static inline void QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCluster, int DstCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int Recluster) {
+//! Members[] lists the indices of the data points in SrcCluster (in
+//! increasing order), and these are re-assigned between SrcCluster and
+//! DstCluster; passing Members = NULL does not recluster the data.
+//! NOTE: When reclustering with distance bounds (Upper != NULL), the
+//! bounds of all affected points are reset to trivially-valid values.
+static inline void QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCluster, int DstCluster, const struct BGRAf_t *Data, const float *DataWeight, int32_t *DataClusters, const int32_t *Members, int nMembers, float *Upper, float *Lower) {
 	//! Shift the cluster in either direction of the distortion vector
 	struct BGRAf_t Dist = BGRAf_Divi(&Clusters[SrcCluster].Dist, Clusters[SrcCluster].DistWeight);
 	Clusters[DstCluster].Centroid = BGRAf_Add(&Clusters[SrcCluster].Centroid, &Dist);
 	Clusters[SrcCluster].Centroid = BGRAf_Sub(&Clusters[SrcCluster].Centroid, &Dist);
 
 	//! Re-assign clusters
-	if(Recluster) {
-		int n;
+	if(Members) {
+		int i;
 		QuantCluster_ClearTraining(&Clusters[SrcCluster]);
 		QuantCluster_ClearTraining(&Clusters[DstCluster]);
-		for(n=0;n<nData;n++) if(DataClusters[n] == SrcCluster) {
+		for(i=0;i<nMembers;i++) {
+			int n = Members[i];
+			if(Upper) Upper[n] = INFINITY, Lower[n] = 0.0f;
 			float DistSrc = BGRAf_ColDistance(&Data[n], &Clusters[SrcCluster].Centroid);
 			float DistDst = BGRAf_ColDistance(&Data[n], &Clusters[DstCluster].Centroid);
 			if(DistSrc < DistDst) {
-				QuantCluster_Train(&Clusters[SrcCluster], &Data[n]);
+				QuantCluster_Train(&Clusters[SrcCluster], &Data[n], DATA_WEIGHT(DataWeight, n));
 			} else {
-				QuantCluster_Train(&Clusters[DstCluster], &Data[n]);
+				QuantCluster_Train(&Clusters[DstCluster], &Data[n], DATA_WEIGHT(DataWeight, n));
 				DataClusters[n] = DstCluster;
 			}
 		}
@@ -60,47 +127,628 @@ static inline void QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCl
 	}
 }
 
+//! Bucket the data points by cluster (counting sort)
+//! Points of cluster k are MemberIdx[MemberStart[k] .. MemberStart[k+1]-1],
+//! in increasing order.
+static void QuantCluster_BuildMembership(const int32_t *DataClusters, int nData, int nCluster, int32_t *MemberStart, int32_t *MemberIdx) {
+	int n, k;
+	for(k=0;k<=nCluster;k++) MemberStart[k] = 0;
+	for(n=0;n<nData;n++) MemberStart[DataClusters[n]+1]++;
+	for(k=0;k<nCluster;k++) MemberStart[k+1] += MemberStart[k];
+	for(n=0;n<nData;n++) MemberIdx[MemberStart[DataClusters[n]]++] = n;
+	for(k=nCluster;k>0;k--) MemberStart[k] = MemberStart[k-1];
+	MemberStart[0] = 0;
+}
+
 /**************************************/
 
-//! Place a cluster in a distortion linked list (Head = Most distorted)
-static int QuantCluster_InsertToDistortionList(struct QuantCluster_t *Clusters, int Idx, int Head) {
-	int Next = Head;
-	int Prev = -1;
-	float Dist = Clusters[Idx].DistWeight;
-	if(Dist != 0.0f) {
-		while(Next != -1 && Dist < Clusters[Next].DistWeight) {
-			Prev = Next;
-			Next = Clusters[Next].Next;
-		}
-		Clusters[Idx].Next = Next;
+//! Check if cluster a comes before cluster b in the distortion list
+//! NOTE: Ties go to the higher index, matching the order of the
+//! sorted-insertion list this replaced.
+static inline int QuantCluster_DistortionBefore(const struct QuantCluster_t *Clusters, int a, int b) {
+	float DistA = Clusters[a].DistWeight;
+	float DistB = Clusters[b].DistWeight;
+	return (DistA > DistB) || (DistA == DistB && a > b);
+}
+
+//! Restore the heap property below Heap[i]
+static void QuantCluster_HeapSiftDown(const struct QuantCluster_t *Clusters, int32_t *Heap, int nHeap, int i) {
+	int32_t x = Heap[i];
+	for(;;) {
+		int c = 2*i + 1;
+		if(c >= nHeap) break;
+		if(c+1 < nHeap && QuantCluster_DistortionBefore(Clusters, Heap[c+1], Heap[c])) c++;
+		if(!QuantCluster_DistortionBefore(Clusters, Heap[c], x)) break;
+		Heap[i] = Heap[c], i = c;
+	}
+	Heap[i] = x;
+}
+
+//! Build the distortion linked list (Head = Most distorted) from
+//! a set of cluster indices, returning the head (or -1 if empty)
+//! NOTE: Heap[] is used as a binary max-heap and is destroyed.
+static int QuantCluster_BuildDistortionList(struct QuantCluster_t *Clusters, int32_t *Heap, int nHeap) {
+	int i;
+	for(i=nHeap/2-1;i>=0;i--) QuantCluster_HeapSiftDown(Clusters, Heap, nHeap, i);
+	int Head = -1, Prev = -1;
+	while(nHeap) {
+		int Idx = Heap[0];
+		Heap[0] = Heap[--nHeap];
+		QuantCluster_HeapSiftDown(Clusters, Heap, nHeap, 0);
 		if(Prev != -1) Clusters[Prev].Next = Idx;
 		else Head = Idx;
+		Prev = Idx;
 	}
+	if(Prev != -1) Clusters[Prev].Next = -1;
 	return Head;
 }
 
 /**************************************/
 
-//! Perform total vector quantization
-void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses) {
+//! Copy centroids to structure-of-arrays layout
+static void QuantCluster_CentroidsFromClusters(struct QuantCluster_Centroids_t *Dst, const struct QuantCluster_t *Clusters, int nCluster) {
+	int j;
+	Dst->n       = nCluster;
+	Dst->nPadded = ALIGN2N(nCluster, QUANTCLUSTER_CENTROID_PADDING);
+	for(j=0;j<nCluster;j++) {
+		Dst->b[j] = Clusters[j].Centroid.b;
+		Dst->g[j] = Clusters[j].Centroid.g;
+		Dst->r[j] = Clusters[j].Centroid.r;
+		Dst->a[j] = Clusters[j].Centroid.a;
+	}
+	for(;j<Dst->nPadded;j++) Dst->b[j] = Dst->g[j] = Dst->r[j] = Dst->a[j] = INFINITY;
+}
+
+//! Get the number of floats needed to store n colours in structure-of-arrays layout
+int QuantCluster_CentroidsGetSize(int n) {
+	return 4*ALIGN2N(n, QUANTCLUSTER_CENTROID_PADDING);
+}
+
+//! Store colours in structure-of-arrays layout
+void QuantCluster_CentroidsFromColours(struct QuantCluster_Centroids_t *Dst, float *Buffer, const struct BGRAf_t *Colours, int n) {
+	int j;
+	Dst->n       = n;
+	Dst->nPadded = ALIGN2N(n, QUANTCLUSTER_CENTROID_PADDING);
+	Dst->b = Buffer;
+	Dst->g = Dst->b + Dst->nPadded;
+	Dst->r = Dst->g + Dst->nPadded;
+	Dst->a = Dst->r + Dst->nPadded;
+	for(j=0;j<n;j++) {
+		Dst->b[j] = Colours[j].b;
+		Dst->g[j] = Colours[j].g;
+		Dst->r[j] = Colours[j].r;
+		Dst->a[j] = Colours[j].a;
+	}
+	for(;j<Dst->nPadded;j++) Dst->b[j] = Dst->g[j] = Dst->r[j] = Dst->a[j] = INFINITY;
+}
+
+/**************************************/
+
+#ifndef QUANTCLUSTER_SSE2
+
+//! Nearest-centroid search (scalar)
+//! NOTE: This is the reference implementation; all other kernels
+//! must return the same index (ie. the first of any tied entries).
+static int QuantCluster_FindNearest_Scalar(const struct BGRAf_t *x, const struct QuantCluster_Centroids_t *Centroids) {
+	int   j;
+	int   BestIdx  = -1;
+	float BestDist = INFINITY;
+	for(j=0;j<Centroids->n;j++) {
+		struct BGRAf_t c = {Centroids->b[j], Centroids->g[j], Centroids->r[j], Centroids->a[j]};
+		float Dist = BGRAf_ColDistance(x, &c);
+		if(Dist < BestDist) BestIdx = j, BestDist = Dist;
+	}
+	return BestIdx;
+}
+
+#endif
+
+//! Resolve the best lane of a SIMD search
+//! NOTE: Each lane keeps the first index of its own minimum, so
+//! ties between lanes are resolved towards the lowest index.
+static inline int QuantCluster_FindNearest_ReduceLanes(const float *Dist, const int32_t *Idx, int nLanes) {
+	int   n;
+	int   BestIdx  = -1;
+	float BestDist = INFINITY;
+	for(n=0;n<nLanes;n++) if(Idx[n] != -1) {
+		if(Dist[n] < BestDist || (Dist[n] == BestDist && Idx[n] < BestIdx)) {
+			BestIdx  = Idx[n];
+			BestDist = Dist[n];
+		}
+	}
+	return BestIdx;
+}
+
+#if defined(QUANTCLUSTER_SSE2) && QUANTCLUSTER_AVX2 != 1
+
+//! Nearest-centroid search (SSE2, 8 centroids per iteration)
+//! NOTE: The distance is accumulated in the same order as
+//! BGRAf_ColDistance() to give bit-identical results.
+static int QuantCluster_FindNearest_SSE2(const struct BGRAf_t *x, const struct QuantCluster_Centroids_t *Centroids) {
+	int j;
+	__m128  xb = _mm_set1_ps(x->b), xg = _mm_set1_ps(x->g);
+	__m128  xr = _mm_set1_ps(x->r), xa = _mm_set1_ps(x->a);
+	__m128  BestDist0 = _mm_set1_ps(INFINITY), BestDist1 = BestDist0;
+	__m128i BestIdx0  = _mm_set1_epi32(-1),    BestIdx1  = BestIdx0;
+	__m128i CurIdx0   = _mm_setr_epi32(0,1,2,3);
+	__m128i CurIdx1   = _mm_setr_epi32(4,5,6,7);
+	const __m128i Step = _mm_set1_epi32(8);
+	for(j=0;j<Centroids->nPadded;j+=8) {
+		__m128 d, Dist0, Dist1, Mask;
+		d = _mm_sub_ps(xb, _mm_load_ps(Centroids->b + j+0)), Dist0 = _mm_mul_ps(d, d);
+		d = _mm_sub_ps(xb, _mm_load_ps(Centroids->b + j+4)), Dist1 = _mm_mul_ps(d, d);
+		d = _mm_sub_ps(xg, _mm_load_ps(Centroids->g + j+0)), Dist0 = _mm_add_ps(Dist0, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(xg, _mm_load_ps(Centroids->g + j+4)), Dist1 = _mm_add_ps(Dist1, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(xr, _mm_load_ps(Centroids->r + j+0)), Dist0 = _mm_add_ps(Dist0, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(xr, _mm_load_ps(Centroids->r + j+4)), Dist1 = _mm_add_ps(Dist1, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(xa, _mm_load_ps(Centroids->a + j+0)), Dist0 = _mm_add_ps(Dist0, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(xa, _mm_load_ps(Centroids->a + j+4)), Dist1 = _mm_add_ps(Dist1, _mm_mul_ps(d, d));
+
+		//! Keep the first minimum of each lane (Dist < BestDist)
+		Mask      = _mm_cmplt_ps(Dist0, BestDist0);
+		BestDist0 = _mm_or_ps(_mm_and_ps(Mask, Dist0), _mm_andnot_ps(Mask, BestDist0));
+		BestIdx0  = _mm_or_si128(_mm_and_si128(_mm_castps_si128(Mask), CurIdx0), _mm_andnot_si128(_mm_castps_si128(Mask), BestIdx0));
+		Mask      = _mm_cmplt_ps(Dist1, BestDist1);
+		BestDist1 = _mm_or_ps(_mm_and_ps(Mask, Dist1), _mm_andnot_ps(Mask, BestDist1));
+		BestIdx1  = _mm_or_si128(_mm_and_si128(_mm_castps_si128(Mask), CurIdx1), _mm_andnot_si128(_mm_castps_si128(Mask), BestIdx1));
+		CurIdx0   = _mm_add_epi32(CurIdx0, Step);
+		CurIdx1   = _mm_add_epi32(CurIdx1, Step);
+	}
+
+	//! Reduce lanes
+	float   LaneDist[8];
+	int32_t LaneIdx [8];
+	_mm_storeu_ps(LaneDist+0, BestDist0), _mm_storeu_si128((__m128i*)(LaneIdx+0), BestIdx0);
+	_mm_storeu_ps(LaneDist+4, BestDist1), _mm_storeu_si128((__m128i*)(LaneIdx+4), BestIdx1);
+	return QuantCluster_FindNearest_ReduceLanes(LaneDist, LaneIdx, 8);
+}
+
+#endif
+#ifdef QUANTCLUSTER_AVX2
+
+//! Nearest-centroid search (AVX2, 16 centroids per iteration)
+//! NOTE: FMA is deliberately not enabled here, so that results
+//! remain bit-identical to the scalar path.
+#if QUANTCLUSTER_AVX2 == 2
+__attribute__((target("avx2")))
+#endif
+static int QuantCluster_FindNearest_AVX2(const struct BGRAf_t *x, const struct QuantCluster_Centroids_t *Centroids) {
+	int j;
+	__m256  xb = _mm256_set1_ps(x->b), xg = _mm256_set1_ps(x->g);
+	__m256  xr = _mm256_set1_ps(x->r), xa = _mm256_set1_ps(x->a);
+	__m256  BestDist0 = _mm256_set1_ps(INFINITY), BestDist1 = BestDist0;
+	__m256i BestIdx0  = _mm256_set1_epi32(-1),    BestIdx1  = BestIdx0;
+	__m256i CurIdx0   = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+	__m256i CurIdx1   = _mm256_setr_epi32(8,9,10,11,12,13,14,15);
+	const __m256i Step = _mm256_set1_epi32(16);
+	for(j=0;j<Centroids->nPadded;j+=16) {
+		__m256 d, Dist0, Dist1, Mask;
+		d = _mm256_sub_ps(xb, _mm256_load_ps(Centroids->b + j+0)), Dist0 = _mm256_mul_ps(d, d);
+		d = _mm256_sub_ps(xb, _mm256_load_ps(Centroids->b + j+8)), Dist1 = _mm256_mul_ps(d, d);
+		d = _mm256_sub_ps(xg, _mm256_load_ps(Centroids->g + j+0)), Dist0 = _mm256_add_ps(Dist0, _mm256_mul_ps(d, d));
+		d = _mm256_sub_ps(xg, _mm256_load_ps(Centroids->g + j+8)), Dist1 = _mm256_add_ps(Dist1, _mm256_mul_ps(d, d));
+		d = _mm256_sub_ps(xr, _mm256_load_ps(Centroids->r + j+0)), Dist0 = _mm256_add_ps(Dist0, _mm256_mul_ps(d, d));
+		d = _mm256_sub_ps(xr, _mm256_load_ps(Centroids->r + j+8)), Dist1 = _mm256_add_ps(Dist1, _mm256_mul_ps(d, d));
+		d = _mm256_sub_ps(xa, _mm256_load_ps(Centroids->a + j+0)), Dist0 = _mm256_add_ps(Dist0, _mm256_mul_ps(d, d));
+		d = _mm256_sub_ps(xa, _mm256_load_ps(Centroids->a + j+8)), Dist1 = _mm256_add_ps(Dist1, _mm256_mul_ps(d, d));
+
+		//! Keep the first minimum of each lane (Dist < BestDist)
+		Mask      = _mm256_cmp_ps(Dist0, BestDist0, _CMP_LT_OQ);
+		BestDist0 = _mm256_blendv_ps(BestDist0, Dist0, Mask);
+		BestIdx0  = _mm256_blendv_epi8(BestIdx0, CurIdx0, _mm256_castps_si256(Mask));
+		Mask      = _mm256_cmp_ps(Dist1, BestDist1, _CMP_LT_OQ);
+		BestDist1 = _mm256_blendv_ps(BestDist1, Dist1, Mask);
+		BestIdx1  = _mm256_blendv_epi8(BestIdx1, CurIdx1, _mm256_castps_si256(Mask));
+		CurIdx0   = _mm256_add_epi32(CurIdx0, Step);
+		CurIdx1   = _mm256_add_epi32(CurIdx1, Step);
+	}
+
+	//! Reduce lanes
+	float   LaneDist[16];
+	int32_t LaneIdx [16];
+	_mm256_storeu_ps(LaneDist+0, BestDist0), _mm256_storeu_si256((__m256i*)(LaneIdx+0), BestIdx0);
+	_mm256_storeu_ps(LaneDist+8, BestDist1), _mm256_storeu_si256((__m256i*)(LaneIdx+8), BestIdx1);
+	return QuantCluster_FindNearest_ReduceLanes(LaneDist, LaneIdx, 16);
+}
+
+#endif
+
+//! Select the nearest-centroid search kernel
+QuantCluster_FindNearest_t QuantCluster_GetFindNearest(void) {
+#if QUANTCLUSTER_AVX2 == 1
+	return QuantCluster_FindNearest_AVX2;
+#else
+# if QUANTCLUSTER_AVX2 == 2
+	if(__builtin_cpu_supports("avx2")) return QuantCluster_FindNearest_AVX2;
+# endif
+# ifdef QUANTCLUSTER_SSE2
+	return QuantCluster_FindNearest_SSE2;
+# else
+	return QuantCluster_FindNearest_Scalar;
+# endif
+#endif
+}
+
+/**************************************/
+
+#ifndef QUANTCLUSTER_SSE2
+
+//! Distances to all centroids (scalar)
+//! NOTE: Padding entries are included, and evaluate to INFINITY.
+static void QuantCluster_GetDistances_Scalar(const struct BGRAf_t *x, const struct QuantCluster_Centroids_t *Centroids, float *Dist) {
+	int j;
+	for(j=0;j<Centroids->nPadded;j++) {
+		struct BGRAf_t c = {Centroids->b[j], Centroids->g[j], Centroids->r[j], Centroids->a[j]};
+		Dist[j] = BGRAf_ColDistance(x, &c);
+	}
+}
+
+#endif
+
+#if defined(QUANTCLUSTER_SSE2) && QUANTCLUSTER_AVX2 != 1
+
+//! Distances to all centroids (SSE2)
+static void QuantCluster_GetDistances_SSE2(const struct BGRAf_t *x, const struct QuantCluster_Centroids_t *Centroids, float *Dist) {
+	int j;
+	__m128 xb = _mm_set1_ps(x->b), xg = _mm_set1_ps(x->g);
+	__m128 xr = _mm_set1_ps(x->r), xa = _mm_set1_ps(x->a);
+	for(j=0;j<Centroids->nPadded;j+=4) {
+		__m128 d, s;
+		d = _mm_sub_ps(xb, _mm_load_ps(Centroids->b + j)), s = _mm_mul_ps(d, d);
+		d = _mm_sub_ps(xg, _mm_load_ps(Centroids->g + j)), s = _mm_add_ps(s, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(xr, _mm_load_ps(Centroids->r + j)), s = _mm_add_ps(s, _mm_mul_ps(d, d));
+		d = _mm_sub_ps(xa, _mm_load_ps(Centroids->a + j)), s = _mm_add_ps(s, _mm_mul_ps(d, d));
+		_mm_store_ps(Dist + j, s);
+	}
+}
+
+#endif
+#ifdef QUANTCLUSTER_AVX2
+
+//! Distances to all centroids (AVX2)
+#if QUANTCLUSTER_AVX2 == 2
+__attribute__((target("avx2")))
+#endif
+static void QuantCluster_GetDistances_AVX2(const struct BGRAf_t *x, const struct QuantCluster_Centroids_t *Centroids, float *Dist) {
+	int j;
+	__m256 xb = _mm256_set1_ps(x->b), xg = _mm256_set1_ps(x->g);
+	__m256 xr = _mm256_set1_ps(x->r), xa = _mm256_set1_ps(x->a);
+	for(j=0;j<Centroids->nPadded;j+=8) {
+		__m256 d, s;
+		d = _mm256_sub_ps(xb, _mm256_load_ps(Centroids->b + j)), s = _mm256_mul_ps(d, d);
+		d = _mm256_sub_ps(xg, _mm256_load_ps(Centroids->g + j)), s = _mm256_add_ps(s, _mm256_mul_ps(d, d));
+		d = _mm256_sub_ps(xr, _mm256_load_ps(Centroids->r + j)), s = _mm256_add_ps(s, _mm256_mul_ps(d, d));
+		d = _mm256_sub_ps(xa, _mm256_load_ps(Centroids->a + j)), s = _mm256_add_ps(s, _mm256_mul_ps(d, d));
+		_mm256_store_ps(Dist + j, s);
+	}
+}
+
+#endif
+
+//! Select the distance kernel
+typedef void (*QuantCluster_GetDistances_t)(const struct BGRAf_t *x, const struct QuantCluster_Centroids_t *Centroids, float *Dist);
+static QuantCluster_GetDistances_t QuantCluster_GetGetDistances(void) {
+#if QUANTCLUSTER_AVX2 == 1
+	return QuantCluster_GetDistances_AVX2;
+#else
+# if QUANTCLUSTER_AVX2 == 2
+	if(__builtin_cpu_supports("avx2")) return QuantCluster_GetDistances_AVX2;
+# endif
+# ifdef QUANTCLUSTER_SSE2
+	return QuantCluster_GetDistances_SSE2;
+# else
+	return QuantCluster_GetDistances_Scalar;
+# endif
+#endif
+}
+
+/**************************************/
+
+//! Refinement pass state
+struct QuantCluster_Pass_t {
+	const struct QuantCluster_t *Clusters;
+	const struct QuantCluster_Centroids_t *Centroids;
+	QuantCluster_FindNearest_t FindNearest;
+	const struct BGRAf_t *Data;
+	const float *DataWeight;
+	int      nData;
+	int32_t *DataClusters;
+	int      ChunkSize;
+	struct QuantCluster_t *ChunkTraining; //! [nChunks][nClusterCur]
+	float   *ChunkChanged;                //! [nChunks] Weight of points that changed cluster
+	uint64_t*ChunkDistances;              //! [nChunks] Distance evaluations
+
+	//! QUANTCLUSTER_ENGINE_HAMERLY only
+	//! Upper[] bounds the distance to the assigned centroid, and
+	//! Lower[] bounds the distance to every other centroid. These
+	//! are carried between passes by adding/subtracting the drift
+	//! of the centroids; HalfSep[] is half the distance from each
+	//! centroid to its nearest neighbour.
+	//! NOTE: All of these are linear (not squared) distances.
+	int    BoundsValid;
+	float *Upper;
+	float *Lower;
+	float *Drift;
+	float *HalfSep;
+	float  MaxDrift, MaxDrift2; //! Largest and second-largest drift
+	int    MaxDriftIdx;
+	float *ThreadDist;          //! [nThreads][nPadded] scratch distances
+	QuantCluster_GetDistances_t GetDistances;
+};
+
+//! Check whether a distance bound rules out any other centroid
+//! NOTE: Bounds accumulate rounding error from pass to pass, and
+//! squared distances are compared by the brute-force search, so we
+//! only trust a bound when it wins by a clear margin. Any point that
+//! falls inside the margin is simply searched exhaustively.
+static inline int QuantCluster_BoundHolds(float Upper, float Bound) {
+	return Upper + (BOUND_TOLERANCE_REL*Bound + BOUND_TOLERANCE_ABS) < Bound;
+}
+
+//! Assign a point using distance bounds (Hamerly's algorithm)
+static inline int QuantCluster_AssignBounded(const struct QuantCluster_Pass_t *Pass, int i, float *Dist, uint64_t *nDistances) {
+	int j;
+	const struct BGRAf_t *x = &Pass->Data[i];
+	if(Pass->BoundsValid) {
+		//! Update bounds for the centroid drift
+		int   a = Pass->DataClusters[i];
+		float u = Pass->Upper[i] + Pass->Drift[a];
+		float l = Pass->Lower[i] - ((a == Pass->MaxDriftIdx) ? Pass->MaxDrift2 : Pass->MaxDrift);
+		float m = (Pass->HalfSep[a] > l) ? Pass->HalfSep[a] : l;
+
+		//! Check bounds, then tighten the upper bound and re-check
+		Pass->Upper[i] = u, Pass->Lower[i] = l;
+		if(QuantCluster_BoundHolds(u, m)) return a;
+		u = sqrtf(BGRAf_ColDistance(x, &Pass->Clusters[a].Centroid));
+		Pass->Upper[i] = u;
+		*nDistances += 1;
+		if(QuantCluster_BoundHolds(u, m)) return a;
+	}
+
+	//! Exhaustive search, keeping the second-nearest distance as lower bound
+	//! NOTE: Same comparison order as QuantCluster_FindNearest_Scalar().
+	int   BestIdx   = -1;
+	float BestDist  = INFINITY;
+	float BestDist2 = INFINITY;
+	Pass->GetDistances(x, Pass->Centroids, Dist);
+	*nDistances += Pass->Centroids->n;
+	for(j=0;j<Pass->Centroids->n;j++) {
+		float d = Dist[j];
+		if(d < BestDist) BestIdx = j, BestDist2 = BestDist, BestDist = d;
+		else if(d < BestDist2) BestDist2 = d;
+	}
+	Pass->Upper[i] = sqrtf(BestDist);
+	Pass->Lower[i] = sqrtf(BestDist2);
+	return BestIdx;
+}
+
+//! Assign the points of a chunk to their nearest cluster and train
+static void QuantCluster_AssignChunk(void *Arg, int Chunk, int ThreadIdx) {
+	int i;
+	const struct QuantCluster_Pass_t *Pass = Arg;
+
+	//! Get chunk range and clear its training data
+	int nClusterCur = Pass->Centroids->n;
+	int Beg = Chunk*Pass->ChunkSize;
+	int End = Beg + Pass->ChunkSize; if(End > Pass->nData) End = Pass->nData;
+	struct QuantCluster_t *Training = Pass->ChunkTraining + Chunk*nClusterCur;
+	for(i=0;i<nClusterCur;i++) QuantCluster_ClearTraining(&Training[i]);
+
+	//! Process points
+	float  Changed = 0.0f;
+	float *Dist = Pass->Upper ? (Pass->ThreadDist + ThreadIdx*Pass->Centroids->nPadded) : NULL;
+	uint64_t nDistances = Pass->Upper ? 0 : (uint64_t)(End-Beg)*nClusterCur;
+	for(i=Beg;i<End;i++) {
+		int BestIdx;
+		if(Pass->Upper) BestIdx = QuantCluster_AssignBounded(Pass, i, Dist, &nDistances);
+		else BestIdx = Pass->FindNearest(&Pass->Data[i], Pass->Centroids);
+		float Weight = DATA_WEIGHT(Pass->DataWeight, i);
+		if(Pass->DataClusters[i] != BestIdx) Changed += Weight;
+		Pass->DataClusters[i] = BestIdx;
+		QuantCluster_TrainAt(&Training[BestIdx], &Pass->Clusters[BestIdx].Centroid, &Pass->Data[i], Weight);
+	}
+	Pass->ChunkChanged  [Chunk] = Changed;
+	Pass->ChunkDistances[Chunk] = nDistances;
+}
+
+//! Update the centroid drift and separation for the distance bounds
+static void QuantCluster_UpdateBounds(struct QuantCluster_Pass_t *Pass, const struct QuantCluster_t *Clusters, int nCluster, struct BGRAf_t *PrevCentroid) {
+	int j, k;
+
+	//! Get drift since the last assignment
+	Pass->MaxDrift    = 0.0f;
+	Pass->MaxDrift2   = 0.0f;
+	Pass->MaxDriftIdx = -1;
+	for(j=0;j<nCluster;j++) {
+		float Drift = Pass->BoundsValid ? sqrtf(BGRAf_ColDistance(&Clusters[j].Centroid, &PrevCentroid[j])) : 0.0f;
+		Pass->Drift[j] = Drift;
+		if(Drift > Pass->MaxDrift) {
+			Pass->MaxDrift2   = Pass->MaxDrift;
+			Pass->MaxDrift    = Drift;
+			Pass->MaxDriftIdx = j;
+		} else if(Drift > Pass->MaxDrift2) Pass->MaxDrift2 = Drift;
+		PrevCentroid[j] = Clusters[j].Centroid;
+	}
+
+	//! Get half the distance to the nearest other centroid
+	for(j=0;j<nCluster;j++) Pass->HalfSep[j] = INFINITY;
+	for(j=0;j<nCluster;j++) for(k=j+1;k<nCluster;k++) {
+		float d = 0.5f*sqrtf(BGRAf_ColDistance(&Clusters[j].Centroid, &Clusters[k].Centroid));
+		if(d < Pass->HalfSep[j]) Pass->HalfSep[j] = d;
+		if(d < Pass->HalfSep[k]) Pass->HalfSep[k] = d;
+	}
+}
+
+//! Assign the points of a chunk to their nearest cluster (no training)
+static void QuantCluster_AssignOnlyChunk(void *Arg, int Chunk, int ThreadIdx) {
+	int i;
+	const struct QuantCluster_Pass_t *Pass = Arg;
+	(void)ThreadIdx;
+	int Beg = Chunk*Pass->ChunkSize;
+	int End = Beg + Pass->ChunkSize; if(End > Pass->nData) End = Pass->nData;
+	for(i=Beg;i<End;i++) {
+		Pass->DataClusters[i] = Pass->FindNearest(&Pass->Data[i], Pass->Centroids);
+	}
+}
+
+/**************************************/
+
+//! Simple xorshift PRNG for mini-batch sampling
+static inline uint32_t QuantCluster_Random(uint32_t *State) {
+	uint32_t x = *State;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *State = x;
+}
+
+//! Draw a stratified mini-batch: Data[] is cut into nBatch equal
+//! strata, and one point is picked at random from each of them.
+//! Returns the total weight of the batch.
+static double QuantCluster_SampleBatch(
+	const struct BGRAf_t *Data,
+	const float   *DataWeight,
+	const int32_t *DataClusters,
+	int            nData,
+	struct BGRAf_t *BatchData,
+	float          *BatchWeight,
+	int32_t        *BatchClusters,
+	int32_t        *BatchIdx,
+	int             nBatch,
+	uint32_t       *RandState
+) {
+	int k;
+	double TotalWeight = 0.0;
+	for(k=0;k<nBatch;k++) {
+		int Beg = (int)(( int64_t)k    * nData / nBatch);
+		int End = (int)(((int64_t)k+1) * nData / nBatch);
+		int n   = Beg + QuantCluster_Random(RandState) % (uint32_t)(End-Beg);
+		BatchIdx     [k] = n;
+		BatchData    [k] = Data[n];
+		BatchWeight  [k] = DATA_WEIGHT(DataWeight, n);
+		BatchClusters[k] = DataClusters[n];
+		TotalWeight += BatchWeight[k];
+	}
+	return TotalWeight;
+}
+
+/**************************************/
+
+//! Perform vector quantization of the data as given
+static int QuantCluster_QuantizeData(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, const float *DataWeight, int nData, int32_t *DataClusters, const struct QuantCluster_Params_t *Params) {
 	int i, j;
-	if(!nData) return;
+	if(!nData) return 1;
+	if(Params->Stats) Params->Stats->nPoints += nData;
 
 	//! Perform first pass from average of data
+	//! NOTE: Total weight is accumulated in double precision, as
+	//! large unweighted sets would otherwise lose precision.
+	double TotalWeight = 0.0;
 	Clusters[0].Centroid = (struct BGRAf_t){0,0,0,0};
 	QuantCluster_ClearTraining(&Clusters[0]);
 	for(i=0;i<nData;i++) {
 		DataClusters[i] = 0;
-		Clusters[0].Centroid = BGRAf_Add(&Clusters[0].Centroid, &Data[i]);
+		if(DataWeight) {
+			struct BGRAf_t t = BGRAf_Muli(&Data[i], DataWeight[i]);
+			Clusters[0].Centroid = BGRAf_Add(&Clusters[0].Centroid, &t);
+			TotalWeight += DataWeight[i];
+		} else {
+			Clusters[0].Centroid = BGRAf_Add(&Clusters[0].Centroid, &Data[i]);
+			TotalWeight += 1.0;
+		}
 	}
-	Clusters[0].Centroid = BGRAf_Divi(&Clusters[0].Centroid, nData);
+	Clusters[0].Centroid = BGRAf_Divi(&Clusters[0].Centroid, (float)TotalWeight);
 
 	//! Second pass to properly train the distortion measures
 	QuantCluster_ClearTraining(&Clusters[0]);
-	for(i=0;i<nData;i++) QuantCluster_Train(&Clusters[0], &Data[i]);
-	if(Clusters[0].DistWeight == 0.0f) return; //! Global convergence already reached (ie. single item)
+	for(i=0;i<nData;i++) QuantCluster_Train(&Clusters[0], &Data[i], DATA_WEIGHT(DataWeight, i));
+	if(Clusters[0].DistWeight == 0.0f) return 1; //! Global convergence already reached (ie. single item)
 	Clusters[0].Next = -1;
 
+	//! In mini-batch mode, refinement passes only see a subset of the data
+	//! NOTE: Distance bounds can't be carried between different subsets,
+	//! so QUANTCLUSTER_ENGINE_HAMERLY falls back to brute-force search.
+	int nBatch    = (Params->BatchSize > 0 && nData > Params->BatchSize) ? Params->BatchSize : 0;
+	int nPassData = nBatch ? nBatch : nData;
+	int UseBounds = (Params->Engine == QUANTCLUSTER_ENGINE_HAMERLY && !nBatch);
+	uint32_t RandState = Params->BatchSeed ^ 0x9E3779B9u; if(!RandState) RandState = 1;
+
+	//! Get chunk layout
+	int ChunkSize = (nPassData + MAX_CHUNKS-1) / MAX_CHUNKS; if(ChunkSize < CHUNK_MIN_SIZE) ChunkSize = CHUNK_MIN_SIZE;
+	int nChunks   = (nPassData + ChunkSize-1) / ChunkSize;
+
+	//! Allocate the structure-of-arrays centroid copy and chunk training data,
+	//! the distortion heap and membership index, the distance bounds when
+	//! using QUANTCLUSTER_ENGINE_HAMERLY, and the sampled data for mini-batch mode
+	struct QuantCluster_Centroids_t Centroids;
+	struct QuantCluster_Pass_t Pass;
+	struct BGRAf_t *PrevCentroid  = NULL;
+	struct BGRAf_t *BatchData     = NULL;
+	float          *BatchWeight   = NULL;
+	int32_t        *BatchClusters = NULL;
+	int32_t        *BatchIdx      = NULL;
+	int32_t        *DistHeap      = NULL;
+	int32_t        *MemberStart   = NULL;
+	int32_t        *MemberIdx     = NULL;
+	void *ScratchBuffer; {
+		int nPadded  = ALIGN2N(nCluster, QUANTCLUSTER_CENTROID_PADDING);
+		int nThreads = ThreadPool_GetThreadCount(Params->Pool);
+		int nBounded = UseBounds ? nData    : 0;
+		int nBoundedC= UseBounds ? nCluster : 0;
+		int nBoundedT= UseBounds ? nThreads : 0;
+		ScratchBuffer = Arena_Alloc(Params->Arena,
+			DATA_ALIGNMENT-1                                           + //! Rounding
+			DATA_ALIGN(4*nPadded*sizeof(float))                        + //! Centroids
+			DATA_ALIGN(nChunks*nCluster*sizeof(struct QuantCluster_t)) + //! ChunkTraining
+			DATA_ALIGN(nChunks*sizeof(float))                          + //! ChunkChanged
+			DATA_ALIGN(nChunks*sizeof(uint64_t))                       + //! ChunkDistances
+			DATA_ALIGN(nBounded *sizeof(float))                        + //! Upper
+			DATA_ALIGN(nBounded *sizeof(float))                        + //! Lower
+			DATA_ALIGN(nBoundedC*sizeof(float))                        + //! Drift
+			DATA_ALIGN(nBoundedC*sizeof(float))                        + //! HalfSep
+			DATA_ALIGN(nBoundedC*sizeof(struct BGRAf_t))               + //! PrevCentroid
+			DATA_ALIGN(nBoundedT*nPadded*sizeof(float))                + //! ThreadDist
+			DATA_ALIGN(nBatch*sizeof(struct BGRAf_t))                  + //! BatchData
+			DATA_ALIGN(nBatch*sizeof(float))                           + //! BatchWeight
+			DATA_ALIGN(nBatch*sizeof(int32_t))                         + //! BatchClusters
+			DATA_ALIGN(nBatch*sizeof(int32_t))                         + //! BatchIdx
+			DATA_ALIGN(nCluster*sizeof(int32_t))                       + //! DistHeap
+			DATA_ALIGN((nCluster+1)*sizeof(int32_t))                   + //! MemberStart
+			DATA_ALIGN(nPassData*sizeof(int32_t))                        //! MemberIdx
+		);
+		if(!ScratchBuffer) return 0;
+		Centroids.b = (float*)DATA_ALIGN(ScratchBuffer);
+		Centroids.g = Centroids.b + nPadded;
+		Centroids.r = Centroids.g + nPadded;
+		Centroids.a = Centroids.r + nPadded;
+		Pass.ChunkTraining = (struct QuantCluster_t*)DATA_ALIGN(Centroids.a + nPadded);
+		Pass.ChunkChanged  = (float*)DATA_ALIGN(Pass.ChunkTraining + nChunks*nCluster);
+		Pass.ChunkDistances= (uint64_t*)DATA_ALIGN(Pass.ChunkChanged + nChunks);
+		Pass.Upper         = (float*)DATA_ALIGN(Pass.ChunkDistances + nChunks);
+		Pass.Lower         = (float*)DATA_ALIGN(Pass.Upper   + nBounded);
+		Pass.Drift         = (float*)DATA_ALIGN(Pass.Lower   + nBounded);
+		Pass.HalfSep       = (float*)DATA_ALIGN(Pass.Drift   + nBoundedC);
+		PrevCentroid       = (struct BGRAf_t*)DATA_ALIGN(Pass.HalfSep + nBoundedC);
+		Pass.ThreadDist    = (float*)DATA_ALIGN(PrevCentroid + nBoundedC);
+		BatchData          = (struct BGRAf_t*)DATA_ALIGN(Pass.ThreadDist + nBoundedT*nPadded);
+		BatchWeight        = (float  *)DATA_ALIGN(BatchData     + nBatch);
+		BatchClusters      = (int32_t*)DATA_ALIGN(BatchWeight   + nBatch);
+		BatchIdx           = (int32_t*)DATA_ALIGN(BatchClusters + nBatch);
+		DistHeap           = (int32_t*)DATA_ALIGN(BatchIdx      + nBatch);
+		MemberStart        = (int32_t*)DATA_ALIGN(DistHeap      + nCluster);
+		MemberIdx          = (int32_t*)DATA_ALIGN(MemberStart   + nCluster+1);
+		if(!UseBounds) Pass.Upper = Pass.Lower = NULL;
+	}
+	Pass.Clusters     = Clusters;
+	Pass.Centroids    = &Centroids;
+	Pass.FindNearest  = QuantCluster_GetFindNearest();
+	Pass.Data         = nBatch ? BatchData     : Data;
+	Pass.DataWeight   = nBatch ? BatchWeight   : DataWeight;
+	Pass.nData        = nPassData;
+	Pass.DataClusters = nBatch ? BatchClusters : DataClusters;
+	Pass.ChunkSize    = ChunkSize;
+	Pass.GetDistances = QuantCluster_GetGetDistances();
+
 	//! Begin splitting clusters to form the initial codebook
 	int nClusterCur = 1;
 	int MaxDistCluster = 0;
@@ -125,7 +773,7 @@ void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const
 				//! Split cluster, but do NOT recluster the data.
 				//! By not re-clustering, we give outliers a better chance
 				//! of making it through to a better-fitting cluster.
-				QuantCluster_Split(Clusters, MaxDistCluster, DstCluster, Data, nData, DataClusters, 0);
+				QuantCluster_Split(Clusters, MaxDistCluster, DstCluster, Data, DataWeight, DataClusters, NULL, 0, NULL, NULL);
 
 				//! Check if we have more clusters that need splitting
 				MaxDistCluster = Clusters[MaxDistCluster].Next;
@@ -134,46 +782,200 @@ void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const
 		}
 
 		//! Perform refinement passes
-		int Pass;
-		for(Pass=0;Pass<nPasses;Pass++) {
-			for(i=0;i<nClusterCur;i++) QuantCluster_ClearTraining(&Clusters[i]);
-			for(i=0;i<nData;i++) {
-				int   BestIdx  = -1;
-				float BestDist = INFINITY;
-				for(j=0;j<nClusterCur;j++) {
-					float Dist = BGRAf_ColDistance(&Data[i], &Clusters[j].Centroid);
-					if(Dist < BestDist) BestIdx = j, BestDist = Dist;
+		//! NOTE: New clusters were created by splitting, so the
+		//! distance bounds must be re-initialized by a full search.
+		int   PassIdx;
+		float LastDistortion = 0.0f;
+		Pass.BoundsValid = 0;
+		for(PassIdx=0;PassIdx<Params->nPasses;PassIdx++) {
+			//! Update centroid drift and separation for the distance bounds
+			if(Pass.Upper) QuantCluster_UpdateBounds(&Pass, Clusters, nClusterCur, PrevCentroid);
+
+			//! Draw a new mini-batch
+			double PassWeight = TotalWeight;
+			if(nBatch) {
+				PassWeight = QuantCluster_SampleBatch(
+					Data, DataWeight, DataClusters, nData,
+					BatchData, BatchWeight, BatchClusters, BatchIdx, nBatch,
+					&RandState
+				);
+			}
+
+			//! Assign and train each chunk, then sum the
+			//! training data in chunk order (deterministic)
+			QuantCluster_CentroidsFromClusters(&Centroids, Clusters, nClusterCur);
+			ThreadPool_Run(Params->Pool, QuantCluster_AssignChunk, &Pass, nChunks);
+			for(i=0;i<nClusterCur;i++) {
+				const struct QuantCluster_t *Src = Pass.ChunkTraining + i;
+				QuantCluster_ClearTraining(&Clusters[i]);
+				for(j=0;j<nChunks;j++) QuantCluster_MergeTraining(&Clusters[i], &Src[j*nClusterCur]);
+			}
+			Pass.BoundsValid = 1;
+			if(Params->Stats) {
+				Params->Stats->nPasses++;
+				for(i=0;i<nChunks;i++) Params->Stats->nDistances += Pass.ChunkDistances[i];
+			}
+
+			//! Check for convergence: Too few points changed cluster, or
+			//! distortion did not drop by enough relative to the last pass
+			//! NOTE: We still resolve and refill empty clusters below, but
+			//! break out afterwards if nothing had to be refilled.
+			int Converged = 0; {
+				float Changed    = 0.0f;
+				float Distortion = 0.0f;
+				for(i=0;i<nChunks;    i++) Changed    += Pass.ChunkChanged[i];
+				for(i=0;i<nClusterCur;i++) Distortion += Clusters[i].DistWeight;
+				if(Params->StopChangeRatio > 0.0f && Changed < Params->StopChangeRatio*(float)PassWeight) Converged = 1;
+				if(Params->StopDistortionDrop > 0.0f && PassIdx > 0) {
+					if(LastDistortion - Distortion < Params->StopDistortionDrop*LastDistortion) Converged = 1;
 				}
-				DataClusters[i] = BestIdx;
-				QuantCluster_Train(&Clusters[BestIdx], &Data[i]);
+				LastDistortion = Distortion;
 			}
 
 			//! Resolve clusters
-			MaxDistCluster = -1;
-			EmptyCluster   = -1;
+			int nDistHeap = 0;
+			EmptyCluster  = -1;
 			for(i=0;i<nClusterCur;i++) {
-				//! If the cluster resolves, update the distortion linked list
+				//! If the cluster resolves, add it to the distortion heap
 				if(QuantCluster_Resolve(&Clusters[i])) {
-					//! Only insert to the list if the distortion is non-zero
-					if(Clusters[i].DistWeight != 0.0f) {
-						MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, i, MaxDistCluster);
-					}
+					//! Only insert to the heap if the distortion is non-zero
+					if(Clusters[i].DistWeight != 0.0f) DistHeap[nDistHeap++] = i;
 				} else {
 					//! No resolve - append to empty-cluster linked list
 					Clusters[i].Next = EmptyCluster, EmptyCluster = i;
 				}
 			}
+			MaxDistCluster = QuantCluster_BuildDistortionList(Clusters, DistHeap, nDistHeap);
 
 			//! Split the most distorted clusters into any empty ones
+			//! NOTE: Each split moves points from a cluster in the distortion
+			//! list to an empty cluster, neither of which is split again in
+			//! this loop, so the membership index stays valid throughout.
+			if(EmptyCluster != -1 && MaxDistCluster != -1) {
+				QuantCluster_BuildMembership(Pass.DataClusters, Pass.nData, nClusterCur, MemberStart, MemberIdx);
+			}
 			while(EmptyCluster != -1 && MaxDistCluster != -1) {
-				QuantCluster_Split(Clusters, MaxDistCluster, EmptyCluster, Data, nData, DataClusters, 1);
+				int Beg = MemberStart[MaxDistCluster];
+				int End = MemberStart[MaxDistCluster+1];
+				QuantCluster_Split(Clusters, MaxDistCluster, EmptyCluster, Pass.Data, Pass.DataWeight, Pass.DataClusters, MemberIdx + Beg, End - Beg, Pass.Upper, Pass.Lower);
 				MaxDistCluster = Clusters[MaxDistCluster].Next;
 				EmptyCluster   = Clusters[EmptyCluster].Next;
+				Converged = 0;
 			}
+
+			//! Store mini-batch assignments
+			if(nBatch) for(i=0;i<nBatch;i++) DataClusters[BatchIdx[i]] = BatchClusters[i];
+			if(Converged) break;
+		}
+	}
+
+	//! In mini-batch mode, most points were never assigned to
+	//! the final clusters, so do a full assignment pass here
+	if(nBatch) {
+		Pass.Data         = Data;
+		Pass.nData        = nData;
+		Pass.DataClusters = DataClusters;
+		Pass.ChunkSize    = (nData + MAX_CHUNKS-1) / MAX_CHUNKS; if(Pass.ChunkSize < CHUNK_MIN_SIZE) Pass.ChunkSize = CHUNK_MIN_SIZE;
+		QuantCluster_CentroidsFromClusters(&Centroids, Clusters, nClusterCur);
+		ThreadPool_Run(Params->Pool, QuantCluster_AssignOnlyChunk, &Pass, (nData + Pass.ChunkSize-1) / Pass.ChunkSize);
+		if(Params->Stats) Params->Stats->nDistances += (uint64_t)nData*nClusterCur;
+	}
+
+	//! Clean up
+	Arena_Free(Params->Arena, ScratchBuffer);
+	return 1;
+}
+
+/**************************************/
+
+//! Hash a data point for the histogram
+static inline uint32_t QuantCluster_HashPoint(const struct BGRAf_t *x) {
+	uint32_t k[4]; memcpy(k, x, sizeof(k));
+	uint32_t h = k[0];
+	h = (h ^ (h >> 16)) * 0x7FEB352Du + k[1];
+	h = (h ^ (h >> 15)) * 0x846CA68Bu + k[2];
+	h = (h ^ (h >> 16)) * 0x7FEB352Du + k[3];
+	h = (h ^ (h >> 15)) * 0x846CA68Bu;
+	return h ^ (h >> 16);
+}
+
+//! Collapse identical data points into weighted unique points
+//! Returns the number of unique points, or -1 on failure (out of memory).
+//! NOTE: Unique points are stored in order of first appearance, and
+//! DataUnique[] maps each input point to its unique point index.
+//! NOTE: Points are compared by bit pattern, so eg. +0.0 and -0.0
+//! will be kept separate; this is harmless.
+static int QuantCluster_BuildHistogram(
+	const struct BGRAf_t *Data,
+	const float    *DataWeight,
+	int             nData,
+	struct BGRAf_t *UniqueData,
+	float          *UniqueWeight,
+	int32_t        *DataUnique,
+	struct Arena_t *Arena
+) {
+	int i;
+
+	//! Allocate hash table (at least 50% empty)
+	uint32_t HashMask = 1; while(HashMask < 2u*nData) HashMask *= 2; HashMask--;
+	int32_t *Hash = Arena_Alloc(Arena, (HashMask+1) * sizeof(int32_t));
+	if(!Hash) return -1;
+	for(i=0;i<=(int)HashMask;i++) Hash[i] = -1;
+
+	//! Insert points
+	int nUnique = 0;
+	for(i=0;i<nData;i++) {
+		uint32_t h = QuantCluster_HashPoint(&Data[i]) & HashMask;
+		while(Hash[h] != -1 && memcmp(&UniqueData[Hash[h]], &Data[i], sizeof(struct BGRAf_t))) h = (h+1) & HashMask;
+		if(Hash[h] == -1) {
+			Hash[h] = nUnique;
+			UniqueData  [nUnique] = Data[i];
+			UniqueWeight[nUnique] = 0.0f;
+			nUnique++;
 		}
+		UniqueWeight[Hash[h]] += DATA_WEIGHT(DataWeight, i);
+		DataUnique[i] = Hash[h];
 	}
+	Arena_Free(Arena, Hash);
+	return nUnique;
 }
 
+/**************************************/
+
+//! Perform total vector quantization
+int QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, const float *DataWeight, int nData, int32_t *DataClusters, const struct QuantCluster_Params_t *Params) {
+	int i;
+
+	//! Collapse identical points when requested and worthwhile
+	//! NOTE: When fewer than half of the points collapse, clustering
+	//! the original data directly is cheaper than the remapping.
+	if(Params->Histogram && nData > 1) {
+		int Result = -1;
+		void *Buffer = Arena_Alloc(Params->Arena,
+			DATA_ALIGNMENT-1                           + //! Rounding
+			DATA_ALIGN(nData*sizeof(struct BGRAf_t))   + //! UniqueData
+			DATA_ALIGN(nData*sizeof(float))            + //! UniqueWeight
+			DATA_ALIGN(nData*sizeof(int32_t))          + //! UniqueClusters
+			DATA_ALIGN(nData*sizeof(int32_t))            //! DataUnique
+		);
+		if(Buffer) {
+			struct BGRAf_t *UniqueData     = (struct BGRAf_t*)DATA_ALIGN(Buffer);
+			float          *UniqueWeight   = (float         *)DATA_ALIGN(UniqueData   + nData);
+			int32_t        *UniqueClusters = (int32_t       *)DATA_ALIGN(UniqueWeight + nData);
+			int32_t        *DataUnique     = (int32_t       *)DATA_ALIGN(UniqueClusters + nData);
+			int nUnique = QuantCluster_BuildHistogram(Data, DataWeight, nData, UniqueData, UniqueWeight, DataUnique, Params->Arena);
+			if(nUnique >= 0 && nUnique <= nData/2) {
+				Result = QuantCluster_QuantizeData(Clusters, nCluster, UniqueData, UniqueWeight, nUnique, UniqueClusters, Params);
+				for(i=0;i<nData;i++) DataClusters[i] = UniqueClusters[DataUnique[i]];
+			}
+			Arena_Free(Params->Arena, Buffer);
+		}
+		if(Result != -1) return Result;
+	}
+
+	//! Cluster data directly
+	return QuantCluster_QuantizeData(Clusters, nCluster, Data, DataWeight, nData, DataClusters, Params);
+}
 /**************************************/
 //! EOF
 /**************************************/
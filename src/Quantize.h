@@ -1,7 +1,9 @@
 /**************************************/
 #pragma once
 /**************************************/
+#include "Arena.h"
 #include "Colourspace.h"
+#include "Threads.h"
 /**************************************/
 
 struct QuantCluster_t {
@@ -14,10 +16,96 @@ struct QuantCluster_t {
 	struct BGRAf_t Centroid;
 };
 
+//! Clustering engines available
+//! NOTE: QUANTCLUSTER_ENGINE_HAMERLY keeps distance bounds for every
+//!       point to skip most distance evaluations in the refinement
+//!       passes. It gives the same results as brute-force search,
+//!       but needs an extra 8 bytes of memory per point.
+#define QUANTCLUSTER_ENGINE_BRUTEFORCE 0 //! Exhaustive nearest-centroid search
+#define QUANTCLUSTER_ENGINE_HAMERLY    1 //! Bounded search (Hamerly's algorithm)
+
+//! Clustering work counters
+//! NOTE: Counters are added to (never cleared) by QuantCluster_Quantize().
+struct QuantCluster_Stats_t {
+	uint64_t nPoints;    //! Points clustered (after collapsing identical points)
+	uint64_t nPasses;    //! Refinement passes run
+	uint64_t nDistances; //! Point-to-centroid distance evaluations (assignment only)
+};
+
+//! Clustering parameters
+//! NOTE: The refinement passes split Data[] into fixed-size chunks
+//! with their own training accumulators, and these are reduced in
+//! chunk order; results are therefore identical for any Pool size.
+struct QuantCluster_Params_t {
+	int nPasses;               //! Refinement passes per splitting step
+	struct ThreadPool_t *Pool; //! Worker threads (NULL = calling thread only)
+	struct Arena_t *Arena;     //! Scratch memory (NULL = use malloc())
+	int Engine;                //! Clustering engine (QUANTCLUSTER_ENGINE_*)
+
+	//! Early termination of refinement passes
+	//! Refinement stops before nPasses when fewer than StopChangeRatio
+	//! of all points changed cluster, or when the total distortion fell
+	//! by less than StopDistortionDrop (relative to the previous pass).
+	//! NOTE: Set either to 0.0 to disable that criterion.
+	float StopChangeRatio;
+	float StopDistortionDrop;
+
+	//! When not zero, identical data points are first collapsed into
+	//! weighted unique points (when this at least halves the data).
+	//! NOTE: This is much faster on range-reduced data, but the weighted
+	//! sums are rounded differently from summing every copy, so results
+	//! are close to, but not the same as, clustering the original data.
+	//! The same applies to any weights passed in (eg. for deduplicated
+	//! tiles), so results only match clustering every point exactly when
+	//! this is off and no weights are given.
+	int Histogram;
+
+	//! Mini-batch mode
+	//! When BatchSize is not zero and there are more points than this,
+	//! each refinement pass only uses a stratified random sample of
+	//! BatchSize points (drawn with a PRNG seeded by BatchSeed), and a
+	//! single full assignment pass is made at the end.
+	int      BatchSize;
+	uint32_t BatchSeed;
+
+	//! Work counters (NULL = not collected)
+	//! NOTE: Not safe to share between concurrent calls.
+	struct QuantCluster_Stats_t *Stats;
+};
+
+//! Centroid (or colour) positions in structure-of-arrays layout
+//! NOTE: Entries are padded to a multiple of QUANTCLUSTER_CENTROID_PADDING,
+//! so the SIMD kernels never need to handle a tail. Padding entries are set
+//! to INFINITY, so they can never be selected as the nearest centroid.
+#define QUANTCLUSTER_CENTROID_PADDING 16
+struct QuantCluster_Centroids_t {
+	int n, nPadded;
+	float *b, *g, *r, *a;
+};
+
+//! Nearest-centroid search kernel
+//! Returns the index of the nearest centroid (the first of any tied
+//! entries, as per a linear scan), or -1 if no distance is finite.
+//! NOTE: All kernels give bit-identical distances to BGRAf_ColDistance().
+typedef int (*QuantCluster_FindNearest_t)(const struct BGRAf_t *x, const struct QuantCluster_Centroids_t *Centroids);
+
 /**************************************/
 
 //! Perform total vector quantization
-void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses);
+//! Returns 0 on failure (out of memory)
+//! NOTE: DataWeight[] may be NULL (all points have a weight of 1.0).
+int QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, const float *DataWeight, int nData, int32_t *DataClusters, const struct QuantCluster_Params_t *Params);
+
+//! Get the fastest nearest-centroid search kernel for this CPU
+QuantCluster_FindNearest_t QuantCluster_GetFindNearest(void);
+
+//! Get the number of floats needed to store n colours in structure-of-arrays layout
+int QuantCluster_CentroidsGetSize(int n);
+
+//! Store colours in structure-of-arrays layout, for use with the search kernels
+//! NOTE: Buffer[] must hold QuantCluster_CentroidsGetSize(n) floats, and
+//! be aligned to 32 bytes.
+void QuantCluster_CentroidsFromColours(struct QuantCluster_Centroids_t *Dst, float *Buffer, const struct BGRAf_t *Colours, int n);
 
 /**************************************/
 //! EOF
@@ -0,0 +1,133 @@
+/**************************************/
+#include <stddef.h>
+#include <stdint.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <sys/resource.h>
+# include <time.h>
+#endif
+/**************************************/
+#include "Stats.h"
+/**************************************/
+
+//! Get wall-clock time (seconds, from an arbitrary point)
+static double Stats_GetWallTime(void) {
+#ifdef _WIN32
+	LARGE_INTEGER Freq, t;
+	QueryPerformanceFrequency(&Freq);
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart / (double)Freq.QuadPart;
+#else
+	struct timespec t;
+	if(clock_gettime(CLOCK_MONOTONIC, &t) != 0) return 0.0;
+	return (double)t.tv_sec + (double)t.tv_nsec*1.0e-9;
+#endif
+}
+
+//! Get CPU time of the process (seconds)
+static double Stats_GetCPUTime(void) {
+#ifdef _WIN32
+	FILETIME Create, Exit, Kernel, User;
+	if(!GetProcessTimes(GetCurrentProcess(), &Create, &Exit, &Kernel, &User)) return 0.0;
+	uint64_t k = (uint64_t)Kernel.dwHighDateTime << 32 | Kernel.dwLowDateTime;
+	uint64_t u = (uint64_t)User  .dwHighDateTime << 32 | User  .dwLowDateTime;
+	return (double)(k + u) * 1.0e-7; //! <- 100ns units
+#else
+	struct rusage Usage;
+	if(getrusage(RUSAGE_SELF, &Usage) != 0) return 0.0;
+	return (double)(Usage.ru_utime.tv_sec  + Usage.ru_stime.tv_sec) +
+	       (double)(Usage.ru_utime.tv_usec + Usage.ru_stime.tv_usec)*1.0e-6;
+#endif
+}
+
+/**************************************/
+
+//! Clear statistics
+void Stats_Init(struct Stats_t *Stats) {
+	int i;
+	if(!Stats) return;
+	for(i=0;i<STATS_STAGE_COUNT;i++) {
+		Stats->Stage[i] = (struct Stats_Stage_t){
+			.WallTime   = 0.0,
+			.CPUTime    = 0.0,
+			.PeakGrowth = 0.0,
+			.nItems     = 0,
+			.nPasses    = 0,
+			.nDistances = 0,
+		};
+	}
+}
+
+//! Begin timing a stage
+struct Stats_Timer_t Stats_Begin(const struct Stats_t *Stats) {
+	struct Stats_Timer_t Timer = {0.0, 0.0, 0.0};
+	if(Stats) {
+		Timer.WallTime   = Stats_GetWallTime();
+		Timer.CPUTime    = Stats_GetCPUTime();
+		Timer.PeakMemory = Stats_GetPeakMemory();
+	}
+	return Timer;
+}
+
+//! Finish timing a stage
+//! NOTE: The peak memory only ever rises, so the growth over the
+//! start of the stage is what the stage itself added to it.
+void Stats_End(struct Stats_t *Stats, int Stage, const struct Stats_Timer_t *Timer, uint64_t nItems) {
+	if(!Stats) return;
+	struct Stats_Stage_t *x = &Stats->Stage[Stage];
+	x->WallTime   += Stats_GetWallTime()   - Timer->WallTime;
+	x->CPUTime    += Stats_GetCPUTime()    - Timer->CPUTime;
+	x->PeakGrowth += Stats_GetPeakMemory() - Timer->PeakMemory;
+	x->nItems     += nItems;
+}
+
+//! Add the statistics of another run
+void Stats_Merge(struct Stats_t *Dst, const struct Stats_t *Src) {
+	int i;
+	if(!Dst || !Src) return;
+	for(i=0;i<STATS_STAGE_COUNT;i++) {
+		struct Stats_Stage_t *x = &Dst->Stage[i];
+		const struct Stats_Stage_t *y = &Src->Stage[i];
+		x->WallTime   += y->WallTime;
+		x->CPUTime    += y->CPUTime;
+		x->PeakGrowth += y->PeakGrowth;
+		x->nItems     += y->nItems;
+		x->nPasses    += y->nPasses;
+		x->nDistances += y->nDistances;
+	}
+}
+
+//! Get the name of a stage
+const char *Stats_GetStageName(int Stage) {
+	static const char *Names[STATS_STAGE_COUNT] = {
+		"load",
+		"dither",
+		"tiles",
+		"tilecluster",
+		"colourcluster",
+		"remap",
+		"write",
+	};
+	return (Stage >= 0 && Stage < STATS_STAGE_COUNT) ? Names[Stage] : "unknown";
+}
+
+//! Get the peak memory usage of the process so far
+//! NOTE: ru_maxrss is in bytes on macOS, and KiB elsewhere
+double Stats_GetPeakMemory(void) {
+#if defined(__unix__) || defined(__APPLE__)
+	struct rusage Usage;
+	if(getrusage(RUSAGE_SELF, &Usage) != 0) return 0.0;
+# ifdef __APPLE__
+	return Usage.ru_maxrss / (1024.0*1024.0);
+# else
+	return Usage.ru_maxrss / 1024.0;
+# endif
+#else
+	return 0.0;
+#endif
+}
+
+/**************************************/
+//! EOF
+/**************************************/
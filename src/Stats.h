@@ -0,0 +1,76 @@
+/**************************************/
+#pragma once
+/**************************************/
+#include <stdint.h>
+/**************************************/
+
+//! Processing stages
+#define STATS_STAGE_LOAD          0 //! Reading the source image
+#define STATS_STAGE_DITHER        1 //! First-pass dithering
+#define STATS_STAGE_TILES         2 //! Conversion to tiles (and deduplication)
+#define STATS_STAGE_TILECLUSTER   3 //! Tile clustering (palette assignment)
+#define STATS_STAGE_COLOURCLUSTER 4 //! Colour clustering of every palette
+#define STATS_STAGE_REMAP         5 //! Final dithering and palette remapping
+#define STATS_STAGE_WRITE         6 //! Writing the output image
+#define STATS_STAGE_COUNT         7
+
+//! Statistics of a single stage
+//! NOTE: Stages that run several times (eg. when streaming in
+//! bands) accumulate their times and counters.
+//! NOTE: PeakGrowth is how far the peak memory of the whole process
+//! (ru_maxrss) rose during the stage, not what the stage allocated:
+//!  - A stage that stays below an earlier peak reports 0, however
+//!    much it allocates.
+//!  - Memory used by anything running at the same time (eg. the other
+//!    images of a batch) counts towards whichever stage is being timed.
+//!  - Stats_Merge() sums these, so merged growth is not a peak either.
+struct Stats_Stage_t {
+	double   WallTime;   //! Wall-clock time (seconds)
+	double   CPUTime;    //! CPU time of the process, all threads (seconds)
+	double   PeakGrowth; //! Rise in the peak memory of the process during the stage (MiB; 0 = unavailable or none)
+	uint64_t nItems;     //! Pixels processed (or points clustered)
+	uint64_t nPasses;    //! Clustering refinement passes run
+	uint64_t nDistances; //! Clustering distance evaluations
+};
+
+//! Statistics of a run
+struct Stats_t {
+	struct Stats_Stage_t Stage[STATS_STAGE_COUNT];
+};
+
+//! Timer for a stage in progress
+//! NOTE: PeakMemory is the peak memory of the process when the stage
+//! began, which the peak at the end of the stage is measured against.
+struct Stats_Timer_t {
+	double WallTime, CPUTime, PeakMemory;
+};
+
+/**************************************/
+
+//! Clear statistics
+void Stats_Init(struct Stats_t *Stats);
+
+//! Begin timing a stage
+//! NOTE: All functions accept Stats=NULL (no statistics collected).
+struct Stats_Timer_t Stats_Begin(const struct Stats_t *Stats);
+
+//! Finish timing a stage, adding nItems to its counters
+void Stats_End(struct Stats_t *Stats, int Stage, const struct Stats_Timer_t *Timer, uint64_t nItems);
+
+//! Add the statistics of another run (eg. to total a batch of images)
+//! NOTE: Times are summed, so runs that overlapped in time count
+//! towards the total more than once, and CPU times (being measured
+//! for the whole process) also include any concurrent runs. The
+//! same applies to the peak memory growth.
+void Stats_Merge(struct Stats_t *Dst, const struct Stats_t *Src);
+
+//! Get the name of a stage
+const char *Stats_GetStageName(int Stage);
+
+//! Get the peak memory usage of the process so far (MiB; 0 = unavailable)
+//! NOTE: Only available on POSIX systems.
+double Stats_GetPeakMemory(void);
+
+/**************************************/
+//! EOF
+/**************************************/
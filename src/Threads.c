@@ -0,0 +1,186 @@
+/**************************************/
+#include <pthread.h>
+#include <stdlib.h>
+/**************************************/
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <sched.h>
+# include <unistd.h>
+#endif
+/**************************************/
+#include "Threads.h"
+/**************************************/
+
+struct ThreadPool_t {
+	int nThreads;
+	pthread_t      *Threads;
+	pthread_mutex_t Lock;
+	pthread_cond_t  WakeCond; //! Signalled when a job is posted (or on exit)
+	pthread_cond_t  DoneCond; //! Signalled when the last task of a job completes
+
+	//! Current job
+	ThreadPool_Func_t Func;
+	void    *Arg;
+	int      nTasks;
+	int      NextTask;
+	int      nTasksDone;
+	unsigned JobIdx;
+	int      Quit;
+};
+
+struct ThreadPool_WorkerArg_t {
+	struct ThreadPool_t *Pool;
+	int ThreadIdx;
+};
+
+/**************************************/
+
+//! Process tasks until none are left
+//! NOTE: Must be called with Pool->Lock held
+static void ThreadPool_ProcessTasks(struct ThreadPool_t *Pool, int ThreadIdx) {
+	while(Pool->NextTask < Pool->nTasks) {
+		int TaskIdx = Pool->NextTask++;
+		ThreadPool_Func_t Func = Pool->Func;
+		void *Arg = Pool->Arg;
+		pthread_mutex_unlock(&Pool->Lock);
+		Func(Arg, TaskIdx, ThreadIdx);
+		pthread_mutex_lock(&Pool->Lock);
+		if(++Pool->nTasksDone == Pool->nTasks) pthread_cond_broadcast(&Pool->DoneCond);
+	}
+}
+
+//! Worker thread main loop
+static void *ThreadPool_Worker(void *_Arg) {
+	struct ThreadPool_WorkerArg_t *Arg = _Arg;
+	struct ThreadPool_t *Pool = Arg->Pool;
+	int ThreadIdx = Arg->ThreadIdx;
+	free(Arg);
+
+	pthread_mutex_lock(&Pool->Lock);
+	unsigned LastJob = Pool->JobIdx;
+	for(;;) {
+		while(!Pool->Quit && Pool->JobIdx == LastJob) pthread_cond_wait(&Pool->WakeCond, &Pool->Lock);
+		if(Pool->Quit) break;
+		LastJob = Pool->JobIdx;
+		ThreadPool_ProcessTasks(Pool, ThreadIdx);
+	}
+	pthread_mutex_unlock(&Pool->Lock);
+	return NULL;
+}
+
+/**************************************/
+
+//! Get the number of available CPUs
+int ThreadPool_GetCPUCount(void) {
+	int n;
+#ifdef _WIN32
+	SYSTEM_INFO Info;
+	GetSystemInfo(&Info);
+	n = (int)Info.dwNumberOfProcessors;
+#else
+	n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return (n < 1) ? 1 : n;
+}
+
+//! Create pool
+struct ThreadPool_t *ThreadPool_Create(int nThreads) {
+	int i;
+	if(nThreads <= 0) nThreads = ThreadPool_GetCPUCount();
+
+	//! Allocate and initialize pool
+	struct ThreadPool_t *Pool = malloc(sizeof(struct ThreadPool_t) + (nThreads-1)*sizeof(pthread_t));
+	if(!Pool) return NULL;
+	Pool->nThreads   = 1;
+	Pool->Threads    = (pthread_t*)(Pool + 1);
+	Pool->Func       = NULL;
+	Pool->Arg        = NULL;
+	Pool->nTasks     = 0;
+	Pool->NextTask   = 0;
+	Pool->nTasksDone = 0;
+	Pool->JobIdx     = 0;
+	Pool->Quit       = 0;
+	pthread_mutex_init(&Pool->Lock, NULL);
+	pthread_cond_init(&Pool->WakeCond, NULL);
+	pthread_cond_init(&Pool->DoneCond, NULL);
+
+	//! Spawn workers (the calling thread is thread 0)
+	//! NOTE: If a thread fails to spawn, we just continue
+	//! with however many threads we managed to create.
+	for(i=1;i<nThreads;i++) {
+		struct ThreadPool_WorkerArg_t *Arg = malloc(sizeof(struct ThreadPool_WorkerArg_t));
+		if(!Arg) break;
+		Arg->Pool      = Pool;
+		Arg->ThreadIdx = i;
+		if(pthread_create(&Pool->Threads[i-1], NULL, ThreadPool_Worker, Arg) != 0) {
+			free(Arg);
+			break;
+		}
+		Pool->nThreads++;
+	}
+	return Pool;
+}
+
+//! Destroy pool
+void ThreadPool_Destroy(struct ThreadPool_t *Pool) {
+	int i;
+	if(!Pool) return;
+
+	//! Signal exit and wait for workers
+	pthread_mutex_lock(&Pool->Lock);
+	Pool->Quit = 1;
+	pthread_cond_broadcast(&Pool->WakeCond);
+	pthread_mutex_unlock(&Pool->Lock);
+	for(i=1;i<Pool->nThreads;i++) pthread_join(Pool->Threads[i-1], NULL);
+
+	//! Clean up
+	pthread_cond_destroy(&Pool->DoneCond);
+	pthread_cond_destroy(&Pool->WakeCond);
+	pthread_mutex_destroy(&Pool->Lock);
+	free(Pool);
+}
+
+//! Get number of threads in the pool
+int ThreadPool_GetThreadCount(const struct ThreadPool_t *Pool) {
+	return Pool ? Pool->nThreads : 1;
+}
+
+/**************************************/
+
+//! Run tasks and wait for completion
+void ThreadPool_Run(struct ThreadPool_t *Pool, ThreadPool_Func_t Func, void *Arg, int nTasks) {
+	int i;
+
+	//! Single-threaded?
+	if(!Pool || Pool->nThreads == 1 || nTasks == 1) {
+		for(i=0;i<nTasks;i++) Func(Arg, i, 0);
+		return;
+	}
+
+	//! Post job, help process it, and wait for stragglers
+	pthread_mutex_lock(&Pool->Lock);
+	Pool->Func       = Func;
+	Pool->Arg        = Arg;
+	Pool->nTasks     = nTasks;
+	Pool->NextTask   = 0;
+	Pool->nTasksDone = 0;
+	Pool->JobIdx++;
+	pthread_cond_broadcast(&Pool->WakeCond);
+	ThreadPool_ProcessTasks(Pool, 0);
+	while(Pool->nTasksDone < Pool->nTasks) pthread_cond_wait(&Pool->DoneCond, &Pool->Lock);
+	pthread_mutex_unlock(&Pool->Lock);
+}
+
+//! Yield time slice
+void ThreadPool_Yield(void) {
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+/**************************************/
+//! EOF
+/**************************************/
@@ -0,0 +1,47 @@
+/**************************************/
+#pragma once
+/**************************************/
+
+//! Worker function: Called once for every task index.
+//! ThreadIdx is in [0,nThreads) and can be used to select
+//! per-thread scratch memory.
+typedef void (*ThreadPool_Func_t)(void *Arg, int TaskIdx, int ThreadIdx);
+
+//! Opaque pool of worker threads
+struct ThreadPool_t;
+
+/**************************************/
+
+//! Get the number of available CPUs
+int ThreadPool_GetCPUCount(void);
+
+//! Create pool
+//! Pass nThreads=0 to use one thread per CPU.
+//! NOTE: The calling thread counts towards nThreads, as it
+//! takes part in processing during ThreadPool_Run().
+struct ThreadPool_t *ThreadPool_Create(int nThreads);
+
+//! Destroy pool
+void ThreadPool_Destroy(struct ThreadPool_t *Pool);
+
+//! Get number of threads in the pool
+//! NOTE: Returns 1 for Pool=NULL
+int ThreadPool_GetThreadCount(const struct ThreadPool_t *Pool);
+
+//! Run tasks [0,nTasks) and wait for all of them to complete
+//! NOTE: With Pool=NULL, all tasks run on the calling thread.
+//! NOTE: Tasks are started in increasing order, but may complete
+//! in any order, so any results that must be deterministic should
+//! be stored per-task and reduced by the caller afterwards. Tasks
+//! may wait on tasks with a lower index (eg. wavefront processing),
+//! but never on tasks with a higher index.
+//! NOTE: Do NOT call this from inside a task on the same pool.
+void ThreadPool_Run(struct ThreadPool_t *Pool, ThreadPool_Func_t Func, void *Arg, int nTasks);
+
+//! Yield the remainder of the calling thread's time slice
+//! NOTE: Used when waiting on other tasks.
+void ThreadPool_Yield(void);
+
+/**************************************/
+//! EOF
+/**************************************/
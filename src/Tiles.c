@@ -1,7 +1,9 @@
 /**************************************/
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 /**************************************/
 #include "Dither.h"
 #include "Quantize.h"
@@ -20,59 +22,224 @@
 #define DATA_ALIGN(x) ALIGN2N((uintptr_t)(x), DATA_ALIGNMENT) //! NOTE: Cast to uintptr_t
 /**************************************/
 
+//! Get the number of elements needed for PxTemp[]
+//! This must fit a row of tiles (for ConvertToTiles()), and
+//! the diffusion buffer or palette spreads of DitherImage().
+static inline int TilesData_GetTempSize(int Width, int TileH) {
+	int n = TileH*Width;
+	if(n < (Width+2)*2)           n = (Width+2)*2;
+	if(n < BMP_PALETTE_COLOURS)   n = BMP_PALETTE_COLOURS;
+	return n;
+}
+
+//! Widen a TILESDATA_STORAGE_BGRA8 pixel to YUVA
+//! NOTE: This gives exactly the same value as TILESDATA_STORAGE_FLOAT.
+static inline struct BGRAf_t TilesData_WidenPx(const struct BGRA8_t *x, const struct BGRA8_t *BitRange) {
+	struct BGRAf_t Px = BGRAf_FromBGRA(x, BitRange);
+	return BGRAf_AsYUV(&Px);
+}
+
+//! Get the size of a tile pixel in the storage mode
+static inline int TilesData_GetPxSize(const struct TilesData_t *TilesData) {
+	return (TilesData->PxStorage == TILESDATA_STORAGE_BGRA8) ? sizeof(struct BGRA8_t) : sizeof(struct BGRAf_t);
+}
+
+//! Get the value of a tile from the sum of its YUVA pixels
+static inline struct BGRAf_t TilesData_GetTileValue(struct BGRAf_t Mean, int nPx) {
+	//! Normalize the chroma values by the luma value, and normalize
+	//! the luma value to the mean for this tile.
+	//! The idea here is to cluster the colour similarity after adjusting
+	//! for luminosity (so that similar colours of different luminosities
+	//! will end up in the same palette), and then treat the luma as just
+	//! another dimension to optimize for.
+	//! Note that the alpha channels is just normalized as per usual,
+	//! because it is assumed that the input is pre-multiplied.
+	//! NOTE: Dividing by the square root of the luminosity improves PSNR;
+	//! I have no idea why this is the case, though.
+	float Norm = Mean.b;
+	if(Norm) {
+		//! NOTE: Chroma values are scaled by 0.1 relative to luma and
+		//! alpha; this is to give 10x more importance to the latter,
+		//! and is used to fixe some edge cases with subtle details.
+		float InvNorm = 0.1f / sqrtf(Norm);
+		Mean.g *= InvNorm;
+		Mean.r *= InvNorm;
+	}
+	Mean.b /= (float)nPx;
+	Mean.a /= (float)nPx;
+	return Mean;
+}
+
 //! Fill out the tile data
+//! NOTE: PxData[] (or PxDataBGRA8[]) initially holds the image in raster
+//! order, and is converted to tile order in-place, one row of tiles at a
+//! time (the pixels of a row of tiles occupy the same range in both
+//! layouts); BandTemp[] must hold TileH*nTileX*TileW elements.
 static inline void ConvertToTiles(
 	struct TilesData_t *TilesData,
-	const struct BGRAf_t *PxBGRA,
+	struct BGRAf_t *BandTemp,
 	int TileW,
 	int TileH,
 	int nTileX,
 	int nTileY
 ) {
-	int tx, ty, px, py;
-	union TilePx_t *TilePxPtr = TilesData->TilePxPtr;
-	struct BGRAf_t *TileValue = TilesData->TileValue;
-	struct BGRAf_t *PxData    = TilesData->PxData;
+	int i, tx, ty, px, py;
+	int nBandPx = TileH*nTileX*TileW;
+	union TilePx_t *TilePxPtr   = TilesData->TilePxPtr;
+	struct BGRAf_t *TileValue   = TilesData->TileValue;
+	struct BGRAf_t *PxData      = TilesData->PxData;
+	struct BGRA8_t *PxDataBGRA8 = TilesData->PxDataBGRA8;
+	struct BGRA8_t *BandTempBGRA8 = (struct BGRA8_t*)BandTemp;
 	for(ty=0;ty<nTileY;ty++) for(tx=0;tx<nTileX;tx++) {
+		//! Move this row of tiles out of the way when starting on it
+		if(tx == 0) {
+			if(PxDataBGRA8) for(i=0;i<nBandPx;i++) BandTempBGRA8[i] = PxDataBGRA8[i];
+			else            for(i=0;i<nBandPx;i++) BandTemp     [i] = PxData     [i];
+		}
+
 		//! Copy pixels as YUV, and get mean
 		struct BGRAf_t Mean = {0,0,0,0};
 		for(py=0;py<TileH;py++) for(px=0;px<TileW;px++) {
 			//! Convert and store pixel
-			struct BGRAf_t Px = BGRAf_AsYUV(&PxBGRA[(ty*TileH+py)*(nTileX*TileW) + (tx*TileW+px)]);
-			*PxData++ = Px;
+			//! NOTE: Compact storage keeps the original pixel, but
+			//! still needs the YUV value for the tile mean.
+			struct BGRAf_t Px;
+			int SrcIdx = py*(nTileX*TileW) + (tx*TileW+px);
+			if(PxDataBGRA8) {
+				*PxDataBGRA8++ = BandTempBGRA8[SrcIdx];
+				Px = TilesData_WidenPx(&BandTempBGRA8[SrcIdx], &TilesData->BitRange);
+			} else {
+				Px = BGRAf_AsYUV(&BandTemp[SrcIdx]);
+				*PxData++ = Px;
+			}
 			Mean = BGRAf_Add(&Mean, &Px);
 		}
 
-		//! Now normalize the chroma values by the luma value, and normalize
-		//! the luma value to the mean for this tile.
-		//! The idea here is to cluster the colour similarity after adjusting
-		//! for luminosity (so that similar colours of different luminosities
-		//! will end up in the same palette), and then treat the luma as just
-		//! another dimension to optimize for.
-		//! Note that the alpha channels is just normalized as per usual,
-		//! because it is assumed that the input is pre-multiplied.
-		//! NOTE: Dividing by the square root of the luminosity improves PSNR;
-		//! I have no idea why this is the case, though.
-		float Norm = Mean.b;
-		if(Norm) {
-			//! NOTE: Chroma values are scaled by 0.1 relative to luma and
-			//! alpha; this is to give 10x more importance to the latter,
-			//! and is used to fixe some edge cases with subtle details.
-			float InvNorm = 0.1f / sqrtf(Norm);
-			Mean.g *= InvNorm;
-			Mean.r *= InvNorm;
-		}
-		Mean.b /= (float)(TileW*TileH);
-		Mean.a /= (float)(TileW*TileH);
-
 		//! Store value and move to next tile
-		(TilePxPtr++)->PxBGRAf = PxData - TileW*TileH;
-		*TileValue++ = Mean;
+		if(PxDataBGRA8) (TilePxPtr++)->PxBGRA8 = PxDataBGRA8 - TileW*TileH;
+		else            (TilePxPtr++)->PxBGRAf = PxData      - TileW*TileH;
+		*TileValue++ = TilesData_GetTileValue(Mean, TileW*TileH);
 	}
 }
 
 /**************************************/
 
+//! Get the pixel offset within a tile for a given flip
+static inline int TilesData_FlipOffset(int x, int y, int TileW, int TileH, int Flip) {
+	if(Flip & TILE_FLIP_H) x = TileW-1 - x;
+	if(Flip & TILE_FLIP_V) y = TileH-1 - y;
+	return y*TileW + x;
+}
+
+//! Hash a sequence of 32-bit words (FNV-1a with a final mix)
+static inline uint32_t TilesData_HashStep(uint32_t h, uint32_t x) {
+	return (h ^ x) * 0x01000193u;
+}
+static inline uint32_t TilesData_HashFinal(uint32_t h) {
+	h = (h ^ (h >> 16)) * 0x7FEB352Du;
+	h = (h ^ (h >> 15)) * 0x846CA68Bu;
+	return h ^ (h >> 16);
+}
+
+//! Get a source pixel of a tile
+static inline struct BGRA8_t TilesData_GetSrcPx(const struct BmpCtx_t *Ctx, const struct TilesData_t *TilesData, int Tile, int Offs) {
+	int tx = Tile % TilesData->TilesX, px = Offs % TilesData->TileW;
+	int ty = Tile / TilesData->TilesX, py = Offs / TilesData->TileW;
+	int Idx = (ty*TilesData->TileH + py)*Ctx->Width + (tx*TilesData->TileW + px);
+	return Ctx->ColPal ? Ctx->ColPal[Ctx->PxIdx[Idx]] : Ctx->PxBGR[Idx];
+}
+
+//! Hash the source pixels of a tile, as seen through a flip
+static uint32_t TilesData_HashSrcTile(const struct BmpCtx_t *Ctx, const struct TilesData_t *TilesData, int Tile, int Flip) {
+	int x, y;
+	uint32_t h = 0x811C9DC5u;
+	for(y=0;y<TilesData->TileH;y++) for(x=0;x<TilesData->TileW;x++) {
+		struct BGRA8_t p = TilesData_GetSrcPx(Ctx, TilesData, Tile, TilesData_FlipOffset(x, y, TilesData->TileW, TilesData->TileH, Flip));
+		uint32_t k; memcpy(&k, &p, sizeof(k));
+		h = TilesData_HashStep(h, k);
+	}
+	return TilesData_HashFinal(h);
+}
+
+//! Check if tile Ref is equal to tile Tile seen through a flip,
+//! both in the source image and after the first dithering pass
+static int TilesData_TileIsCopy(const struct BmpCtx_t *Ctx, const struct TilesData_t *TilesData, int Ref, int Tile, int Flip) {
+	int x, y;
+	int PxSize = TilesData_GetPxSize(TilesData);
+	const uint8_t *RefPx  = TilesData->PxDataBGRA8 ? (const uint8_t*)TilesData->TilePxPtr[Ref ].PxBGRA8 : (const uint8_t*)TilesData->TilePxPtr[Ref ].PxBGRAf;
+	const uint8_t *TilePx = TilesData->PxDataBGRA8 ? (const uint8_t*)TilesData->TilePxPtr[Tile].PxBGRA8 : (const uint8_t*)TilesData->TilePxPtr[Tile].PxBGRAf;
+	for(y=0;y<TilesData->TileH;y++) for(x=0;x<TilesData->TileW;x++) {
+		int RefOffs  = y*TilesData->TileW + x;
+		int TileOffs = TilesData_FlipOffset(x, y, TilesData->TileW, TilesData->TileH, Flip);
+		struct BGRA8_t a = TilesData_GetSrcPx(Ctx, TilesData, Ref,  RefOffs);
+		struct BGRA8_t b = TilesData_GetSrcPx(Ctx, TilesData, Tile, TileOffs);
+		if(memcmp(&a, &b, sizeof(a))) return 0;
+		if(memcmp(RefPx + RefOffs*PxSize, TilePx + TileOffs*PxSize, PxSize)) return 0;
+	}
+	return 1;
+}
+
+//! Find duplicate tiles
+//! Returns 0 on failure (out of memory), leaving all tiles unique.
+//! NOTE: Expects TileRef[], TileFlip[] and TileCount[] to be initialized
+//! with every tile being unique.
+static int TilesData_FindDuplicates(struct TilesData_t *TilesData, const struct BmpCtx_t *Ctx) {
+	int i, Flip;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+
+	//! Allocate hash table (at least 50% empty)
+	uint32_t HashMask = 1; while(HashMask < 2u*nTiles) HashMask *= 2; HashMask--;
+	int32_t  *Hash;
+	uint32_t *TileHash;
+	void *Buffer = Arena_Alloc(TilesData->Arena,
+		DATA_ALIGNMENT-1                          + //! Rounding
+		DATA_ALIGN((HashMask+1)*sizeof(int32_t))  + //! Hash
+		DATA_ALIGN(nTiles*sizeof(uint32_t))         //! TileHash
+	);
+	if(!Buffer) return 0;
+	Hash     = (int32_t *)DATA_ALIGN(Buffer);
+	TileHash = (uint32_t*)DATA_ALIGN(Hash + HashMask+1);
+	for(i=0;i<=(int)HashMask;i++) Hash[i] = -1;
+
+	//! Look up every tile (in every orientation) among the unique
+	//! tiles found so far, and insert it as a new one if not found
+	//! NOTE: If Tile is Ref seen through a flip, then hashing Tile
+	//! through the same flip gives the (unflipped) hash of Ref.
+	TilesData->nUniqueTiles = 0;
+	for(i=0;i<nTiles;i++) {
+		int Ref = -1;
+		uint32_t h0 = 0;
+		for(Flip=0;Flip<4 && Ref == -1;Flip++) {
+			uint32_t h = TilesData_HashSrcTile(Ctx, TilesData, i, Flip);
+			uint32_t Slot = h & HashMask;
+			if(Flip == 0) h0 = h;
+			for(;Hash[Slot] != -1;Slot=(Slot+1)&HashMask) {
+				int Cand = Hash[Slot];
+				if(TileHash[Cand] == h && TilesData_TileIsCopy(Ctx, TilesData, Cand, i, Flip)) {
+					Ref = Cand;
+					TilesData->TileFlip[i] = Flip;
+					break;
+				}
+			}
+		}
+		if(Ref != -1) {
+			TilesData->TileRef  [i] = Ref;
+			TilesData->TileCount[i] = 0;
+			TilesData->TileCount[Ref]++;
+		} else {
+			uint32_t Slot = h0 & HashMask;
+			while(Hash[Slot] != -1) Slot = (Slot+1) & HashMask;
+			Hash[Slot] = i;
+			TileHash[i] = h0;
+			TilesData->nUniqueTiles++;
+		}
+	}
+	Arena_Free(TilesData->Arena, Buffer);
+	return 1;
+}
+
+/**************************************/
+
 //! Convert bitmap to tiles
 struct TilesData_t *TilesData_FromBitmap(
 	const struct BmpCtx_t *Ctx,
@@ -80,22 +247,34 @@ struct TilesData_t *TilesData_FromBitmap(
 	int TileH,
 	const struct BGRA8_t *BitRange,
 	int   DitherType,
-	float DitherLevel
+	float DitherLevel,
+	int   PxStorage,
+	int   DedupTiles,
+	struct ThreadPool_t *Pool,
+	struct Stats_t *Stats,
+	struct Arena_t *Arena
 ) {
 	//! Allocate memory for tiles
 	int nPx    = Ctx->Width * Ctx->Height;
 	int nTileX = (Ctx->Width  / TileW);
 	int nTileY = (Ctx->Height / TileH);
 	int nTiles = nTileX * nTileY;
-	struct TilesData_t *TilesData = malloc(
+	int nTemp  = TilesData_GetTempSize(Ctx->Width, TileH);
+	int nPxF   = (PxStorage == TILESDATA_STORAGE_BGRA8) ? 0 : nPx;
+	int nPx8   = (PxStorage == TILESDATA_STORAGE_BGRA8) ? nPx : 0;
+	struct TilesData_t *TilesData = Arena_Alloc(Arena,
 		DATA_ALIGNMENT-1                          + //! Rounding
 		DATA_ALIGN(sizeof(struct TilesData_t))    +
 		DATA_ALIGN(nTiles*sizeof(union TilePx_t)) + //! TilePxPtr
 		DATA_ALIGN(nTiles*sizeof(struct BGRAf_t)) + //! TileValue
-		DATA_ALIGN(nPx   *sizeof(struct BGRAf_t)) + //! PxData
-		DATA_ALIGN(nPx   *sizeof(struct BGRAf_t)) + //! PxTemp
+		DATA_ALIGN(nPxF  *sizeof(struct BGRAf_t)) + //! PxData
+		DATA_ALIGN(nPx8  *sizeof(struct BGRA8_t)) + //! PxDataBGRA8
+		DATA_ALIGN(nTemp *sizeof(struct BGRAf_t)) + //! PxTemp
 		DATA_ALIGN(nPx   *sizeof(int32_t)       ) + //! PxTempIdx
-		DATA_ALIGN(nTiles*sizeof(int32_t)       )   //! TilePalIdx
+		DATA_ALIGN(nTiles*sizeof(int32_t)       ) + //! TilePalIdx
+		DATA_ALIGN(nTiles*sizeof(int32_t)       ) + //! TileRef
+		DATA_ALIGN(nTiles*sizeof(uint8_t)       ) + //! TileFlip
+		DATA_ALIGN(nTiles*sizeof(int32_t)       )   //! TileCount
 	);
 	if(!TilesData) return NULL;
 
@@ -104,99 +283,1097 @@ struct TilesData_t *TilesData_FromBitmap(
 	TilesData->TileH      = TileH;
 	TilesData->TilesX     = nTileX;
 	TilesData->TilesY     = nTileY;
+	TilesData->PxStorage  = (PxStorage == TILESDATA_STORAGE_BGRA8) ? TILESDATA_STORAGE_BGRA8 : TILESDATA_STORAGE_FLOAT;
+	TilesData->BitRange   = *BitRange;
 	TilesData->TilePxPtr  = (union TilePx_t*)DATA_ALIGN(TilesData + 1);
 	TilesData->TileValue  = (struct BGRAf_t*)DATA_ALIGN(TilesData->TilePxPtr + nTiles);
 	TilesData->PxData     = (struct BGRAf_t*)DATA_ALIGN(TilesData->TileValue + nTiles);
-	TilesData->PxTemp     = (struct BGRAf_t*)DATA_ALIGN(TilesData->PxData    + nPx);
-	TilesData->PxTempIdx  = (int32_t       *)DATA_ALIGN(TilesData->PxTemp    + nPx);
+	TilesData->PxDataBGRA8= (struct BGRA8_t*)DATA_ALIGN(TilesData->PxData    + nPxF);
+	TilesData->PxTemp     = (struct BGRAf_t*)DATA_ALIGN(TilesData->PxDataBGRA8 + nPx8);
+	TilesData->PxTempIdx  = (int32_t       *)DATA_ALIGN(TilesData->PxTemp    + nTemp);
 	TilesData->TilePalIdx = (int32_t       *)DATA_ALIGN(TilesData->PxTempIdx + nPx);
+	TilesData->TileRef    = (int32_t       *)DATA_ALIGN(TilesData->TilePalIdx + nTiles);
+	TilesData->TileFlip   = (uint8_t       *)DATA_ALIGN(TilesData->TileRef    + nTiles);
+	TilesData->TileCount  = (int32_t       *)DATA_ALIGN(TilesData->TileFlip   + nTiles);
+
+	TilesData->Stream     = NULL;
+	TilesData->Pool       = Pool;
+	TilesData->Stats      = Stats;
+	TilesData->Arena      = Arena;
 
-	//! Apply first-pass dithering into PxTemp[] and fill tiles using this data
+	if(nPxF) TilesData->PxDataBGRA8 = NULL;
+	else     TilesData->PxData      = NULL;
+
+	//! Apply first-pass dithering into PxData[] (or PxDataBGRA8[])
+	//! and convert this to tiles
+	struct Stats_Timer_t Timer = Stats_Begin(Stats);
 	DitherImage(
 		Ctx,
 		BitRange,
-		TilesData->PxTemp,
-		0,
-		0,
+		TilesData->PxData,
+		TilesData->PxDataBGRA8,
+		TileW,
+		TileH,
 		0,
 		0,
 		0,
 		NULL,
 		NULL,
 		NULL,
+		NULL,
 		DitherType,
 		DitherLevel,
-		TilesData->PxData //! <- This is unused until after ConvertToTiles(), so we can use it here
+		TilesData->PxTemp,
+		Pool,
+		Arena
 	);
+	Stats_End(Stats, STATS_STAGE_DITHER, &Timer, nPx);
+	Timer = Stats_Begin(Stats);
 	ConvertToTiles(TilesData, TilesData->PxTemp, TileW, TileH, nTileX, nTileY);
 
+	//! Find duplicate tiles
+	{
+		int i;
+		for(i=0;i<nTiles;i++) {
+			TilesData->TileRef  [i] = i;
+			TilesData->TileFlip [i] = 0;
+			TilesData->TileCount[i] = 1;
+		}
+		TilesData->nUniqueTiles = nTiles;
+		if(DedupTiles) (void)TilesData_FindDuplicates(TilesData, Ctx); //! <- On failure, all tiles remain unique
+	}
+	Stats_End(Stats, STATS_STAGE_TILES, &Timer, nTiles);
+
 	//! Return tiles array
 	return TilesData;
 }
 
 /**************************************/
 
-//! Create quantized palette
-int TilesData_QuantizePalettes(
+//! Band of rows of tiles from a TILESDATA_STORAGE_STREAM image
+struct TilesData_Band_t {
+	struct BmpCtx_t Image;       //! Source pixels
+	struct BGRA8_t *Px;          //! Pixels after first-pass dithering (range-reduced, raster order)
+	struct DitherState_t Dither; //! First-pass dithering state
+	int TileY;                   //! First row of tiles in this band
+	int nTileRows;               //! Rows of tiles in this band
+};
+
+//! Begin reading bands from the start of the image
+static int TilesData_BandOpen(struct TilesData_t *TilesData, struct TilesData_Band_t *Band) {
+	int ImgW  = TilesData->TilesX * TilesData->TileW;
+	int BandH = TilesData->BandTileRows * TilesData->TileH;
+	Band->Px        = NULL;
+	Band->TileY     = 0;
+	Band->nTileRows = 0;
+	if(!BmpStream_CreateBand(TilesData->Stream, &Band->Image, BandH)) return 0;
+	Band->Px = malloc(ImgW*BandH*sizeof(struct BGRA8_t));
+	if(!Band->Px || !BmpStream_Rewind(TilesData->Stream)) {
+		BmpCtx_Destroy(&Band->Image);
+		free(Band->Px);
+		return 0;
+	}
+	DitherImage_Begin(
+		&Band->Dither,
+		ImgW,
+		&TilesData->BitRange,
+		TilesData->TileW,
+		TilesData->TileH,
+		0,
+		0,
+		0,
+		NULL,
+		TilesData->DitherType,
+		TilesData->DitherLevel,
+		TilesData->PxTemp,
+		TilesData->Pool,
+		NULL
+	);
+	return 1;
+}
+
+//! Read and apply first-pass dithering to the next band
+//! Returns 1 on success, 0 at the end of the image, or -1 on failure (read error).
+static int TilesData_BandNext(struct TilesData_t *TilesData, struct TilesData_Band_t *Band) {
+	Band->TileY += Band->nTileRows;
+	Band->nTileRows = TilesData->TilesY - Band->TileY;
+	if(Band->nTileRows > TilesData->BandTileRows) Band->nTileRows = TilesData->BandTileRows;
+	if(Band->nTileRows <= 0) return 0;
+	int nRows = Band->nTileRows*TilesData->TileH;
+	struct Stats_Timer_t Timer = Stats_Begin(TilesData->Stats);
+	if(!BmpStream_ReadRows(TilesData->Stream, &Band->Image, nRows)) return -1;
+	Stats_End(TilesData->Stats, STATS_STAGE_LOAD, &Timer, (uint64_t)nRows*Band->Image.Width);
+	Timer = Stats_Begin(TilesData->Stats);
+	DitherImage_Rows(&Band->Dither, &Band->Image, NULL, Band->Px, NULL, NULL, NULL);
+	Stats_End(TilesData->Stats, STATS_STAGE_DITHER, &Timer, (uint64_t)nRows*Band->Image.Width);
+	return 1;
+}
+
+//! Finish reading bands
+static void TilesData_BandClose(struct TilesData_Band_t *Band) {
+	(void)DitherImage_End(&Band->Dither);
+	BmpCtx_Destroy(&Band->Image);
+	free(Band->Px);
+}
+
+//! Get a pixel of a tile in a band
+static inline const struct BGRA8_t *TilesData_BandPx(const struct TilesData_t *TilesData, const struct TilesData_Band_t *Band, int tx, int ty, int px, int py) {
+	int ImgW = TilesData->TilesX * TilesData->TileW;
+	return &Band->Px[(ty*TilesData->TileH + py)*ImgW + (tx*TilesData->TileW + px)];
+}
+
+/**************************************/
+
+//! Prepare tiles from a streamed image
+struct TilesData_t *TilesData_FromStream(
+	struct BmpStream_t *Stream,
+	int TileW,
+	int TileH,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	int   BandTileRows,
+	struct ThreadPool_t *Pool,
+	struct Stats_t *Stats
+) {
+	if(Stream->Width % TileW || Stream->Height % TileH) return NULL;
+	if(BandTileRows <= 0) BandTileRows = 1;
+
+	//! Allocate memory for tile values
+	//! NOTE: No pixels are stored, so PxTemp[] only needs to
+	//! hold the diffusion buffer or palette spreads.
+	int nTileX = (Stream->Width  / TileW);
+	int nTileY = (Stream->Height / TileH);
+	int nTiles = nTileX * nTileY;
+	int nTemp  = TilesData_GetTempSize(Stream->Width, 0);
+	struct TilesData_t *TilesData = malloc(
+		DATA_ALIGNMENT-1                          + //! Rounding
+		DATA_ALIGN(sizeof(struct TilesData_t))    +
+		DATA_ALIGN(nTiles*sizeof(struct BGRAf_t)) + //! TileValue
+		DATA_ALIGN(nTemp *sizeof(struct BGRAf_t)) + //! PxTemp
+		DATA_ALIGN(nTiles*sizeof(int32_t)       )   //! TilePalIdx
+	);
+	if(!TilesData) return NULL;
+
+	//! Setup structure
+	TilesData->TileW        = TileW;
+	TilesData->TileH        = TileH;
+	TilesData->TilesX       = nTileX;
+	TilesData->TilesY       = nTileY;
+	TilesData->PxStorage    = TILESDATA_STORAGE_STREAM;
+	TilesData->BitRange     = *BitRange;
+	TilesData->TilePxPtr    = NULL;
+	TilesData->TileValue    = (struct BGRAf_t*)DATA_ALIGN(TilesData + 1);
+	TilesData->PxData       = NULL;
+	TilesData->PxDataBGRA8  = NULL;
+	TilesData->PxTemp       = (struct BGRAf_t*)DATA_ALIGN(TilesData->TileValue + nTiles);
+	TilesData->PxTempIdx    = NULL;
+	TilesData->TilePalIdx   = (int32_t       *)DATA_ALIGN(TilesData->PxTemp    + nTemp);
+	TilesData->TileRef      = NULL;
+	TilesData->TileFlip     = NULL;
+	TilesData->TileCount    = NULL;
+	TilesData->nUniqueTiles = nTiles;
+	TilesData->Stream       = Stream;
+	TilesData->BandTileRows = BandTileRows;
+	TilesData->DitherType   = DitherType;
+	TilesData->DitherLevel  = DitherLevel;
+	TilesData->Pool         = Pool;
+	TilesData->Stats        = Stats;
+	TilesData->Arena        = NULL;
+
+	//! Apply first-pass dithering to each band, and get the tile values
+	int Result;
+	struct TilesData_Band_t Band;
+	if(!TilesData_BandOpen(TilesData, &Band)) {
+		free(TilesData);
+		return NULL;
+	}
+	while((Result = TilesData_BandNext(TilesData, &Band)) > 0) {
+		int tx, ty, px, py;
+		struct Stats_Timer_t Timer = Stats_Begin(Stats);
+		for(ty=0;ty<Band.nTileRows;ty++) for(tx=0;tx<nTileX;tx++) {
+			struct BGRAf_t Mean = {0,0,0,0};
+			for(py=0;py<TileH;py++) for(px=0;px<TileW;px++) {
+				struct BGRAf_t Px = TilesData_WidenPx(TilesData_BandPx(TilesData, &Band, tx, ty, px, py), BitRange);
+				Mean = BGRAf_Add(&Mean, &Px);
+			}
+			TilesData->TileValue[(Band.TileY+ty)*nTileX + tx] = TilesData_GetTileValue(Mean, TileW*TileH);
+		}
+		Stats_End(Stats, STATS_STAGE_TILES, &Timer, Band.nTileRows*nTileX);
+	}
+	TilesData_BandClose(&Band);
+	if(Result < 0) {
+		free(TilesData);
+		return NULL;
+	}
+
+	//! Return tiles array
+	return TilesData;
+}
+
+/**************************************/
+
+//! Shared state for quantizing tile palettes
+struct TilesData_PalettePass_t {
+	struct TilesData_t *const *TilesData; //! [nImages]
+	int nImages;
+	struct BGRAf_t     *Palette;
+	int MaxTilePals;
+	int MaxPalSize;
+	int PalUnusedEntries;
+	const struct QuantCluster_Params_t *Params;
+	struct QuantCluster_t *Clusters; //! [nThreads][MaxPalSize]
+	const int32_t *PxOffset;         //! [nImages][MaxTilePals+1] (offsets into PxData[] and PxTempIdx[] of each image)
+	const int32_t *SlotTile;         //! [Sum of nTiles] (tile stored in each tile slot of PxData[], for every image in turn)
+	const int32_t *TileBase;         //! [nImages] (index of the first tile of each image in SlotTile[])
+	int            Weighted;         //! Pixels are weighted by their number of copies
+	const struct TilesData_ColourHist_t *Hists; //! [MaxTilePals] (TILESDATA_STORAGE_STREAM only)
+	int32_t       *PalFailed;        //! [MaxTilePals]
+	struct QuantCluster_Stats_t *PalStats; //! [MaxTilePals] (NULL = not collected)
+};
+
+//! Colour histogram of TILESDATA_STORAGE_BGRA8 pixels
+//! Identical pixels are collapsed (by their compact value) into weighted
+//! unique colours, in order of first appearance.
+struct TilesData_ColourHist_t {
+	int nUnique, nMax;
+	uint32_t HashMask;
+	int32_t        *Hash;   //! [HashMask+1]
+	struct BGRA8_t *Col;    //! [nMax]
+	float          *Weight; //! [nMax]
+	void *Buffer;
+	struct Arena_t *Arena;  //! Memory for Buffer (NULL = use malloc())
+};
+
+//! Find the hash slot of a colour (either holding it, or empty)
+static inline uint32_t TilesData_ColourHist_Find(const struct TilesData_ColourHist_t *Hist, const struct BGRA8_t *x) {
+	uint32_t Key; memcpy(&Key, x, sizeof(Key));
+	uint32_t h = Key * 0x9E3779B1u;
+	h = (h ^ (h >> 15)) * 0x85EBCA77u;
+	h = (h ^ (h >> 13)) & Hist->HashMask;
+	while(Hist->Hash[h] != -1 && memcmp(&Hist->Col[Hist->Hash[h]], x, sizeof(struct BGRA8_t))) h = (h+1) & Hist->HashMask;
+	return h;
+}
+
+//! Resize histogram to hold nMax colours (with the hash table at least 50% empty)
+//! NOTE: Pass a zeroed histogram (with Arena set as needed) to create a new
+//! one; destroy with Arena_Free(Hist->Arena, Hist->Buffer).
+static int TilesData_ColourHist_Resize(struct TilesData_ColourHist_t *Hist, int nMax) {
+	int i;
+	struct TilesData_ColourHist_t New = *Hist;
+	New.nMax     = nMax;
+	New.HashMask = 1; while(New.HashMask < 2u*nMax) New.HashMask *= 2; New.HashMask--;
+	New.Buffer   = Arena_Alloc(Hist->Arena,
+		DATA_ALIGNMENT-1                             + //! Rounding
+		DATA_ALIGN((New.HashMask+1)*sizeof(int32_t)) + //! Hash
+		DATA_ALIGN(nMax*sizeof(struct BGRA8_t))      + //! Col
+		DATA_ALIGN(nMax*sizeof(float))                 //! Weight
+	);
+	if(!New.Buffer) return 0;
+	New.Hash   = (int32_t       *)DATA_ALIGN(New.Buffer);
+	New.Col    = (struct BGRA8_t*)DATA_ALIGN(New.Hash + New.HashMask+1);
+	New.Weight = (float         *)DATA_ALIGN(New.Col  + nMax);
+	for(i=0;i<=(int)New.HashMask;i++) New.Hash[i] = -1;
+
+	//! Re-insert existing colours
+	for(i=0;i<Hist->nUnique;i++) {
+		New.Col   [i] = Hist->Col   [i];
+		New.Weight[i] = Hist->Weight[i];
+		New.Hash[TilesData_ColourHist_Find(&New, &New.Col[i])] = i;
+	}
+	Arena_Free(Hist->Arena, Hist->Buffer);
+	*Hist = New;
+	return 1;
+}
+
+//! Add pixels to histogram, storing the unique colour of each pixel to PxUnique[] (if not NULL)
+//! Returns 0 on failure (out of memory).
+static int TilesData_ColourHist_Add(
+	struct TilesData_ColourHist_t *Hist,
+	const struct BGRA8_t *Px,
+	const float *PxWeight,
+	int PxCnt,
+	int32_t *PxUnique
+) {
+	int i;
+	for(i=0;i<PxCnt;i++) {
+		uint32_t h = TilesData_ColourHist_Find(Hist, &Px[i]);
+		if(Hist->Hash[h] == -1) {
+			if(Hist->nUnique == Hist->nMax) {
+				if(!TilesData_ColourHist_Resize(Hist, Hist->nMax*2)) return 0;
+				h = TilesData_ColourHist_Find(Hist, &Px[i]);
+			}
+			Hist->Hash  [h] = Hist->nUnique;
+			Hist->Col   [Hist->nUnique] = Px[i];
+			Hist->Weight[Hist->nUnique] = 0.0f;
+			Hist->nUnique++;
+		}
+		Hist->Weight[Hist->Hash[h]] += PxWeight ? PxWeight[i] : 1.0f;
+		if(PxUnique) PxUnique[i] = Hist->Hash[h];
+	}
+	return 1;
+}
+
+//! Widen and cluster the unique colours of a histogram, then map
+//! the unique colour indices in PxClusters[PxCnt] to their clusters
+//! Returns 0 on failure (out of memory).
+static int TilesData_ColourHist_Quantize(
+	const struct TilesData_ColourHist_t *Hist,
+	struct QuantCluster_t *Clusters,
+	int nCluster,
+	int32_t *PxClusters,
+	int PxCnt,
+	const struct BGRA8_t *BitRange,
+	const struct QuantCluster_Params_t *Params
+) {
+	int i;
+	int nUnique = Hist->nUnique;
+	struct BGRAf_t *UniqueData;
+	int32_t        *UniqueClusters;
+	void *Buffer = Arena_Alloc(Params->Arena,
+		DATA_ALIGNMENT-1                                + //! Rounding
+		DATA_ALIGN(nUnique*sizeof(struct BGRAf_t))      + //! UniqueData
+		DATA_ALIGN(nUnique*sizeof(int32_t))               //! UniqueClusters
+	);
+	if(!Buffer) return 0;
+	UniqueData     = (struct BGRAf_t*)DATA_ALIGN(Buffer);
+	UniqueClusters = (int32_t       *)DATA_ALIGN(UniqueData + nUnique);
+
+	//! NOTE: The colours are already unique, so skip the histogram.
+	struct QuantCluster_Params_t UniqueParams = *Params;
+	UniqueParams.Histogram = 0;
+	for(i=0;i<nUnique;i++) UniqueData[i] = TilesData_WidenPx(&Hist->Col[i], BitRange);
+	int Result = QuantCluster_Quantize(Clusters, nCluster, UniqueData, Hist->Weight, nUnique, UniqueClusters, &UniqueParams);
+	if(Result) for(i=0;i<PxCnt;i++) PxClusters[i] = UniqueClusters[PxClusters[i]];
+	Arena_Free(Params->Arena, Buffer);
+	return Result;
+}
+
+//! Quantize TILESDATA_STORAGE_BGRA8 pixels
+//! With Params->Histogram, identical pixels are collapsed (by their compact
+//! value) into weighted unique colours, and only these are widened to YUVA
+//! and clustered. Otherwise, every pixel is widened and clustered as-is,
+//! which gives the same results as TILESDATA_STORAGE_FLOAT.
+//! Returns 0 on failure (out of memory).
+//! NOTE: The hash table and unique colours are bounded by the number of
+//! colours that BitRange can represent, which is usually far below PxCnt.
+//! Without the histogram, a YUVA copy of the pixels is held instead, but
+//! only while clustering this palette.
+static int TilesData_QuantizeBGRA8(
+	struct QuantCluster_t *Clusters,
+	int nCluster,
+	const struct BGRA8_t *Px,
+	const float *PxWeight,
+	int PxCnt,
+	int32_t *PxClusters,
+	const struct BGRA8_t *BitRange,
+	const struct QuantCluster_Params_t *Params
+) {
+	//! Cluster widened pixels
+	if(!Params->Histogram) {
+		int i;
+		struct BGRAf_t *Data = Arena_Alloc(Params->Arena, PxCnt*sizeof(struct BGRAf_t));
+		if(!Data) return 0;
+		for(i=0;i<PxCnt;i++) Data[i] = TilesData_WidenPx(&Px[i], BitRange);
+		int Result = QuantCluster_Quantize(Clusters, nCluster, Data, PxWeight, PxCnt, PxClusters, Params);
+		Arena_Free(Params->Arena, Data);
+		return Result;
+	}
+
+	//! Create histogram
+	uint64_t nColours = (uint64_t)(BitRange->b+1) * (BitRange->g+1) * (BitRange->r+1) * (BitRange->a+1);
+	int nMax = ((uint64_t)PxCnt < nColours) ? PxCnt : (int)nColours;
+	struct TilesData_ColourHist_t Hist = {.Arena = Params->Arena};
+	if(!TilesData_ColourHist_Resize(&Hist, nMax)) return 0;
+
+	//! Collapse identical pixels, and cluster the unique colours
+	int Result = TilesData_ColourHist_Add(&Hist, Px, PxWeight, PxCnt, PxClusters) &&
+	             TilesData_ColourHist_Quantize(&Hist, Clusters, nCluster, PxClusters, PxCnt, BitRange, Params);
+	Arena_Free(Hist.Arena, Hist.Buffer);
+	return Result;
+}
+
+//! Store the palette from the cluster centroids
+static void TilesData_StorePalette(const struct TilesData_PalettePass_t *Pass, int PalIdx, const struct QuantCluster_t *Clusters) {
+	int j;
+	struct BGRAf_t *Palette = Pass->Palette + PalIdx*(Pass->PalUnusedEntries + Pass->MaxPalSize);
+	for(j=0;j<Pass->PalUnusedEntries;j++) *Palette++ = (struct BGRAf_t){0,0,0,0};
+	for(j=0;j<Pass->MaxPalSize;      j++) *Palette++ = Clusters[j].Centroid;
+}
+
+//! Quantize a single tile palette
+//! NOTE: Every palette works on its own region of PxData[] and
+//! PxTempIdx[], and writes to its own slot of Palette[], so all
+//! palettes can be processed concurrently.
+static void TilesData_QuantizePaletteTask(void *Arg, int PalIdx, int ThreadIdx) {
+	int j, k, n;
+	const struct TilesData_PalettePass_t *Pass = Arg;
+	struct TilesData_t *TilesData = Pass->TilesData[0];
+	struct QuantCluster_t *Clusters = Pass->Clusters + ThreadIdx*Pass->MaxPalSize;
+	Pass->PalFailed[PalIdx] = 0;
+
+	//! Collect work counters separately for every palette, so
+	//! that they can be summed in order once all are done
+	struct QuantCluster_Params_t Params = *Pass->Params;
+	Params.Stats = Pass->PalStats ? &Pass->PalStats[PalIdx] : NULL;
+
+	//! Streamed tiles were already collapsed into a colour
+	//! histogram for each palette while reading the image
+	if(TilesData->PxStorage == TILESDATA_STORAGE_STREAM) {
+		const struct TilesData_ColourHist_t *Hist = &Pass->Hists[PalIdx];
+		if(!Hist->nUnique) return;
+		if(!TilesData_ColourHist_Quantize(Hist, Clusters, Pass->MaxPalSize, NULL, 0, &TilesData->BitRange, &Params)) {
+			Pass->PalFailed[PalIdx] = 1;
+			return;
+		}
+		TilesData_StorePalette(Pass, PalIdx, Clusters);
+		return;
+	}
+
+	//! The tiles of this palette are stored contiguously in every
+	//! image, so with a single image we can cluster its pixels directly
+	int nPxTile = TilesData->TileW * TilesData->TileH;
+	int PxSize  = TilesData_GetPxSize(TilesData);
+	int PxCnt   = 0;
+	for(k=0;k<Pass->nImages;k++) {
+		const int32_t *PxOffset = Pass->PxOffset + k*(Pass->MaxTilePals+1);
+		PxCnt += PxOffset[PalIdx+1] - PxOffset[PalIdx];
+	}
+	if(!PxCnt) return;
+	int32_t    *PxTempIdx = TilesData->PxTempIdx + Pass->PxOffset[PalIdx];
+	const void *PxData    = (TilesData->PxStorage == TILESDATA_STORAGE_BGRA8) ?
+		(const void*)(TilesData->PxDataBGRA8 + Pass->PxOffset[PalIdx]) :
+		(const void*)(TilesData->PxData      + Pass->PxOffset[PalIdx]);
+
+	//! Only unique tiles are stored here, so weight each
+	//! pixel by the number of copies of its tile
+	//! NOTE: With several images, the pixels of every image are gathered
+	//! (in image order) into a buffer along with these.
+	float *PxWeight = NULL;
+	void  *Buffer   = NULL;
+	if(Pass->Weighted || Pass->nImages > 1) {
+		int nWeight = Pass->Weighted  ? PxCnt : 0;
+		int nGather = (Pass->nImages > 1) ? PxCnt : 0;
+		Buffer = Arena_Alloc(Params.Arena,
+			DATA_ALIGNMENT-1                        + //! Rounding
+			DATA_ALIGN(nWeight*sizeof(float))       + //! PxWeight
+			DATA_ALIGN(nGather*PxSize)              + //! PxData
+			DATA_ALIGN(nGather*sizeof(int32_t))       //! PxTempIdx
+		);
+		if(!Buffer) {
+			Pass->PalFailed[PalIdx] = 1;
+			return;
+		}
+		PxWeight = (float*)DATA_ALIGN(Buffer);
+		if(nGather) {
+			PxData    = (void   *)DATA_ALIGN(PxWeight + nWeight);
+			PxTempIdx = (int32_t*)DATA_ALIGN((uint8_t*)PxData + nGather*PxSize);
+		}
+		for(k=0,n=0;k<Pass->nImages;k++) {
+			const struct TilesData_t *Image = Pass->TilesData[k];
+			const int32_t *PxOffset = Pass->PxOffset + k*(Pass->MaxTilePals+1);
+			const int32_t *SlotTile = Pass->SlotTile + Pass->TileBase[k];
+			int nImgPx = PxOffset[PalIdx+1] - PxOffset[PalIdx];
+			if(nGather) {
+				const uint8_t *Src = (Image->PxStorage == TILESDATA_STORAGE_BGRA8) ?
+					(const uint8_t*)(Image->PxDataBGRA8 + PxOffset[PalIdx]) :
+					(const uint8_t*)(Image->PxData      + PxOffset[PalIdx]);
+				memcpy((uint8_t*)PxData + n*PxSize, Src, nImgPx*PxSize);
+			}
+			if(Pass->Weighted) for(j=0;j<nImgPx;j++) {
+				int Tile = SlotTile[(PxOffset[PalIdx] + j) / nPxTile];
+				PxWeight[n+j] = (float)Image->TileCount[Tile];
+			}
+			n += nImgPx;
+		}
+		if(!Pass->Weighted) PxWeight = NULL;
+	}
+
+	//! Perform quantization
+	int Result;
+	if(TilesData->PxStorage == TILESDATA_STORAGE_BGRA8) {
+		Result = TilesData_QuantizeBGRA8(Clusters, Pass->MaxPalSize, PxData, PxWeight, PxCnt, PxTempIdx, &TilesData->BitRange, &Params);
+	} else {
+		Result = QuantCluster_Quantize(Clusters, Pass->MaxPalSize, PxData, PxWeight, PxCnt, PxTempIdx, &Params);
+	}
+	Arena_Free(Params.Arena, Buffer);
+	if(!Result) {
+		Pass->PalFailed[PalIdx] = 1;
+		return;
+	}
+
+	//! Extract palette from cluster centroids
+	TilesData_StorePalette(Pass, PalIdx, Clusters);
+}
+
+//! Move tiles in PxData[] (or PxDataBGRA8[]) so that the unique tiles of each palette are
+//! contiguous, starting at PxOffset[Palette] (in tile order), followed by all duplicate
+//! tiles starting at PxOffset[MaxTilePals], and update TilePxPtr[]
+//! NOTE: Tiles are permuted in-place by following cycles, so that no
+//! copy of the image is needed.
+static void TilesData_SortTiles(
 	struct TilesData_t *TilesData,
+	int MaxTilePals,
+	const int32_t *PxOffset,
+	int32_t *PalCursor,
+	int32_t *TileSlot,
+	int32_t *SlotTile
+) {
+	int i, k;
+	int nPxTile = TilesData->TileW  * TilesData->TileH;
+	int nTiles  = TilesData->TilesX * TilesData->TilesY;
+	int Compact = (TilesData->PxStorage == TILESDATA_STORAGE_BGRA8);
+	int TileSize = nPxTile * TilesData_GetPxSize(TilesData);
+	uint8_t *PxData = Compact ? (uint8_t*)TilesData->PxDataBGRA8 : (uint8_t*)TilesData->PxData;
+
+	//! Get the target slot of each tile, and the tile currently in each slot
+	for(i=0;i<=MaxTilePals;i++) PalCursor[i] = PxOffset[i] / nPxTile;
+	for(i=0;i<nTiles;i++) {
+		const uint8_t *Px = Compact ? (const uint8_t*)TilesData->TilePxPtr[i].PxBGRA8 : (const uint8_t*)TilesData->TilePxPtr[i].PxBGRAf;
+		int Bucket = TilesData->TileCount[i] ? TilesData->TilePalIdx[i] : MaxTilePals;
+		TileSlot[i] = PalCursor[Bucket]++;
+		SlotTile[(Px - PxData) / TileSize] = i;
+	}
+
+	//! Swap tiles into place; every swap puts at least one tile into
+	//! its target slot, so this takes fewer than nTiles swaps in total
+	for(i=0;i<nTiles;i++) {
+		int Tile;
+		while(TileSlot[Tile = SlotTile[i]] != i) {
+			int Dst = TileSlot[Tile];
+			uint8_t *a = PxData + i  *TileSize;
+			uint8_t *b = PxData + Dst*TileSize;
+			for(k=0;k<TileSize;k++) {
+				uint8_t t = a[k];
+				a[k] = b[k], b[k] = t;
+			}
+			SlotTile[i]   = SlotTile[Dst];
+			SlotTile[Dst] = Tile;
+		}
+	}
+
+	//! Update tile pointers
+	for(i=0;i<nTiles;i++) {
+		uint8_t *Px = PxData + TileSlot[i]*TileSize;
+		if(Compact) TilesData->TilePxPtr[i].PxBGRA8 = (struct BGRA8_t*)Px;
+		else        TilesData->TilePxPtr[i].PxBGRAf = (struct BGRAf_t*)Px;
+	}
+}
+
+//! Destroy the colour histograms of TilesData_GetStreamHistograms()
+static void TilesData_DestroyHistograms(struct TilesData_ColourHist_t *Hists, int MaxTilePals) {
+	int i;
+	if(Hists) for(i=0;i<MaxTilePals;i++) Arena_Free(Hists[i].Arena, Hists[i].Buffer);
+	free(Hists);
+}
+
+//! Get the colour histogram of every palette of a TILESDATA_STORAGE_STREAM image
+//! The pixels of each palette are added in the same order as they would be
+//! stored after TilesData_SortTiles(), so this gives the same histograms as
+//! TILESDATA_STORAGE_BGRA8 (without deduplication).
+//! NOTE: This is done regardless of QuantCluster_Params_t::Histogram, as
+//! clustering every pixel would need them all in memory at once.
+//! Returns NULL on failure (out of memory, or read error).
+static struct TilesData_ColourHist_t *TilesData_GetStreamHistograms(struct TilesData_t *TilesData, int MaxTilePals) {
+	int i;
+	int nPxTile = TilesData->TileW * TilesData->TileH;
+
+	//! Create histograms, and a buffer for the pixels of one tile
+	struct TilesData_ColourHist_t *Hists = calloc(MaxTilePals, sizeof(struct TilesData_ColourHist_t));
+	struct BGRA8_t *TilePx = malloc(nPxTile * sizeof(struct BGRA8_t));
+	int Ok = (Hists && TilePx);
+	for(i=0;i<MaxTilePals && Ok;i++) Ok = TilesData_ColourHist_Resize(&Hists[i], BMP_PALETTE_COLOURS);
+
+	//! Read the image again, and add the pixels of every tile to its palette
+	struct TilesData_Band_t Band;
+	if(Ok && TilesData_BandOpen(TilesData, &Band)) {
+		int Status = 0;
+		while(Ok && (Status = TilesData_BandNext(TilesData, &Band)) > 0) {
+			int tx, ty, px, py;
+			for(ty=0;ty<Band.nTileRows && Ok;ty++) for(tx=0;tx<TilesData->TilesX && Ok;tx++) {
+				int Tile = (Band.TileY+ty)*TilesData->TilesX + tx;
+				for(py=0;py<TilesData->TileH;py++) for(px=0;px<TilesData->TileW;px++) {
+					TilePx[py*TilesData->TileW + px] = *TilesData_BandPx(TilesData, &Band, tx, ty, px, py);
+				}
+				Ok = TilesData_ColourHist_Add(&Hists[TilesData->TilePalIdx[Tile]], TilePx, NULL, nPxTile, NULL);
+			}
+		}
+		if(Status < 0) Ok = 0;
+		TilesData_BandClose(&Band);
+	} else Ok = 0;
+	free(TilePx);
+	if(!Ok) {
+		TilesData_DestroyHistograms(Hists, MaxTilePals);
+		return NULL;
+	}
+	return Hists;
+}
+
+//! Add clustering work counters to a stage
+static void TilesData_AddClusterStats(struct Stats_t *Stats, int Stage, const struct Stats_Timer_t *Timer, const struct QuantCluster_Stats_t *x) {
+	if(!Stats) return;
+	Stats->Stage[Stage].nPasses    += x->nPasses;
+	Stats->Stage[Stage].nDistances += x->nDistances;
+	Stats_End(Stats, Stage, Timer, x->nPoints);
+}
+
+//! Create quantized palettes shared by several images
+int TilesData_QuantizeSharedPalettes(
+	struct TilesData_t *const *TilesData,
+	int nImages,
 	struct BGRAf_t *Palette,
 	int MaxTilePals,
 	int MaxPalSize,
 	int PalUnusedEntries,
-	int nTileClusterPasses,
-	int nColourClusterPasses
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams
 ) {
-	int i, j, k;
-	int nPxTile = TilesData->TileW  * TilesData->TileH;
-	int nTiles  = TilesData->TilesX * TilesData->TilesY;
+	int i, k, n;
+	struct TilesData_t *First = TilesData[0];
+	int nPxTile = First->TileW * First->TileH;
+	int Stream  = (First->PxStorage == TILESDATA_STORAGE_STREAM);
+
+	//! All images must have the same tiles and storage, and
+	//! streamed images can only be processed on their own
+	int nTiles = 0, nUnique = 0;
+	for(k=0;k<nImages;k++) {
+		const struct TilesData_t *Image = TilesData[k];
+		if(Image->TileW != First->TileW || Image->TileH != First->TileH) return 0;
+		if(Image->PxStorage != First->PxStorage) return 0;
+		if(memcmp(&Image->BitRange, &First->BitRange, sizeof(struct BGRA8_t))) return 0;
+		nTiles  += Image->TilesX * Image->TilesY;
+		nUnique += Image->nUniqueTiles;
+	}
+	if(Stream && nImages > 1) return 0;
 
 	//! Set default passes as needed
-	if(nTileClusterPasses   == 0) nTileClusterPasses   = DEFAULT_TILECLUSTER_PASSES;
-	if(nColourClusterPasses == 0) nColourClusterPasses = DEFAULT_COLOURCLUSTER_PASSES;
+	struct QuantCluster_Params_t TileParams   = *TileClusterParams;
+	struct QuantCluster_Params_t ColourParams = *ColourClusterParams;
+	if(TileParams.nPasses   == 0) TileParams.nPasses   = DEFAULT_TILECLUSTER_PASSES;
+	if(ColourParams.nPasses == 0) ColourParams.nPasses = DEFAULT_COLOURCLUSTER_PASSES;
 
 	//! Unused entries should not count towards
 	//! the maximum palette size
 	MaxPalSize -= PalUnusedEntries;
 
-	//! Allocate clusters
-	struct QuantCluster_t *Clusters, *_Clusters; {
-		int nClusters = MaxTilePals; if(MaxPalSize > nClusters) nClusters = MaxPalSize;
-		_Clusters = malloc(DATA_ALIGNMENT-1 + nClusters*sizeof(struct QuantCluster_t));
-		if(!_Clusters) return 0;
-		Clusters = (struct QuantCluster_t*)DATA_ALIGN(_Clusters);
+	//! When there are several palettes, quantize them concurrently
+	//! (with each palette being clustered on a single thread), rather
+	//! than distributing the work of each palette over the pool.
+	//! NOTE: Clustering results do not depend on the number of threads,
+	//! so this gives the same output as processing palettes in order.
+	struct ThreadPool_t *PalPool = NULL;
+	if(MaxTilePals > 1 && ThreadPool_GetThreadCount(ColourParams.Pool) > 1) {
+		PalPool = ColourParams.Pool;
+		ColourParams.Pool = NULL;
+	}
+	int nThreads = ThreadPool_GetThreadCount(PalPool);
+
+	//! Allocate clusters (one set per thread for palette quantization),
+	//! the palette pixel offsets, the tile slot mappings, and the unique
+	//! tile values
+	//! NOTE: Tile values of several images are gathered along with the
+	//! unique tiles, so that they can be clustered together.
+	struct QuantCluster_t *Clusters;
+	int32_t *PxOffset, *PalFailed, *PalCursor, *TileSlot, *SlotTile, *TileBase;
+	struct QuantCluster_Stats_t *PalStats;
+	struct BGRAf_t *UniqueValue;
+	float   *UniqueWeight;
+	int32_t *UniquePalIdx;
+	int Gather = (nUnique < nTiles || nImages > 1);
+	void *Buffer; {
+		int nClusters = MaxTilePals; if(nThreads*MaxPalSize > nClusters) nClusters = nThreads*MaxPalSize;
+		int nValues   = Gather ? nUnique : 0;
+		int nSlots    = Stream ? 0 : nTiles;
+		Buffer = Arena_Alloc(First->Arena,
+			DATA_ALIGNMENT-1                                    + //! Rounding
+			DATA_ALIGN(nClusters*sizeof(struct QuantCluster_t)) + //! Clusters
+			DATA_ALIGN(nImages*(MaxTilePals+1)*sizeof(int32_t)) + //! PxOffset
+			DATA_ALIGN(MaxTilePals*sizeof(int32_t))             + //! PalFailed
+			DATA_ALIGN(MaxTilePals*sizeof(struct QuantCluster_Stats_t)) + //! PalStats
+			DATA_ALIGN((MaxTilePals+1)*sizeof(int32_t))         + //! PalCursor
+			DATA_ALIGN(nSlots*sizeof(int32_t))                  + //! TileSlot
+			DATA_ALIGN(nSlots*sizeof(int32_t))                  + //! SlotTile
+			DATA_ALIGN(nImages*sizeof(int32_t))                 + //! TileBase
+			DATA_ALIGN(nValues*sizeof(struct BGRAf_t))          + //! UniqueValue
+			DATA_ALIGN(nValues*sizeof(float))                   + //! UniqueWeight
+			DATA_ALIGN(nValues*sizeof(int32_t))                   //! UniquePalIdx
+		);
+		if(!Buffer) return 0;
+		Clusters     = (struct QuantCluster_t*)DATA_ALIGN(Buffer);
+		PxOffset     = (int32_t*)DATA_ALIGN(Clusters  + nClusters);
+		PalFailed    = (int32_t*)DATA_ALIGN(PxOffset  + nImages*(MaxTilePals+1));
+		PalStats     = (struct QuantCluster_Stats_t*)DATA_ALIGN(PalFailed + MaxTilePals);
+		PalCursor    = (int32_t*)DATA_ALIGN(PalStats  + MaxTilePals);
+		TileSlot     = (int32_t*)DATA_ALIGN(PalCursor + MaxTilePals+1);
+		SlotTile     = (int32_t*)DATA_ALIGN(TileSlot  + nSlots);
+		TileBase     = (int32_t*)DATA_ALIGN(SlotTile  + nSlots);
+		UniqueValue  = (struct BGRAf_t*)DATA_ALIGN(TileBase + nImages);
+		UniqueWeight = (float  *)DATA_ALIGN(UniqueValue  + nValues);
+		UniquePalIdx = (int32_t*)DATA_ALIGN(UniqueWeight + nValues);
+	}
+	for(k=0,n=0;k<nImages;k++) {
+		TileBase[k] = n;
+		n += TilesData[k]->TilesX * TilesData[k]->TilesY;
 	}
 
 	//! Categorize tiles by palette
-	QuantCluster_Quantize(Clusters, MaxTilePals, TilesData->TileValue, nTiles, TilesData->TilePalIdx, nTileClusterPasses);
+	struct Stats_t *Stats = First->Stats;
+	struct Stats_Timer_t Timer = Stats_Begin(Stats);
+	struct QuantCluster_Stats_t TileStats = {0, 0, 0};
+	TileParams.Stats = &TileStats;
+	//! NOTE: When there are duplicate tiles, only the unique tiles are
+	//! clustered (weighted by their number of copies), and duplicates
+	//! then take on the palette of the tile they are a copy of. The
+	//! tiles of several images are clustered together in image order.
+	if(Gather) {
+		for(k=0,n=0;k<nImages;k++) {
+			const struct TilesData_t *Image = TilesData[k];
+			int nImgTiles = Image->TilesX * Image->TilesY;
+			for(i=0;i<nImgTiles;i++) if(Image->TileCount[i]) {
+				UniqueValue [n] = Image->TileValue[i];
+				UniqueWeight[n] = (float)Image->TileCount[i];
+				n++;
+			}
+		}
+		if(!QuantCluster_Quantize(Clusters, MaxTilePals, UniqueValue, (nUnique < nTiles) ? UniqueWeight : NULL, n, UniquePalIdx, &TileParams)) {
+			Arena_Free(First->Arena, Buffer);
+			return 0;
+		}
+		for(k=0,n=0;k<nImages;k++) {
+			struct TilesData_t *Image = TilesData[k];
+			int nImgTiles = Image->TilesX * Image->TilesY;
+			for(i=0;i<nImgTiles;i++) if(Image->TileCount[i]) Image->TilePalIdx[i] = UniquePalIdx[n++];
+			for(i=0;i<nImgTiles;i++) Image->TilePalIdx[i] = Image->TilePalIdx[Image->TileRef[i]];
+		}
+	} else if(!QuantCluster_Quantize(Clusters, MaxTilePals, First->TileValue, NULL, nTiles, First->TilePalIdx, &TileParams)) {
+		Arena_Free(First->Arena, Buffer);
+		return 0;
+	}
+	TilesData_AddClusterStats(Stats, STATS_STAGE_TILECLUSTER, &Timer, &TileStats);
+
+	//! Bucket the unique tiles by palette (counting sort), and lay out the
+	//! pixels of each palette contiguously in PxData[] (keeping the tile order)
+	//! NOTE: Streamed images have no pixels in memory, so these are instead
+	//! read again, and collapsed into a colour histogram for each palette
+	//! (the reading and dithering being counted in their own stages).
+	struct TilesData_ColourHist_t *Hists = NULL;
+	if(Stream) {
+		Hists = TilesData_GetStreamHistograms(First, MaxTilePals);
+		if(!Hists) {
+			Arena_Free(First->Arena, Buffer);
+			return 0;
+		}
+		Timer = Stats_Begin(Stats);
+	} else {
+		Timer = Stats_Begin(Stats);
+		for(k=0;k<nImages;k++) {
+			struct TilesData_t *Image = TilesData[k];
+			int32_t *ImgOffset = PxOffset + k*(MaxTilePals+1);
+			int nImgTiles = Image->TilesX * Image->TilesY;
+			for(i=0;i<=MaxTilePals;i++) ImgOffset[i] = 0;
+			for(i=0;i<nImgTiles;i++) if(Image->TileCount[i]) ImgOffset[Image->TilePalIdx[i]+1] += nPxTile;
+			for(i=0;i<MaxTilePals;i++) ImgOffset[i+1] += ImgOffset[i];
+			TilesData_SortTiles(Image, MaxTilePals, ImgOffset, PalCursor, TileSlot, SlotTile + TileBase[k]);
+		}
+	}
 
 	//! Quantize tile palettes
-	for(i=0;i<MaxTilePals;i++) {
-		struct BGRAf_t *PxTemp = TilesData->PxTemp;
-
-		//! Get all pixels of all tiles falling into this palette
-		int PxCnt; {
-			struct BGRAf_t *Dst = PxTemp;
-			for(j=0;j<nTiles;j++) if(TilesData->TilePalIdx[j] == i) {
-				const struct BGRAf_t *Src = TilesData->TilePxPtr[j].PxBGRAf;
-				for(k=0;k<nPxTile;k++) *Dst++ = *Src++;
-			}
-			PxCnt = Dst - PxTemp;
+	//! NOTE: Each palette is written to its own slot, even when
+	//! preceding palettes were left unused, so that palette indices
+	//! always match TilePalIdx[].
+	struct TilesData_PalettePass_t Pass = {
+		.TilesData        = TilesData,
+		.nImages          = nImages,
+		.Palette          = Palette,
+		.MaxTilePals      = MaxTilePals,
+		.MaxPalSize       = MaxPalSize,
+		.PalUnusedEntries = PalUnusedEntries,
+		.Params           = &ColourParams,
+		.Clusters         = Clusters,
+		.PxOffset         = PxOffset,
+		.SlotTile         = SlotTile,
+		.TileBase         = TileBase,
+		.Weighted         = (nUnique < nTiles),
+		.Hists            = Hists,
+		.PalFailed        = PalFailed,
+		.PalStats         = Stats ? PalStats : NULL,
+	};
+	for(i=0;i<MaxTilePals;i++) PalStats[i] = (struct QuantCluster_Stats_t){0, 0, 0};
+	ThreadPool_Run(PalPool, TilesData_QuantizePaletteTask, &Pass, MaxTilePals);
+	TilesData_DestroyHistograms(Hists, MaxTilePals);
+	{
+		struct QuantCluster_Stats_t Total = {0, 0, 0};
+		for(i=0;i<MaxTilePals;i++) {
+			Total.nPoints    += PalStats[i].nPoints;
+			Total.nPasses    += PalStats[i].nPasses;
+			Total.nDistances += PalStats[i].nDistances;
+		}
+		TilesData_AddClusterStats(Stats, STATS_STAGE_COLOURCLUSTER, &Timer, &Total);
+	}
+	for(i=0;i<MaxTilePals;i++) if(PalFailed[i]) {
+		Arena_Free(First->Arena, Buffer);
+		return 0;
+	}
+
+	//! Clean up, return
+	Arena_Free(First->Arena, Buffer);
+	return 1;
+}
+
+//! Create quantized palette
+int TilesData_QuantizePalettes(
+	struct TilesData_t *TilesData,
+	struct BGRAf_t *Palette,
+	int MaxTilePals,
+	int MaxPalSize,
+	int PalUnusedEntries,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams
+) {
+	return TilesData_QuantizeSharedPalettes(
+		&TilesData,
+		1,
+		Palette,
+		MaxTilePals,
+		MaxPalSize,
+		PalUnusedEntries,
+		TileClusterParams,
+		ColourClusterParams
+	);
+}
+
+/**************************************/
+
+//! Shared state for assigning given palettes to tiles
+struct TilesData_AssignPass_t {
+	struct TilesData_t *TilesData;
+	int MaxTilePals;
+	const struct QuantCluster_Centroids_t *PalMatch; //! [MaxTilePals] (matched entries of each palette, as YUVA)
+	QuantCluster_FindNearest_t FindNearest;
+};
+
+//! Get the remapping error of a tile with a palette
+//! Stops early (returning more than MaxErr) once MaxErr is exceeded, so
+//! a result equal to MaxErr is always the full error.
+static float TilesData_GetRemapError(
+	const struct TilesData_t *TilesData,
+	int Tile,
+	const struct QuantCluster_Centroids_t *Pal,
+	QuantCluster_FindNearest_t FindNearest,
+	float MaxErr
+) {
+	int n;
+	int nPx = TilesData->TileW * TilesData->TileH;
+	float Err = 0.0f, Dist = 0.0f;
+	struct BGRAf_t Px, PrevPx;
+	for(n=0;n<nPx && Err <= MaxErr;n++) {
+		Px = (TilesData->PxStorage == TILESDATA_STORAGE_BGRA8) ?
+			TilesData_WidenPx(&TilesData->TilePxPtr[Tile].PxBGRA8[n], &TilesData->BitRange) :
+			TilesData->TilePxPtr[Tile].PxBGRAf[n];
+
+		//! Pixels are range-reduced, so runs of the same colour
+		//! are common, and only need to be matched once
+		if(n == 0 || memcmp(&Px, &PrevPx, sizeof(Px))) {
+			int Idx = FindNearest(&Px, Pal);
+			if(Idx < 0) return INFINITY;
+			struct BGRAf_t Col = {Pal->b[Idx], Pal->g[Idx], Pal->r[Idx], Pal->a[Idx]};
+			Dist   = BGRAf_ColDistance(&Px, &Col);
+			PrevPx = Px;
+		}
+		Err += Dist;
+	}
+	return Err;
+}
+
+//! Assign the best-fitting palette to every unique tile of a row of tiles
+//! NOTE: Neighbouring tiles tend to use the same palette, so the palette
+//! of the previous tile is tried first, which lets the remaining palettes
+//! stop early. Ties still go to the first palette, so this gives the same
+//! result as trying every palette in order.
+static void TilesData_AssignPaletteTask(void *Arg, int TileY, int ThreadIdx) {
+	int tx, i;
+	const struct TilesData_AssignPass_t *Pass = Arg;
+	struct TilesData_t *TilesData = Pass->TilesData;
+	int PrevPal = 0;
+	(void)ThreadIdx;
+	for(tx=0;tx<TilesData->TilesX;tx++) {
+		int Tile = TileY*TilesData->TilesX + tx;
+		if(!TilesData->TileCount[Tile]) continue;
+		int   BestPal = -1;
+		float BestErr = INFINITY;
+		for(i=-1;i<Pass->MaxTilePals;i++) {
+			int Pal = (i < 0) ? PrevPal : i;
+			if(i == PrevPal) continue;
+			float Err = TilesData_GetRemapError(TilesData, Tile, &Pass->PalMatch[Pal], Pass->FindNearest, BestErr);
+			if(Err < BestErr || (Err == BestErr && Pal < BestPal)) BestPal = Pal, BestErr = Err;
 		}
-		if(!PxCnt) continue;
+		if(BestPal < 0) BestPal = 0; //! <- Nothing could be matched
+		TilesData->TilePalIdx[Tile] = PrevPal = BestPal;
+	}
+}
+
+//! Assign given palettes to tiles
+int TilesData_AssignPalettes(
+	struct TilesData_t *TilesData,
+	const struct BGRAf_t *Palette,
+	int MaxTilePals,
+	int MaxPalSize,
+	int PalUnusedEntries,
+	const int32_t *TilePalIdx,
+	struct ThreadPool_t *Pool
+) {
+	int i;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+	if(TilesData->PxStorage == TILESDATA_STORAGE_STREAM) return 0;
+	struct Stats_Timer_t Timer = Stats_Begin(TilesData->Stats);
 
-		//! Perform quantization
-		QuantCluster_Quantize(Clusters, MaxPalSize, PxTemp, PxCnt, TilesData->PxTempIdx, nColourClusterPasses);
+	//! Fixed palettes
+	//! NOTE: Duplicates of a tile are remapped along with it, so any
+	//! duplicate given a different palette becomes a unique tile.
+	if(TilePalIdx) {
+		for(i=0;i<nTiles;i++) if(TilePalIdx[i] < 0 || TilePalIdx[i] >= MaxTilePals) return 0;
+		for(i=0;i<nTiles;i++) {
+			int Ref = TilesData->TileRef[i];
+			TilesData->TilePalIdx[i] = TilePalIdx[i];
+			if(Ref != i && TilePalIdx[i] != TilePalIdx[Ref]) {
+				TilesData->TileRef  [i] = i;
+				TilesData->TileFlip [i] = 0;
+				TilesData->TileCount[i] = 1;
+				TilesData->TileCount[Ref]--;
+				TilesData->nUniqueTiles++;
+			}
+		}
+		Stats_End(TilesData->Stats, STATS_STAGE_TILECLUSTER, &Timer, nTiles);
+		return 1;
+	}
 
-		//! Extract palette from cluster centroids
-		for(j=0;j<PalUnusedEntries;j++) *Palette++ = (struct BGRAf_t){0,0,0,0};
-		for(j=0;j<MaxPalSize;      j++) *Palette++ = Clusters[j].Centroid;
+	//! Convert the palettes to YUVA in structure-of-arrays layout,
+	//! considering the same entries as DitherImage() does
+	//! NOTE: With unused entries, the last of these (usually a
+	//! transparent entry) can still be matched.
+	int Start = (PalUnusedEntries > 0) ? (PalUnusedEntries-1) : 0;
+	int nCol  = MaxPalSize - Start;
+	int nSize = QuantCluster_CentroidsGetSize(nCol);
+	void *Buffer = Arena_Alloc(TilesData->Arena,
+		DATA_ALIGNMENT-1                                                + //! Rounding
+		DATA_ALIGN(MaxTilePals*sizeof(struct QuantCluster_Centroids_t)) + //! PalMatch
+		DATA_ALIGN(nCol*sizeof(struct BGRAf_t))                         + //! PalYUV
+		MaxTilePals*DATA_ALIGN(nSize*sizeof(float))                       //! Centroid data
+	);
+	if(!Buffer) return 0;
+	struct QuantCluster_Centroids_t *PalMatch = (struct QuantCluster_Centroids_t*)DATA_ALIGN(Buffer);
+	struct BGRAf_t *PalYUV = (struct BGRAf_t*)DATA_ALIGN(PalMatch + MaxTilePals);
+	float *Data = (float*)DATA_ALIGN(PalYUV + nCol);
+	for(i=0;i<MaxTilePals;i++) {
+		int n;
+		for(n=0;n<nCol;n++) PalYUV[n] = BGRAf_AsYUV(&Palette[i*MaxPalSize + Start+n]);
+		QuantCluster_CentroidsFromColours(&PalMatch[i], Data, PalYUV, nCol);
+		Data = (float*)DATA_ALIGN(Data + nSize);
 	}
 
+	//! Pick the palette of every unique tile by its remapping error,
+	//! and have duplicates take on the palette of their tile
+	struct TilesData_AssignPass_t Pass = {
+		.TilesData   = TilesData,
+		.MaxTilePals = MaxTilePals,
+		.PalMatch    = PalMatch,
+		.FindNearest = QuantCluster_GetFindNearest(),
+	};
+	ThreadPool_Run(Pool, TilesData_AssignPaletteTask, &Pass, TilesData->TilesY);
+	for(i=0;i<nTiles;i++) TilesData->TilePalIdx[i] = TilesData->TilePalIdx[TilesData->TileRef[i]];
+	Stats_End(TilesData->Stats, STATS_STAGE_TILECLUSTER, &Timer, TilesData->nUniqueTiles);
+
 	//! Clean up, return
-	free(_Clusters);
+	Arena_Free(TilesData->Arena, Buffer);
 	return 1;
 }
 
+/**************************************/
+
+//! Get the palette-relative output index of a tile pixel
+static inline uint8_t TilesData_GetOutPx(const struct TilesData_t *TilesData, const uint8_t *PxIdx, int MaxPalSize, int Tile, int Offs) {
+	int ImgW = TilesData->TilesX * TilesData->TileW;
+	int tx = Tile % TilesData->TilesX, px = Offs % TilesData->TileW;
+	int ty = Tile / TilesData->TilesX, py = Offs / TilesData->TileW;
+	return PxIdx[(ty*TilesData->TileH + py)*ImgW + (tx*TilesData->TileW + px)] % MaxPalSize;
+}
+
+//! Build tilemap from output image
+int TilesData_BuildTileMap(
+	const struct TilesData_t *TilesData,
+	const uint8_t *PxIdx,
+	int MaxPalSize,
+	struct TileMapEntry_t *TileMap
+) {
+	int i, x, y, Flip;
+	int TileW  = TilesData->TileW;
+	int TileH  = TilesData->TileH;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+
+	//! Allocate hash table (at least 50% empty) and the
+	//! source tile and hash of every unique tile
+	uint32_t HashMask = 1; while(HashMask < 2u*nTiles) HashMask *= 2; HashMask--;
+	int32_t  *Hash;
+	int32_t  *UniqueTile;
+	uint32_t *UniqueHash;
+	void *Buffer = Arena_Alloc(TilesData->Arena,
+		DATA_ALIGNMENT-1                          + //! Rounding
+		DATA_ALIGN((HashMask+1)*sizeof(int32_t))  + //! Hash
+		DATA_ALIGN(nTiles*sizeof(int32_t))        + //! UniqueTile
+		DATA_ALIGN(nTiles*sizeof(uint32_t))         //! UniqueHash
+	);
+	if(!Buffer) return -1;
+	Hash       = (int32_t *)DATA_ALIGN(Buffer);
+	UniqueTile = (int32_t *)DATA_ALIGN(Hash       + HashMask+1);
+	UniqueHash = (uint32_t*)DATA_ALIGN(UniqueTile + nTiles);
+	for(i=0;i<=(int)HashMask;i++) Hash[i] = -1;
+
+	//! Look up every tile (in every orientation), as in TilesData_FindDuplicates()
+	int nUnique = 0;
+	for(i=0;i<nTiles;i++) {
+		int Found = -1;
+		uint32_t h0 = 0;
+		for(Flip=0;Flip<4 && Found == -1;Flip++) {
+			uint32_t h = 0x811C9DC5u;
+			for(y=0;y<TileH;y++) for(x=0;x<TileW;x++) {
+				h = TilesData_HashStep(h, TilesData_GetOutPx(TilesData, PxIdx, MaxPalSize, i, TilesData_FlipOffset(x, y, TileW, TileH, Flip)));
+			}
+			h = TilesData_HashFinal(h);
+			if(Flip == 0) h0 = h;
+
+			uint32_t Slot;
+			for(Slot=h&HashMask;Hash[Slot] != -1;Slot=(Slot+1)&HashMask) {
+				int Cand = Hash[Slot];
+				if(UniqueHash[Cand] != h) continue;
+
+				int Same = 1;
+				for(y=0;y<TileH && Same;y++) for(x=0;x<TileW && Same;x++) {
+					Same = TilesData_GetOutPx(TilesData, PxIdx, MaxPalSize, UniqueTile[Cand], y*TileW + x) ==
+					       TilesData_GetOutPx(TilesData, PxIdx, MaxPalSize, i, TilesData_FlipOffset(x, y, TileW, TileH, Flip));
+				}
+				if(Same) {
+					Found = Cand;
+					TileMap[i].Flip = Flip;
+					break;
+				}
+			}
+		}
+		if(Found == -1) {
+			uint32_t Slot = h0 & HashMask;
+			while(Hash[Slot] != -1) Slot = (Slot+1) & HashMask;
+			Hash[Slot] = nUnique;
+			UniqueTile[nUnique] = i;
+			UniqueHash[nUnique] = h0;
+			Found = nUnique++;
+			TileMap[i].Flip = 0;
+		}
+		TileMap[i].TileIdx = Found;
+		TileMap[i].PalIdx  = TilesData->TilePalIdx[i];
+	}
+	Arena_Free(TilesData->Arena, Buffer);
+	return nUnique;
+}
+
 /**************************************/
 //! EOF
 /**************************************/
@@ -5,50 +5,197 @@
 /**************************************/
 #include "Bitmap.h"
 #include "Colourspace.h"
+#include "Quantize.h"
+#include "Stats.h"
 /**************************************/
 
+//! Tile pixel storage modes
+//!  TILESDATA_STORAGE_FLOAT stores tile pixels as YUVA floats (16 bytes/pixel).
+//!  TILESDATA_STORAGE_BGRA8 stores tile pixels as the range-reduced BGRA values
+//!  from the first dithering pass (4 bytes/pixel), and converts them to YUVA
+//!  when needed. This is lossless, and gives the same results as
+//!  TILESDATA_STORAGE_FLOAT; only the palette being clustered is widened
+//!  at once (or, with QuantCluster_Params_t::Histogram, only its colours).
+//!  TILESDATA_STORAGE_STREAM keeps no tile pixels at all; these are instead
+//!  re-read from the source file (in bands of rows) whenever needed, so that
+//!  only the per-tile values and palette indices are held in memory. The
+//!  pixels of every palette are then always collapsed into a colour histogram,
+//!  so this gives the same results as the other modes with
+//!  QuantCluster_Params_t::Histogram set (and without deduplication),
+//!  whether or not it is set; results differ slightly from those without it.
+#define TILESDATA_STORAGE_FLOAT  0
+#define TILESDATA_STORAGE_BGRA8  1
+#define TILESDATA_STORAGE_STREAM 2
+
+//! Tile flip flags
+//! A tile with flip flags F relative to a reference tile R has
+//! pixel (x,y) equal to pixel (x',y') of R, where x' = W-1-x when
+//! TILE_FLIP_H is set (else x' = x), and likewise for y'.
+#define TILE_FLIP_H 1
+#define TILE_FLIP_V 2
+
+//! Tilemap entry
+struct TileMapEntry_t {
+	int32_t TileIdx; //! Index of unique tile (in order of first appearance)
+	uint8_t Flip;    //! Flip flags (TILE_FLIP_*)
+	uint8_t PalIdx;  //! Palette index
+};
+
 union TilePx_t {
 	struct BGRAf_t *PxBGRAf;
-	struct BGR8_t  *PxBGRA8;
+	struct BGRA8_t *PxBGRA8;
 	uint8_t PxIdx;
 };
 
 struct TilesData_t {
 	int TileW,  TileH;
 	int TilesX, TilesY;
+	int PxStorage;              //! Tile pixel storage mode (TILESDATA_STORAGE_*)
+	struct BGRA8_t  BitRange;   //! Bit range (for widening TILESDATA_STORAGE_BGRA8 pixels)
 	union TilePx_t *TilePxPtr;  //! Tile pixel pointers
 	struct BGRAf_t *TileValue;  //! Tile values (for quantization comparisons)
-	struct BGRAf_t *PxData;     //! Tile pixel data           (ImageW*ImageH elements)
-	struct BGRAf_t *PxTemp;     //! Temporary processing data (ImageW*ImageH elements)
+	struct BGRAf_t *PxData;     //! Tile pixel data           (ImageW*ImageH elements; tiles may be reordered, see TilePxPtr)
+	struct BGRA8_t *PxDataBGRA8;//! Tile pixel data, TILESDATA_STORAGE_BGRA8 (PxData is NULL in this mode, and vice-versa)
+	struct BGRAf_t *PxTemp;     //! Temporary processing data (TileH*ImageW elements, at least)
 	int32_t        *PxTempIdx;  //! Temporary processing data (palette entry indices)
 	int32_t        *TilePalIdx; //! Tile palette indices
+	int32_t        *TileRef;    //! Duplicate tiles: Index of the tile this is a duplicate of (else own index)
+	uint8_t        *TileFlip;   //! Duplicate tiles: Flip flags relative to TileRef (TILE_FLIP_*)
+	int32_t        *TileCount;  //! Unique tiles: Number of tiles that are copies of this one (including itself; 0 for duplicates)
+	int             nUniqueTiles;
+	struct BmpStream_t *Stream; //! TILESDATA_STORAGE_STREAM: Source image
+	int             BandTileRows; //! TILESDATA_STORAGE_STREAM: Rows of tiles per band
+	int             DitherType;   //! TILESDATA_STORAGE_STREAM: First-pass dither mode
+	float           DitherLevel;  //! TILESDATA_STORAGE_STREAM: First-pass dither level
+	struct ThreadPool_t *Pool;    //! Worker threads for first-pass dithering (NULL = calling thread only)
+	struct Stats_t *Stats;        //! Statistics (NULL = not collected)
+	struct Arena_t *Arena;        //! Scratch memory (NULL = use malloc())
 };
 
 /**************************************/
 
 //! Convert bitmap to tiles
-//! NOTE: To destroy, call free() on the returned pointer
+//! NOTE: To destroy, call free() on the returned pointer; when Arena is
+//! not NULL, the tiles are instead allocated from it (as is all scratch
+//! memory of later processing), and are released by Arena_Reset().
+//! NOTE: When DedupTiles is not zero, tiles that are exact (or flipped)
+//! copies of an earlier tile, both in the source image and after the
+//! first dithering pass, are marked as duplicates. These are then
+//! clustered only once (with a weight), always share the palette of
+//! the tile they are a copy of, and are remapped only once by
+//! Qualetize() when not dithering.
+//! NOTE: When Stats is not NULL, the time and work of every stage
+//! (from here on, up to the final remapping) is added to it.
+//! NOTE: When Pool is not NULL, Floyd-Steinberg first-pass dithering
+//! is processed as a wavefront over its threads (with identical output).
 struct TilesData_t *TilesData_FromBitmap(
 	const struct BmpCtx_t *Ctx,
 	int TileW,
 	int TileH,
 	const struct BGRA8_t *BitRange,
 	int   DitherType,
-	float DitherLevel
+	float DitherLevel,
+	int   PxStorage,
+	int   DedupTiles,
+	struct ThreadPool_t *Pool,
+	struct Stats_t *Stats,
+	struct Arena_t *Arena
+);
+
+//! Prepare tiles from a streamed image (TILESDATA_STORAGE_STREAM)
+//! The image is read BandTileRows rows of tiles at a time (0 = 1 row),
+//! and only the tile values are kept; Stream must remain open until the
+//! palettes have been quantized and the image has been processed (see
+//! QualetizeStream()).
+//! NOTE: To destroy, call free() on the returned pointer
+//! NOTE: The image must be a multiple of the tile size.
+//! NOTE: Pool is used for first-pass dithering of each band (as in
+//! TilesData_FromBitmap()), and must remain valid until TilesData is
+//! destroyed, as the image is dithered again when it is read back.
+struct TilesData_t *TilesData_FromStream(
+	struct BmpStream_t *Stream,
+	int TileW,
+	int TileH,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	int   BandTileRows,
+	struct ThreadPool_t *Pool,
+	struct Stats_t *Stats
 );
 
 //! Create quantized palette
 //! NOTE: PalUnusedEntries is used for 'padding', such as on
 //! the GBA/NDS where index 0 of every palette is transparent
 //! NOTE: Palette is generated in YUVA mode
+//! NOTE: Palette i is stored at Palette[i*MaxPalSize]; slots of
+//! palettes that no tiles were assigned to are left untouched.
+//! NOTE: Passing nPasses=0 in the clustering parameters
+//! will use the default number of passes.
 int TilesData_QuantizePalettes(
 	struct TilesData_t *TilesData,
 	struct BGRAf_t *Palette,
 	int MaxTilePals,
 	int MaxPalSize,
 	int PalUnusedEntries,
-	int nTileClusterPasses,
-	int nColourClusterPasses
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams
+);
+
+//! Create quantized palettes shared by several images
+//! The tiles of all images are clustered together (in image order) into
+//! the same MaxTilePals palettes, whose colours are then clustered from
+//! the pixels of every image, so that each image can be processed (see
+//! QualetizeShared()) with the same set of palettes. This gives the same
+//! palettes as a single image built by stacking the images, but needs no
+//! such image, and the images may have different sizes.
+//! Returns 0 on failure (out of memory, or images that don't match).
+//! NOTE: All images must have the same tile size, bit range and storage
+//! mode. TILESDATA_STORAGE_STREAM images can only be processed on their own.
+//! NOTE: Scratch memory and statistics are taken from TilesData[0].
+int TilesData_QuantizeSharedPalettes(
+	struct TilesData_t *const *TilesData,
+	int nImages,
+	struct BGRAf_t *Palette,
+	int MaxTilePals,
+	int MaxPalSize,
+	int PalUnusedEntries,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams
+);
+
+//! Assign given palettes to tiles
+//! Every tile is given the palette that remaps its pixels (after the
+//! first dithering pass) with the least error, matching the same palette
+//! entries as DitherImage() does, so no clustering is needed at all.
+//! Alternatively, TilePalIdx[] (when not NULL) gives the palette of every
+//! tile directly.
+//! Returns 0 on failure (out of memory, or palette indices out of range).
+//! NOTE: Palette i is read from Palette[i*MaxPalSize], as final colours
+//! (ie. range-reduced BGRA, as passed to DitherImage()).
+//! NOTE: TILESDATA_STORAGE_STREAM images keep no tile pixels, and are
+//! not supported.
+int TilesData_AssignPalettes(
+	struct TilesData_t *TilesData,
+	const struct BGRAf_t *Palette,
+	int MaxTilePals,
+	int MaxPalSize,
+	int PalUnusedEntries,
+	const int32_t *TilePalIdx,
+	struct ThreadPool_t *Pool
+);
+
+//! Build tilemap from output image
+//! Tiles are compared by their palette-relative indices (ie. PxIdx modulo
+//! MaxPalSize), allowing for flips, so that tiles using different palettes
+//! can still share the same tile data.
+//! Returns the number of unique tiles (or -1 on failure; out of memory).
+//! NOTE: The first appearance of every unique tile is never flipped.
+int TilesData_BuildTileMap(
+	const struct TilesData_t *TilesData,
+	const uint8_t *PxIdx,
+	int MaxPalSize,
+	struct TileMapEntry_t *TileMap
 );
 
 /**************************************/
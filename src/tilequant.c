@@ -1,18 +1,43 @@
 /**************************************/
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+# include <glob.h>
+#endif
 /**************************************/
+#include "Arena.h"
 #include "Bitmap.h"
 #include "Colourspace.h"
+#include "GbaOutput.h"
 #include "Qualetize.h"
+#include "Stats.h"
+#include "Threads.h"
 #include "Tiles.h"
 /**************************************/
 
 //! When not zero, the PSNR for each channel will be displayed
 #define MEASURE_PSNR 1
 
+//! When not zero, the peak memory usage will be displayed
+//! NOTE: Only available on POSIX systems.
+#if defined(__unix__) || defined(__APPLE__)
+# define MEASURE_PEAK_MEMORY 1
+#else
+# define MEASURE_PEAK_MEMORY 0
+#endif
+
+//! When not zero, wildcards in input names are expanded (for
+//! patterns that the shell left alone, eg. when quoted)
+//! NOTE: Only available on POSIX systems.
+#if defined(__unix__) || defined(__APPLE__)
+# define EXPAND_WILDCARDS 1
+#else
+# define EXPAND_WILDCARDS 0
+#endif
+
 /**************************************/
 
 //! strcmp() implementation that ACTUALLY returns the difference between
@@ -22,6 +47,782 @@ static int mystrcmp(const char *s1, const char *s2) {
 	return *s1 - *s2;
 }
 
+//! Parse clustering passes argument: "nPasses[,StopChangeRatio[,StopDistortionDrop]]"
+static void ParseClusterPasses(const char *s, int *nPasses, float *StopChangeRatio, float *StopDistortionDrop) {
+	char *End;
+	*nPasses = strtol(s, &End, 10);
+	if(*End == ',') {
+		*StopChangeRatio = strtof(End+1, &End);
+		if(*End == ',') *StopDistortionDrop = strtof(End+1, &End);
+	}
+}
+
+//! Stream for messages (NULL = stdout)
+//! NOTE: This is stderr with -stats:json, so that stdout only holds the JSON.
+static FILE *MessageStream = NULL;
+
+//! Print a message, prefixed with the name of the image when given
+//! NOTE: The message is printed with a single call, so that messages
+//! from concurrent jobs don't get mixed up.
+static void Report(const char *Name, const char *Format, ...) {
+	char Msg[1024];
+	va_list Args;
+	va_start(Args, Format);
+	vsnprintf(Msg, sizeof(Msg), Format, Args);
+	va_end(Args);
+	FILE *Out = MessageStream ? MessageStream : stdout;
+	if(Name) fprintf(Out, "%s: %s\n", Name, Msg);
+	else     fprintf(Out, "%s\n", Msg);
+}
+
+//! Print PSNR
+static void PrintPSNR(const char *Name, struct BGRAf_t RMSE) {
+#if MEASURE_PSNR
+	RMSE.b = -8.68588963f*logf(RMSE.b / 255.0f); //! -20*Log10[RMSE/255] == -20/Log[10] * Log[RMSE/255]
+	RMSE.g = -8.68588963f*logf(RMSE.g / 255.0f);
+	RMSE.r = -8.68588963f*logf(RMSE.r / 255.0f);
+	RMSE.a = -8.68588963f*logf(RMSE.a / 255.0f);
+	Report(Name, "PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}", RMSE.b, RMSE.g, RMSE.r, RMSE.a);
+#else
+	(void)Name;
+	(void)RMSE;
+#endif
+}
+
+//! Print peak memory usage
+static void PrintPeakMemory(void) {
+#if MEASURE_PEAK_MEMORY
+	Report(NULL, "Peak memory = %.1fMiB", Stats_GetPeakMemory());
+#endif
+}
+
+//! Print per-stage statistics, as a table or as JSON
+static void PrintStageStats(const struct Stats_t *Stats, int Json) {
+	int i;
+	if(Json) {
+		printf("{\"peak_growth_source\":\"process_rss\",\"stages\":[");
+		for(i=0;i<STATS_STAGE_COUNT;i++) {
+			const struct Stats_Stage_t *x = &Stats->Stage[i];
+			printf(
+				"%s{\"name\":\"%s\",\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"peak_growth_mib\":%.1f,\"items\":%llu,\"passes\":%llu,\"distances\":%llu}",
+				i ? "," : "",
+				Stats_GetStageName(i),
+				x->WallTime*1000.0,
+				x->CPUTime*1000.0,
+				x->PeakGrowth,
+				(unsigned long long)x->nItems,
+				(unsigned long long)x->nPasses,
+				(unsigned long long)x->nDistances
+			);
+		}
+		printf("]}\n");
+	} else {
+		printf("%-14s %10s %10s %10s %12s %8s %14s\n", "Stage", "Wall[ms]", "CPU[ms]", "+Peak[MiB]", "Items", "Passes", "Distances");
+		for(i=0;i<STATS_STAGE_COUNT;i++) {
+			const struct Stats_Stage_t *x = &Stats->Stage[i];
+			printf(
+				"%-14s %10.3f %10.3f %10.1f %12llu %8llu %14llu\n",
+				Stats_GetStageName(i),
+				x->WallTime*1000.0,
+				x->CPUTime*1000.0,
+				x->PeakGrowth,
+				(unsigned long long)x->nItems,
+				(unsigned long long)x->nPasses,
+				(unsigned long long)x->nDistances
+			);
+		}
+		printf("+Peak: rise in the peak memory of the whole process during the stage\n");
+		printf("       (0 below an earlier peak; includes any concurrent images, summed over images)\n");
+	}
+}
+
+/**************************************/
+
+//! Processing options (shared by every image)
+struct Options_t {
+	int   nPalettes;
+	int   nColoursPerPalette;
+	int   nUnusedColoursPerPalette;
+	int   TileW, TileH;
+	struct BGRA8_t BitRange;
+	int   DitherMode;
+	float DitherLevel;
+	int   PxStorage;
+	int   DedupTiles;
+	int   CharDepth;
+	int   PalStride;
+	int   StreamTileRows;
+	const struct BGRA8_t *SrcPalette; //! Given palettes (NULL = quantize palettes)
+	struct QuantCluster_Params_t TileClusterParams;   //! Pool and Arena are set for each image
+	struct QuantCluster_Params_t ColourClusterParams;
+};
+
+//! Files of an image (NULL for outputs not wanted)
+struct ImageFiles_t {
+	const char *Input;
+	const char *Output;
+	const char *TileMap;
+	const char *Chars;
+	const char *Palette;
+	const char *TilePals; //! Input tilemap giving the palette of every tile (NULL = pick the best palette)
+};
+
+//! Write the outputs of a processed image
+//! Returns 0 if the output image could not be written.
+//! NOTE: 8bpp characters use absolute palette indices, so tiles
+//! are only merged when these match, rather than palette-relative
+//! indices.
+//! NOTE: The image is vertically inverted (see BmpCtx_FromFile()).
+static int WriteImage(
+	const struct Options_t *Opt,
+	const struct ImageFiles_t *Files,
+	const struct BmpCtx_t *Image,
+	const struct TilesData_t *TilesData,
+	struct Arena_t *Arena,
+	struct Stats_t *Stats,
+	const char *Name
+) {
+	//! Output tilemap, tile characters and palette
+	struct Stats_Timer_t Timer = Stats_Begin(Stats);
+	if(Files->TileMap || Files->Chars) {
+		int nTiles = TilesData->TilesX * TilesData->TilesY;
+		int MapPalSize = (Files->Chars && Opt->CharDepth == GBAOUTPUT_CHARS_8BPP) ? BMP_PALETTE_COLOURS : Opt->nColoursPerPalette;
+		struct TileMapEntry_t *TileMap = Arena_Alloc(Arena, nTiles * sizeof(struct TileMapEntry_t));
+		int nUniqueTiles = TileMap ? TilesData_BuildTileMap(TilesData, Image->PxIdx, MapPalSize, TileMap) : -1;
+		if(nUniqueTiles < 0) Report(Name, "Out of memory; tilemap not written");
+		else {
+			Report(Name, "Unique tiles = %d (of %d)", nUniqueTiles, nTiles);
+			if(Files->TileMap) {
+				int nOverflow;
+				if(!GbaOutput_WriteTileMap(Files->TileMap, TilesData, TileMap, 1, &nOverflow)) Report(Name, "Unable to write tilemap file");
+				else if(nOverflow) Report(Name, "WARNING: Tilemap has tile or palette indices out of range");
+			}
+			if(Files->Chars && !GbaOutput_WriteChars(Files->Chars, TilesData, Image->PxIdx, TileMap, nUniqueTiles, Opt->nColoursPerPalette, Opt->CharDepth, 1)) {
+				Report(Name, "Unable to write characters file");
+			}
+		}
+		Arena_Free(Arena, TileMap);
+	}
+	if(Files->Palette && !GbaOutput_WritePalette(Files->Palette, Image->ColPal, Opt->nPalettes, Opt->nColoursPerPalette, Opt->PalStride, &Opt->BitRange)) {
+		Report(Name, "Unable to write palette file");
+	}
+	Stats_End(Stats, STATS_STAGE_WRITE, &Timer, 0);
+
+	//! Output image
+	Timer = Stats_Begin(Stats);
+	if(!BmpCtx_ToFile(Image, Files->Output)) {
+		Report(Name, "Unable to write output file");
+		return 0;
+	}
+	Stats_End(Stats, STATS_STAGE_WRITE, &Timer, (uint64_t)Image->Width*Image->Height);
+	return 1;
+}
+
+//! Process a streamed image
+static int ProcessStream(
+	const struct Options_t *Opt,
+	const struct ImageFiles_t *Files,
+	const struct QuantCluster_Params_t *TileClusterParams,
+	const struct QuantCluster_Params_t *ColourClusterParams,
+	struct Stats_t *Stats,
+	struct BGRAf_t *RMSE,
+	const char *Name
+) {
+	int Ok = 0;
+	struct BmpStream_t Stream;
+	struct BGRAf_t Palette[BMP_PALETTE_COLOURS] = {{0,0,0,0}};
+	if(Files->TileMap || Files->Chars) Report(Name, "Tilemap and character output is not available when streaming");
+	if(!BmpStream_Open(&Stream, Files->Input)) {
+		Report(Name, "Unable to read input file");
+		return 0;
+	}
+	if(Stream.Width%Opt->TileW || Stream.Height%Opt->TileH) {
+		Report(Name, "Image not a multiple of tile size (%dx%d)", Opt->TileW, Opt->TileH);
+	} else {
+		struct TilesData_t *TilesData = TilesData_FromStream(&Stream, Opt->TileW, Opt->TileH, &Opt->BitRange, Opt->DitherMode, Opt->DitherLevel, Opt->StreamTileRows, TileClusterParams->Pool, Stats);
+		Ok = TilesData && QualetizeStream(
+			TilesData,
+			Files->Output,
+			Palette,
+			Opt->nPalettes,
+			Opt->nColoursPerPalette,
+			Opt->nUnusedColoursPerPalette,
+			TileClusterParams,
+			ColourClusterParams,
+			&Opt->BitRange,
+			Opt->DitherMode,
+			Opt->DitherLevel,
+			RMSE
+		);
+		if(!Ok) Report(Name, "Unable to process image (out of memory, or read/write error)");
+		free(TilesData);
+	}
+	BmpStream_Close(&Stream);
+	if(Ok && Files->Palette) {
+		struct Stats_Timer_t Timer = Stats_Begin(Stats);
+		if(!GbaOutput_WritePalette(Files->Palette, (const struct BGRA8_t*)Palette, Opt->nPalettes, Opt->nColoursPerPalette, Opt->PalStride, &Opt->BitRange)) {
+			Report(Name, "Unable to write palette file");
+		}
+		Stats_End(Stats, STATS_STAGE_WRITE, &Timer, 0);
+	}
+	return Ok;
+}
+
+//! Process an image, using the given threads and scratch memory
+//! (either of which may be NULL)
+//! Returns 0 on failure, else 1, and stores the RMS error to RMSE.
+//! NOTE: Messages are prefixed with Name, unless this is NULL.
+static int ProcessImage(
+	const struct Options_t *Opt,
+	const struct ImageFiles_t *Files,
+	struct ThreadPool_t *Pool,
+	struct Arena_t *Arena,
+	struct Stats_t *Stats,
+	struct BGRAf_t *RMSE,
+	const char *Name
+) {
+	struct QuantCluster_Params_t TileClusterParams   = Opt->TileClusterParams;
+	struct QuantCluster_Params_t ColourClusterParams = Opt->ColourClusterParams;
+	TileClusterParams.Pool  = ColourClusterParams.Pool  = Pool;
+	TileClusterParams.Arena = ColourClusterParams.Arena = Arena;
+
+	//! Process streamed image
+	//! NOTE: This reads the image in bands and writes the output as it is
+	//! produced, so the tilemap and tile characters (which need the whole
+	//! output) are unavailable.
+	if(Opt->StreamTileRows > 0 && !Opt->SrcPalette) {
+		return ProcessStream(Opt, Files, &TileClusterParams, &ColourClusterParams, Stats, RMSE, Name);
+	}
+
+	//! Get input image
+	struct BmpCtx_t Image;
+	struct Stats_Timer_t Timer = Stats_Begin(Stats);
+	if(!BmpCtx_FromFile(&Image, Files->Input)) {
+		Report(Name, "Unable to read input file");
+		return 0;
+	}
+	Stats_End(Stats, STATS_STAGE_LOAD, &Timer, (uint64_t)Image.Width*Image.Height);
+	if(Image.Width%Opt->TileW || Image.Height%Opt->TileH) {
+		Report(Name, "Image not a multiple of tile size (%dx%d)", Opt->TileW, Opt->TileH);
+		BmpCtx_Destroy(&Image);
+		return 0;
+	}
+
+	//! Perform processing
+	//! NOTE: PxData and Palette will be assigned to image; do NOT destroy
+	struct TilesData_t  *TilesData = TilesData_FromBitmap(&Image, Opt->TileW, Opt->TileH, &Opt->BitRange, Opt->DitherMode, Opt->DitherLevel, Opt->PxStorage, Opt->DedupTiles, Pool, Stats, Arena);
+	       uint8_t      *PxData    = malloc(Image.Width * Image.Height * sizeof(uint8_t));
+	struct BGRAf_t      *Palette   = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRAf_t));
+	if(!TilesData || !PxData || !Palette) {
+		Report(Name, "Out of memory; image not processed");
+		free(Palette);
+		free(PxData);
+		Arena_Free(Arena, TilesData);
+		BmpCtx_Destroy(&Image);
+		return 0;
+	}
+	if(Opt->SrcPalette) {
+		//! Remap to the given palettes, without any clustering
+		int32_t *TilePalIdx = NULL;
+		int Ok = 1;
+		if(Files->TilePals) {
+			TilePalIdx = Arena_Alloc(Arena, TilesData->TilesX*TilesData->TilesY * sizeof(int32_t));
+			Ok = TilePalIdx && GbaOutput_ReadTileMapPalettes(Files->TilePals, TilesData, TilePalIdx, 1);
+			if(!Ok) Report(Name, "Unable to read tilemap file");
+		}
+		if(Ok && !QualetizeWithPalettes(
+			&Image,
+			TilesData,
+			PxData,
+			Palette,
+			Opt->SrcPalette,
+			TilePalIdx,
+			Opt->nPalettes,
+			Opt->nColoursPerPalette,
+			Opt->nUnusedColoursPerPalette,
+			&Opt->BitRange,
+			Opt->DitherMode,
+			Opt->DitherLevel,
+			1,
+			Pool,
+			RMSE
+		)) {
+			Report(Name, "Unable to remap image (out of memory, or palette indices out of range)");
+			Ok = 0;
+		}
+		Arena_Free(Arena, TilePalIdx);
+		if(!Ok) {
+			free(Palette);
+			free(PxData);
+			Arena_Free(Arena, TilesData);
+			BmpCtx_Destroy(&Image);
+			return 0;
+		}
+	} else {
+		*RMSE = Qualetize(
+			&Image,
+			TilesData,
+			PxData,
+			Palette,
+			Opt->nPalettes,
+			Opt->nColoursPerPalette,
+			Opt->nUnusedColoursPerPalette,
+			&TileClusterParams,
+			&ColourClusterParams,
+			&Opt->BitRange,
+			Opt->DitherMode,
+			Opt->DitherLevel,
+			1
+		);
+	}
+
+	//! Write outputs
+	int Ok = WriteImage(Opt, Files, &Image, TilesData, Arena, Stats, Name);
+	Arena_Free(Arena, TilesData);
+	BmpCtx_Destroy(&Image);
+	return Ok;
+}
+
+/**************************************/
+
+//! List of input files
+struct InputList_t {
+	char **Names;
+	int    n;
+	int    Capacity;
+};
+
+//! Copy a string
+static char *CopyString(const char *s, size_t Len) {
+	char *x = malloc(Len + 1);
+	if(!x) return NULL;
+	memcpy(x, s, Len);
+	x[Len] = '\0';
+	return x;
+}
+
+//! Add a file to the list
+static int InputList_AddFile(struct InputList_t *List, const char *Name) {
+	if(List->n == List->Capacity) {
+		int Capacity = List->Capacity ? List->Capacity*2 : 64;
+		char **Names = realloc(List->Names, Capacity * sizeof(char*));
+		if(!Names) return 0;
+		List->Names    = Names;
+		List->Capacity = Capacity;
+	}
+	if((List->Names[List->n] = CopyString(Name, strlen(Name))) == NULL) return 0;
+	List->n++;
+	return 1;
+}
+
+//! Add files matching a name (expanding any wildcards)
+static int InputList_AddMatches(struct InputList_t *List, const char *Pattern) {
+#if EXPAND_WILDCARDS
+	if(strpbrk(Pattern, "*?[")) {
+		size_t i;
+		glob_t Matches;
+		if(glob(Pattern, 0, NULL, &Matches) != 0) {
+			Report(NULL, "No files match %s", Pattern);
+			return 1;
+		}
+		int Ok = 1;
+		for(i=0;i<Matches.gl_pathc && Ok;i++) Ok = InputList_AddFile(List, Matches.gl_pathv[i]);
+		globfree(&Matches);
+		return Ok;
+	}
+#endif
+	return InputList_AddFile(List, Pattern);
+}
+
+//! Add input files from an argument
+//! "@List.txt" adds the files named in List.txt (one per line).
+static int InputList_Add(struct InputList_t *List, const char *Arg) {
+	if(*Arg != '@') return InputList_AddMatches(List, Arg);
+	char Line[4096];
+	FILE *File = fopen(Arg+1, "r");
+	if(!File) {
+		Report(NULL, "Unable to read file list %s", Arg+1);
+		return 1;
+	}
+	int Ok = 1;
+	while(Ok && fgets(Line, sizeof(Line), File)) {
+		size_t Len = strlen(Line);
+		while(Len && (Line[Len-1] == '\n' || Line[Len-1] == '\r')) Line[--Len] = '\0';
+		if(Len) Ok = InputList_AddMatches(List, Line);
+	}
+	fclose(File);
+	return Ok;
+}
+
+//! Destroy list
+static void InputList_Destroy(struct InputList_t *List) {
+	int i;
+	for(i=0;i<List->n;i++) free(List->Names[i]);
+	free(List->Names);
+}
+
+//! Build an output name in OutDir from the input name
+//! When Ext is given, this replaces the extension of the input name.
+static char *MakeOutputName(const char *OutDir, const char *Input, const char *Ext) {
+	const char *Base = Input, *s;
+	for(s=Input;*s;s++) if(*s == '/' || *s == '\\') Base = s+1;
+	size_t BaseLen = strlen(Base);
+	if(Ext) {
+		const char *Dot = strrchr(Base, '.');
+		if(Dot) BaseLen = Dot - Base;
+	}
+	size_t DirLen = strlen(OutDir);
+	size_t ExtLen = Ext ? strlen(Ext) : 0;
+	char *Name = malloc(DirLen + 1 + BaseLen + ExtLen + 1);
+	if(!Name) return NULL;
+	char *d = Name;
+	memcpy(d, OutDir, DirLen), d += DirLen;
+	if(DirLen && OutDir[DirLen-1] != '/' && OutDir[DirLen-1] != '\\') *d++ = '/';
+	memcpy(d, Base, BaseLen), d += BaseLen;
+	if(Ext) memcpy(d, Ext, ExtLen), d += ExtLen;
+	*d = '\0';
+	return Name;
+}
+
+//! Build the name of a file next to the input, replacing its extension with Ext
+static char *MakeInputName(const char *Input, const char *Ext) {
+	const char *Base = Input, *s;
+	for(s=Input;*s;s++) if(*s == '/' || *s == '\\') Base = s+1;
+	const char *Dot = strrchr(Base, '.');
+	size_t Len    = Dot ? (size_t)(Dot - Input) : strlen(Input);
+	size_t ExtLen = strlen(Ext);
+	char *Name = malloc(Len + ExtLen + 1);
+	if(!Name) return NULL;
+	memcpy(Name, Input, Len);
+	memcpy(Name + Len, Ext, ExtLen + 1);
+	return Name;
+}
+
+//! Set the files of an image in a batch
+//! Returns 0 on failure (out of memory).
+static int MakeImageFiles(
+	struct ImageFiles_t *Files,
+	const char *Input,
+	const char *OutDir,
+	const char *TileMapExt,
+	const char *CharsExt,
+	const char *PaletteExt,
+	const char *TilePalsExt
+) {
+	Files->Input    = Input;
+	Files->Output   = MakeOutputName(OutDir, Input, NULL);
+	Files->TileMap  = TileMapExt  ? MakeOutputName(OutDir, Input, TileMapExt) : NULL;
+	Files->Chars    = CharsExt    ? MakeOutputName(OutDir, Input, CharsExt)   : NULL;
+	Files->Palette  = PaletteExt  ? MakeOutputName(OutDir, Input, PaletteExt) : NULL;
+	Files->TilePals = TilePalsExt ? MakeInputName(Input, TilePalsExt)         : NULL;
+	return Files->Output && (Files->TileMap || !TileMapExt) && (Files->Chars || !CharsExt) && (Files->Palette || !PaletteExt) && (Files->TilePals || !TilePalsExt);
+}
+
+//! Destroy the files of an image in a batch
+static void DestroyImageFiles(struct ImageFiles_t *Files) {
+	free((char*)Files->Output);
+	free((char*)Files->TileMap);
+	free((char*)Files->Chars);
+	free((char*)Files->Palette);
+	free((char*)Files->TilePals);
+}
+
+//! Output file of an image in a batch (for CheckOutputNames())
+struct OutputName_t {
+	const char *Name;
+	const char *Input;
+};
+
+//! Compare output files by name
+static int OutputName_Compare(const void *a, const void *b) {
+	const struct OutputName_t *x = a, *y = b;
+	return strcmp(x->Name, y->Name);
+}
+
+//! Check that no two outputs of a batch have the same name
+//! This happens with inputs of the same name from different directories
+//! (eg. a/x.bmp and b/x.bmp both write Dir/x.bmp), or with files that
+//! only differ by extension (eg. x.bmp and x.png both write Dir/x.bin).
+//! Returns 0 (having reported the clash) when they do, or on failure.
+static int CheckOutputNames(const struct ImageFiles_t *Files, int nImages) {
+	int i, n = 0, Ok = 1;
+	struct OutputName_t *Names = malloc(nImages * 4 * sizeof(struct OutputName_t));
+	if(!Names) {
+		Report(NULL, "Out of memory; images not processed");
+		return 0;
+	}
+	for(i=0;i<nImages;i++) {
+		const char *x[4] = {Files[i].Output, Files[i].TileMap, Files[i].Chars, Files[i].Palette};
+		int k;
+		for(k=0;k<4;k++) if(x[k]) Names[n++] = (struct OutputName_t){x[k], Files[i].Input};
+	}
+	qsort(Names, n, sizeof(struct OutputName_t), OutputName_Compare);
+	for(i=1;i<n;i++) if(!strcmp(Names[i].Name, Names[i-1].Name)) {
+		Report(NULL, "%s would be written by both %s and %s", Names[i].Name, Names[i-1].Input, Names[i].Input);
+		Ok = 0;
+	}
+	if(!Ok) Report(NULL, "Output names must be unique; images not processed");
+	free(Names);
+	return Ok;
+}
+
+/**************************************/
+
+//! Batch job worker (one per job thread)
+struct BatchWorker_t {
+	struct ThreadPool_t *Pool;
+	struct Arena_t      *Arena;
+};
+
+//! Batch job
+struct Batch_t {
+	const struct Options_t *Opt;
+	int    nImages;
+	int    nWorkers;
+	struct ImageFiles_t  *Files;   //! [nImages]
+	struct BatchWorker_t *Workers; //! [nWorkers]
+	struct Stats_t       *Stats;   //! [nImages], or NULL
+	struct BGRAf_t       *RMSE;    //! [nImages]
+	int                  *Ok;      //! [nImages]
+};
+
+//! Process one image of a batch
+//! NOTE: Images are handed out to whichever job thread is idle, so a
+//! thread that gets a small image just moves on to the next one. The
+//! image that this thread will likely take next is prefetched, so that
+//! it is read from disk while this one is being processed.
+static void BatchTask(void *Arg, int TaskIdx, int ThreadIdx) {
+	struct Batch_t *Batch = Arg;
+	struct BatchWorker_t *Worker = &Batch->Workers[ThreadIdx];
+	int Next = TaskIdx + Batch->nWorkers;
+	if(Next < Batch->nImages) BmpCtx_Prefetch(Batch->Files[Next].Input);
+	struct Stats_t *Stats = Batch->Stats ? &Batch->Stats[TaskIdx] : NULL;
+	Stats_Init(Stats);
+	Batch->Ok[TaskIdx] = ProcessImage(
+		Batch->Opt,
+		&Batch->Files[TaskIdx],
+		Worker->Pool,
+		Worker->Arena,
+		Stats,
+		&Batch->RMSE[TaskIdx],
+		Batch->Files[TaskIdx].Input
+	);
+	Arena_Reset(Worker->Arena);
+}
+
+//! Process a batch of images
+//! Returns the number of images processed successfully, or -1 on failure.
+static int ProcessBatch(
+	const struct Options_t *Opt,
+	const struct InputList_t *Inputs,
+	const char *OutDir,
+	const char *TileMapExt,
+	const char *CharsExt,
+	const char *PaletteExt,
+	const char *TilePalsExt,
+	int nJobs,
+	int nThreads,
+	struct Stats_t *Stats
+) {
+	int i, nOk = -1;
+	int nImages = Inputs->n;
+
+	//! Create job threads
+	//! NOTE: Each job processes its image on a single thread unless
+	//! more are explicitly requested, as the jobs already use every CPU.
+	struct ThreadPool_t *JobPool = ThreadPool_Create(nJobs);
+	int nWorkers = ThreadPool_GetThreadCount(JobPool);
+
+	//! Allocate state
+	struct Batch_t Batch = {
+		.Opt      = Opt,
+		.nImages  = nImages,
+		.nWorkers = nWorkers,
+		.Files    = calloc(nImages, sizeof(struct ImageFiles_t)),
+		.Workers  = calloc(nWorkers, sizeof(struct BatchWorker_t)),
+		.Stats    = Stats ? calloc(nImages, sizeof(struct Stats_t)) : NULL,
+		.RMSE     = calloc(nImages, sizeof(struct BGRAf_t)),
+		.Ok       = calloc(nImages, sizeof(int)),
+	};
+	int Ok = Batch.Files && Batch.Workers && (Batch.Stats || !Stats) && Batch.RMSE && Batch.Ok;
+	for(i=0;i<nImages && Ok;i++) {
+		Ok = MakeImageFiles(&Batch.Files[i], Inputs->Names[i], OutDir, TileMapExt, CharsExt, PaletteExt, TilePalsExt);
+	}
+	if(!Ok) Report(NULL, "Out of memory; images not processed");
+	else    Ok = CheckOutputNames(Batch.Files, nImages);
+
+	//! Create per-job threads and scratch memory, and run
+	//! NOTE: If a pool or arena can't be created, that job just runs
+	//! single-threaded, or allocates as needed.
+	if(Ok) {
+		for(i=0;i<nWorkers;i++) {
+			Batch.Workers[i].Pool  = (nThreads > 1) ? ThreadPool_Create(nThreads) : NULL;
+			Batch.Workers[i].Arena = Arena_Create(0);
+		}
+		ThreadPool_Run(JobPool, BatchTask, &Batch, nImages);
+		for(i=0,nOk=0;i<nImages;i++) {
+			if(Batch.Ok[i]) {
+				PrintPSNR(Batch.Files[i].Input, Batch.RMSE[i]);
+				nOk++;
+			}
+			if(Stats) Stats_Merge(Stats, &Batch.Stats[i]);
+		}
+		for(i=0;i<nWorkers;i++) {
+			ThreadPool_Destroy(Batch.Workers[i].Pool);
+			Arena_Destroy(Batch.Workers[i].Arena);
+		}
+	}
+
+	//! Clean up
+	if(Batch.Files) for(i=0;i<nImages;i++) DestroyImageFiles(&Batch.Files[i]);
+	free(Batch.Ok);
+	free(Batch.RMSE);
+	free(Batch.Stats);
+	free(Batch.Workers);
+	free(Batch.Files);
+	ThreadPool_Destroy(JobPool);
+	return nOk;
+}
+
+//! Process a batch of images with shared palettes
+//! Every image is loaded and converted to tiles first, so that the
+//! palettes can be quantized over the tiles of all images at once,
+//! and every image is then processed and written in turn.
+//! Returns the number of images processed successfully, or -1 on failure.
+//! NOTE: All images are held in memory until the palettes are done,
+//! so this takes as much memory as one image of the combined size.
+static int ProcessShared(
+	const struct Options_t *Opt,
+	const struct InputList_t *Inputs,
+	const char *OutDir,
+	const char *TileMapExt,
+	const char *CharsExt,
+	const char *PaletteExt,
+	int nThreads,
+	struct Stats_t *Stats
+) {
+	int i, nOk = -1, nLoaded = 0;
+	int nImages = Inputs->n;
+	if(Opt->StreamTileRows > 0) Report(NULL, "Streaming is not available with shared palettes; loading whole images");
+
+	//! Allocate state
+	struct ImageFiles_t  *Files     = calloc(nImages, sizeof(struct ImageFiles_t));
+	struct BmpCtx_t      *Images    = calloc(nImages, sizeof(struct BmpCtx_t));
+	struct BmpCtx_t     **ImagePtr  = calloc(nImages, sizeof(struct BmpCtx_t*));
+	struct TilesData_t  **TilesData = calloc(nImages, sizeof(struct TilesData_t*));
+	       uint8_t      **PxData    = calloc(nImages, sizeof(uint8_t*));
+	struct BGRAf_t       *RMSE      = calloc(nImages, sizeof(struct BGRAf_t));
+	struct BGRAf_t       *Palette   = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRAf_t));
+	struct ThreadPool_t  *Pool      = ThreadPool_Create(nThreads);
+	int Ok = Files && Images && ImagePtr && TilesData && PxData && RMSE && Palette;
+	if(!Ok) Report(NULL, "Out of memory; images not processed");
+	for(i=0;i<nImages && Ok;i++) {
+		Ok = MakeImageFiles(&Files[i], Inputs->Names[i], OutDir, TileMapExt, CharsExt, PaletteExt, NULL);
+		if(!Ok) Report(NULL, "Out of memory; images not processed");
+	}
+	if(Ok) Ok = CheckOutputNames(Files, nImages);
+
+	//! Load all images and convert them to tiles
+	for(i=0;i<nImages && Ok;i++) {
+		const char *Name = Files[i].Input;
+		struct Stats_Timer_t Timer = Stats_Begin(Stats);
+		ImagePtr[i] = &Images[i];
+		if(!BmpCtx_FromFile(&Images[i], Name)) {
+			Report(Name, "Unable to read input file");
+			Ok = 0;
+			break;
+		}
+		nLoaded++;
+		Stats_End(Stats, STATS_STAGE_LOAD, &Timer, (uint64_t)Images[i].Width*Images[i].Height);
+		if(Images[i].Width%Opt->TileW || Images[i].Height%Opt->TileH) {
+			Report(Name, "Image not a multiple of tile size (%dx%d)", Opt->TileW, Opt->TileH);
+			Ok = 0;
+			break;
+		}
+		TilesData[i] = TilesData_FromBitmap(&Images[i], Opt->TileW, Opt->TileH, &Opt->BitRange, Opt->DitherMode, Opt->DitherLevel, Opt->PxStorage, Opt->DedupTiles, Pool, Stats, NULL);
+		PxData[i]    = malloc(Images[i].Width * Images[i].Height * sizeof(uint8_t));
+		if(!TilesData[i] || !PxData[i]) {
+			Report(Name, "Out of memory; image not processed");
+			Ok = 0;
+		}
+	}
+
+	//! Quantize the palettes over all images, and process each image
+	//! NOTE: PxData will be assigned to the images; do NOT destroy
+	if(Ok) {
+		struct QuantCluster_Params_t TileClusterParams   = Opt->TileClusterParams;
+		struct QuantCluster_Params_t ColourClusterParams = Opt->ColourClusterParams;
+		TileClusterParams.Pool = ColourClusterParams.Pool = Pool;
+		Ok = QualetizeShared(
+			ImagePtr,
+			TilesData,
+			PxData,
+			nImages,
+			Palette,
+			Opt->nPalettes,
+			Opt->nColoursPerPalette,
+			Opt->nUnusedColoursPerPalette,
+			&TileClusterParams,
+			&ColourClusterParams,
+			&Opt->BitRange,
+			Opt->DitherMode,
+			Opt->DitherLevel,
+			1,
+			RMSE
+		);
+		if(Ok) {
+			for(i=0;i<nImages;i++) PxData[i] = NULL;
+			for(i=0,nOk=0;i<nImages;i++) {
+				if(WriteImage(Opt, &Files[i], &Images[i], TilesData[i], NULL, Stats, Files[i].Input)) {
+					PrintPSNR(Files[i].Input, RMSE[i]);
+					nOk++;
+				}
+			}
+		} else Report(NULL, "Unable to quantize palettes (out of memory)");
+	}
+
+	//! Clean up
+	for(i=0;i<nImages;i++) {
+		if(PxData)    free(PxData[i]);
+		if(TilesData) free(TilesData[i]);
+		if(Files)     DestroyImageFiles(&Files[i]);
+	}
+	for(i=0;i<nLoaded;i++) BmpCtx_Destroy(&Images[i]);
+	ThreadPool_Destroy(Pool);
+	free(Palette);
+	free(RMSE);
+	free(PxData);
+	free(TilesData);
+	free(ImagePtr);
+	free(Images);
+	free(Files);
+	return nOk;
+}
+
+/**************************************/
+
+//! Load given palettes to Palette[nPalettes*nColoursPerPalette]
+//! A BMP file gives its colour table (eg. an earlier output image), and
+//! any other file is read as a BGR555 palette (as written by -palette:).
+//! Returns 0 on failure.
+static int LoadPalette(const struct Options_t *Opt, const char *Filename, struct BGRA8_t *Palette) {
+	int nColours = Opt->nPalettes * Opt->nColoursPerPalette;
+	uint8_t Magic[2] = {0,0};
+	FILE *File = fopen(Filename, "rb");
+	if(!File) return 0;
+	int IsBmp = (fread(Magic, sizeof(Magic), 1, File) == 1 && Magic[0] == 'B' && Magic[1] == 'M');
+	fclose(File);
+	if(IsBmp) {
+		struct BmpCtx_t Image;
+		if(!BmpCtx_FromFile(&Image, Filename)) return 0;
+		int Ok = (Image.ColPal != NULL && nColours <= BMP_PALETTE_COLOURS);
+		if(Ok) memcpy(Palette, Image.ColPal, nColours * sizeof(struct BGRA8_t));
+		BmpCtx_Destroy(&Image);
+		return Ok;
+	}
+	return GbaOutput_ReadPalette(Filename, Palette, Opt->nPalettes, Opt->nColoursPerPalette, Opt->PalStride, &Opt->BitRange);
+}
+
 /**************************************/
 
 int main(int argc, const char *argv[]) {
@@ -31,6 +832,7 @@ int main(int argc, const char *argv[]) {
 			"tilequant - Tiled colour-quantization tool\n"
 			"Usage:\n"
 			" tilequant Input.bmp Output.bmp [options]\n"
+			" tilequant -outdir:Dir [options] Input.bmp|@List.txt [...]\n"
 			"Options:\n"
 			" -np:16            - Set number of palettes available\n"
 			" -ps:16            - Set number of colours per palette\n"
@@ -40,15 +842,47 @@ int main(int argc, const char *argv[]) {
 			" -dither:floyd,1.0 - Set dither mode, level\n"
 			" -tilepasses:0     - Set tile cluster passes (0 = default)\n"
 			" -colourpasses:0   - Set colour cluster passes (0 = default)\n"
+			"   Passes may be followed by early-termination thresholds:\n"
+			"   -tilepasses:8,0.01,0.001 stops when <1%% of points change\n"
+			"   cluster, or distortion drops by <0.1%%, after a pass\n"
+			" -threads:0        - Set number of worker threads (0 = one per CPU; one per job for -outdir:)\n"
+			" -kmeans:brute     - Set clustering engine\n"
+			" -histogram:0      - Collapse identical colours before clustering (faster, slightly different output)\n"
+			"                     (-dedup:1 and -stream: also cluster weighted colours, and are off by default too)\n"
+			" -batch:0          - Set mini-batch size[,seed] (0 = use all points)\n"
+			" -compact:0        - Store tile pixels compactly (4 bytes/pixel)\n"
+			" -dedup:0          - Process duplicate (and flipped) tiles only once (faster, slightly different output)\n"
+			" -tilemap:file.bin - Write GBA/NDS tilemap (with flipped tiles merged)\n"
+			" -chars:file.bin   - Write GBA/NDS tile characters (unique tiles only)\n"
+			" -bpp:4            - Set tile character depth (4 or 8)\n"
+			" -palette:file.bin - Write GBA/NDS palette (BGR555)\n"
+			" -stream:0         - Process image in bands of N rows of tiles (0 = load whole image)\n"
+			"                     (always collapses identical colours, as -histogram:1)\n"
+			" -usepal:file      - Remap to given palettes, without clustering (BMP colour table, or BGR555 as per -palette:)\n"
+			" -usemap:file.bin  - With -usepal:, take the palette of every tile from a GBA/NDS tilemap\n"
+			" -stats            - Print time, memory and work of each stage\n"
+			"                     (-stats:json: JSON on stdout, all messages on stderr)\n"
+			"                     NOTE: Memory is the rise in the process peak, not what a stage allocated\n"
+			"Several images:\n"
+			" -outdir:Dir       - Process every input, writing outputs to Dir (with the same name; names must be unique)\n"
+			" -j:0              - Set number of images processed at once (0 = one per CPU)\n"
+			" -shared:0         - Quantize all inputs with one set of palettes (processed one at a time)\n"
+			"   Inputs may be wildcards, or @List.txt to read names from a file (one per line).\n"
+			"   -tilemap:, -chars: and -palette: then give the extension of each file (eg. -tilemap:.map),\n"
+			"   and -usemap: that of the tilemap next to each input.\n"
 			"Dither modes available (and default level):\n"
 			" -dither:none       - No dithering\n"
 			" -dither:floyd,1.0  - Floyd-Steinberg\n"
+			" -dither:floydtile,1.0 - Floyd-Steinberg, confined to each tile\n"
 			" -dither:ord2,0.5   - 2x2 ordered dithering\n"
 			" -dither:ord4,0.5   - 4x4 ordered dithering\n"
 			" -dither:ord8,0.5   - 8x8 ordered dithering\n"
 			" -dither:ord16,0.5  - 16x16 ordered dithering\n"
 			" -dither:ord32,0.5  - 32x32 ordered dithering\n"
 			" -dither:ord64,0.5  - 64x64 ordered dithering\n"
+			"Clustering engines available:\n"
+			" -kmeans:brute      - Exhaustive search\n"
+			" -kmeans:hamerly    - Bounded search (same result, more memory)\n"
 		);
 		return 1;
 	}
@@ -59,15 +893,48 @@ int main(int argc, const char *argv[]) {
 	int     nUnusedColoursPerPalette = 1;
 	int     nTileClusterPasses   = 0;
 	int     nColourClusterPasses = 0;
+	float   TileClusterStop[2]   = {0.0f, 0.0f};
+	float   ColourClusterStop[2] = {0.0f, 0.0f};
+	int     nThreads = 0;
+	int     nJobs    = 0;
+	int     SharedPalettes = 0;
+	int     ClusterEngine = QUANTCLUSTER_ENGINE_BRUTEFORCE;
+	int     ClusterHistogram = 0;
+	int     ClusterBatchSize = 0;
+	uint32_t ClusterBatchSeed = 0;
+	int     PxStorage = TILESDATA_STORAGE_FLOAT;
+	int     DedupTiles = 0;
+	const char *TileMapFile = NULL;
+	const char *CharsFile   = NULL;
+	const char *PaletteFile = NULL;
+	const char *OutDir      = NULL;
+	const char *UsePalFile  = NULL;
+	const char *UseMapFile  = NULL;
+	int     CharDepth = GBAOUTPUT_CHARS_4BPP;
+	int     StreamTileRows = 0;
+	int     StatsMode = 0;
 	int     TileW = 8;
 	int     TileH = 8;
 	struct BGRA8_t BitRange = {.b = 0x1F, .g = 0x1F, .r = 0x1F, .a = 0x01};
 	int     DitherMode  = DITHER_FLOYDSTEINBERG;
-	float   DitherLevel = 1.0f; {
+	float   DitherLevel = 1.0f;
+	int     nFileArgs = 0;
+	const char **FileArgs = calloc(argc, sizeof(const char*)); {
 		int argi;
-		for(argi=3;argi<argc;argi++) {
+		for(argi=1;argi<argc;argi++) if(!strcmp(argv[argi], "-stats:json")) MessageStream = stderr;
+		if(!FileArgs) {
+			Report(NULL, "Out of memory");
+			return -1;
+		}
+		for(argi=1;argi<argc;argi++) {
 			int ArgOk = 0;
 
+			//! Input/output files
+			if(argv[argi][0] != '-') {
+				FileArgs[nFileArgs++] = argv[argi];
+				continue;
+			}
+
 			const char *ArgStr;
 #define ARGMATCH(Input, Target) \
 	ArgStr = Input + strlen(Target); \
@@ -107,6 +974,7 @@ int main(int argc, const char *argv[]) {
 	}
 				DITHERMODE_MATCH(ArgStr, "none",  DITHER_NONE,           0.0f);
 				DITHERMODE_MATCH(ArgStr, "floyd", DITHER_FLOYDSTEINBERG, 1.0f);
+				DITHERMODE_MATCH(ArgStr, "floydtile", DITHER_FLOYDSTEINBERG_TILE, 1.0f);
 				DITHERMODE_MATCH(ArgStr, "ord2",  DITHER_ORDERED(1),     0.5f);
 				DITHERMODE_MATCH(ArgStr, "ord4",  DITHER_ORDERED(2),     0.5f);
 				DITHERMODE_MATCH(ArgStr, "ord8",  DITHER_ORDERED(3),     0.5f);
@@ -114,89 +982,218 @@ int main(int argc, const char *argv[]) {
 				DITHERMODE_MATCH(ArgStr, "ord32", DITHER_ORDERED(5),     0.5f);
 				DITHERMODE_MATCH(ArgStr, "ord64", DITHER_ORDERED(6),     0.5f);
 #undef DITHERMODE_MATCH
-				if(!ArgOk) printf("Unrecognized dither mode: %s\n", ArgStr);
+				if(!ArgOk) Report(NULL, "Unrecognized dither mode: %s", ArgStr);
 				ArgOk = 1;
 			}
 
 			//! nTileClusterPasses
 			ARGMATCH(argv[argi], "-tilepasses:") {
 				ArgOk = 1;
-				nTileClusterPasses = atoi(ArgStr);
+				ParseClusterPasses(ArgStr, &nTileClusterPasses, &TileClusterStop[0], &TileClusterStop[1]);
 			}
 
 			//! nColourClusterPasses
 			ARGMATCH(argv[argi], "-colourpasses:") {
 				ArgOk = 1;
-				nColourClusterPasses = atoi(ArgStr);
+				ParseClusterPasses(ArgStr, &nColourClusterPasses, &ColourClusterStop[0], &ColourClusterStop[1]);
+			}
+
+			//! nThreads
+			ARGMATCH(argv[argi], "-threads:") {
+				ArgOk = 1;
+				nThreads = atoi(ArgStr);
+			}
+
+			//! nJobs
+			//! NOTE: "-j N" is also accepted, as with make.
+			ARGMATCH(argv[argi], "-j:") ArgOk = 1, nJobs = atoi(ArgStr);
+			if(!strcmp(argv[argi], "-j") && argi+1 < argc) ArgOk = 1, nJobs = atoi(argv[++argi]);
+
+			//! ClusterEngine
+			ARGMATCH(argv[argi], "-kmeans:") {
+				ArgOk = 1;
+				if     (!strcmp(ArgStr, "brute"))   ClusterEngine = QUANTCLUSTER_ENGINE_BRUTEFORCE;
+				else if(!strcmp(ArgStr, "hamerly")) ClusterEngine = QUANTCLUSTER_ENGINE_HAMERLY;
+				else Report(NULL, "Unrecognized clustering engine: %s", ArgStr);
+			}
+
+			//! ClusterHistogram
+			ARGMATCH(argv[argi], "-histogram:") {
+				ArgOk = 1;
+				ClusterHistogram = atoi(ArgStr);
+			}
+
+			//! ClusterBatchSize, ClusterBatchSeed
+			ARGMATCH(argv[argi], "-batch:") {
+				ArgOk = 1;
+				ClusterBatchSize = atoi(ArgStr);
+				ArgStr = strchr(ArgStr, ',');
+				if(ArgStr) ClusterBatchSeed = (uint32_t)strtoul(ArgStr+1, NULL, 0);
+			}
+
+			//! PxStorage
+			ARGMATCH(argv[argi], "-compact:") {
+				ArgOk = 1;
+				PxStorage = atoi(ArgStr) ? TILESDATA_STORAGE_BGRA8 : TILESDATA_STORAGE_FLOAT;
+			}
+
+			//! DedupTiles
+			ARGMATCH(argv[argi], "-dedup:") ArgOk = 1, DedupTiles = atoi(ArgStr);
+
+			//! TileMapFile
+			ARGMATCH(argv[argi], "-tilemap:") ArgOk = 1, TileMapFile = ArgStr;
+
+			//! CharsFile
+			ARGMATCH(argv[argi], "-chars:") ArgOk = 1, CharsFile = ArgStr;
+
+			//! CharDepth
+			ARGMATCH(argv[argi], "-bpp:") {
+				int x = atoi(ArgStr);
+				if(x == GBAOUTPUT_CHARS_4BPP || x == GBAOUTPUT_CHARS_8BPP) ArgOk = 1, CharDepth = x;
+			}
+
+			//! PaletteFile
+			ARGMATCH(argv[argi], "-palette:") ArgOk = 1, PaletteFile = ArgStr;
+
+			//! UsePalFile
+			ARGMATCH(argv[argi], "-usepal:") ArgOk = 1, UsePalFile = ArgStr;
+
+			//! UseMapFile
+			ARGMATCH(argv[argi], "-usemap:") ArgOk = 1, UseMapFile = ArgStr;
+
+			//! OutDir
+			ARGMATCH(argv[argi], "-outdir:") ArgOk = 1, OutDir = ArgStr;
+
+			//! SharedPalettes
+			ARGMATCH(argv[argi], "-shared:") ArgOk = 1, SharedPalettes = atoi(ArgStr);
+
+			//! StreamTileRows
+			ARGMATCH(argv[argi], "-stream:") ArgOk = 1, StreamTileRows = atoi(ArgStr);
+
+			//! StatsMode
+			if(!strcmp(argv[argi], "-stats")) ArgOk = 1, StatsMode = 1;
+			ARGMATCH(argv[argi], "-stats:") {
+				if(!strcmp(ArgStr, "json")) ArgOk = 1, StatsMode = 2;
 			}
 #undef ARGMATCH
 			//! Unrecognized?
-			if(!ArgOk) printf("Unrecognized argument: %s\n", ArgStr);
+			if(!ArgOk) Report(NULL, "Unrecognized argument: %s", ArgStr);
 		}
 	}
+	if(!OutDir && nFileArgs != 2) {
+		Report(NULL, "Expected Input.bmp and Output.bmp (or -outdir: for several inputs)");
+		free(FileArgs);
+		return 1;
+	}
 
-	//! Get input image
-	struct BmpCtx_t Image;
-	if(!BmpCtx_FromFile(&Image, argv[1])) {
-		printf("Unable to read input file\n");
-		return -1;
+	//! Prepare options
+	struct Options_t Opt = {
+		.nPalettes                = nPalettes,
+		.nColoursPerPalette       = nColoursPerPalette,
+		.nUnusedColoursPerPalette = nUnusedColoursPerPalette,
+		.TileW                    = TileW,
+		.TileH                    = TileH,
+		.BitRange                 = BitRange,
+		.DitherMode               = DitherMode,
+		.DitherLevel              = DitherLevel,
+		.PxStorage                = PxStorage,
+		.DedupTiles               = DedupTiles,
+		.CharDepth                = CharDepth,
+		.StreamTileRows           = StreamTileRows,
+		.TileClusterParams = {
+			.nPasses            = nTileClusterPasses,
+			.Engine             = ClusterEngine,
+			.StopChangeRatio    = TileClusterStop[0],
+			.StopDistortionDrop = TileClusterStop[1],
+			.Histogram          = ClusterHistogram,
+			.BatchSize          = ClusterBatchSize,
+			.BatchSeed          = ClusterBatchSeed,
+		},
+		.ColourClusterParams = {
+			.nPasses            = nColourClusterPasses,
+			.Engine             = ClusterEngine,
+			.StopChangeRatio    = ColourClusterStop[0],
+			.StopDistortionDrop = ColourClusterStop[1],
+			.Histogram          = ClusterHistogram,
+			.BatchSize          = ClusterBatchSize,
+			.BatchSeed          = ClusterBatchSeed,
+		},
+	};
+
+	//! Palettes are padded to 16 colours for 4bpp tiles
+	Opt.PalStride = (CharDepth == GBAOUTPUT_CHARS_4BPP && nColoursPerPalette <= 16) ? 16 : nColoursPerPalette;
+	if(CharsFile && CharDepth == GBAOUTPUT_CHARS_4BPP && nColoursPerPalette > 16) {
+		Report(NULL, "4bpp tiles need at most 16 colours per palette; characters not written");
+		CharsFile = NULL;
 	}
-	if(Image.Width%TileW || Image.Height%TileH) {
-		printf("Image not a multiple of tile size (%dx%d)\n", TileW, TileH);
-		BmpCtx_Destroy(&Image);
-		return -1;
+
+	//! Load given palettes
+	//! NOTE: Palettes are only remapped to, which needs no streaming,
+	//! and every image can then be processed on its own.
+	struct BGRA8_t SrcPalette[BMP_PALETTE_COLOURS] = {{0,0,0,0}};
+	if(UsePalFile) {
+		if(nPalettes*nColoursPerPalette > BMP_PALETTE_COLOURS || !LoadPalette(&Opt, UsePalFile, SrcPalette)) {
+			Report(NULL, "Unable to read palette file");
+			free(FileArgs);
+			return -1;
+		}
+		Opt.SrcPalette = SrcPalette;
+		if(StreamTileRows > 0) Report(NULL, "Streaming is not needed with given palettes; loading whole images");
+		if(SharedPalettes) Report(NULL, "Palettes are given; -shared: ignored");
+		SharedPalettes = 0;
+	} else if(UseMapFile) {
+		Report(NULL, "-usemap: needs -usepal:; ignored");
+		UseMapFile = NULL;
 	}
 
-	//! Perform processing
-	//! NOTE: PxData and Palette will be assigned to image; do NOT destroy
-	struct TilesData_t *TilesData = TilesData_FromBitmap(&Image, TileW, TileH, &BitRange, DitherMode, DitherLevel);
-	       uint8_t     *PxData    = malloc(Image.Width * Image.Height * sizeof(uint8_t));
-	struct BGRAf_t     *Palette   = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRAf_t));
-	if(!TilesData || !PxData || !Palette) {
-		printf("Out of memory; image not processed\n");
-		free(Palette);
-		free(PxData);
-		free(TilesData);
-		BmpCtx_Destroy(&Image);
-		return -1;
-	}
-	struct BGRAf_t RMSE = Qualetize(
-		&Image,
-		TilesData,
-		PxData,
-		Palette,
-		nPalettes,
-		nColoursPerPalette,
-		nUnusedColoursPerPalette,
-		nTileClusterPasses,
-		nColourClusterPasses,
-		&BitRange,
-		DitherMode,
-		DitherLevel,
-		1
-	);
-	free(TilesData);
+	//! Prepare statistics
+	struct Stats_t StatsData;
+	struct Stats_t *Stats = StatsMode ? &StatsData : NULL;
+	Stats_Init(Stats);
 
-	//! Output PSNR
-#if MEASURE_PSNR
-	RMSE.b = -8.68588963f*logf(RMSE.b / 255.0f); //! -20*Log10[RMSE/255] == -20/Log[10] * Log[RMSE/255]
-	RMSE.g = -8.68588963f*logf(RMSE.g / 255.0f);
-	RMSE.r = -8.68588963f*logf(RMSE.r / 255.0f);
-	RMSE.a = -8.68588963f*logf(RMSE.a / 255.0f);
-	printf("PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}\n", RMSE.b, RMSE.g, RMSE.r, RMSE.a);
-#else
-	(void)RMSE;
-#endif
-	//! Output image
-	if(!BmpCtx_ToFile(&Image, argv[2])) {
-		printf("Unable to write output file\n");
-		BmpCtx_Destroy(&Image);
-		return -1;
+	//! Process several images
+	if(OutDir) {
+		int i, Ok = 1;
+		struct InputList_t Inputs = {NULL, 0, 0};
+		for(i=0;i<nFileArgs && Ok;i++) Ok = InputList_Add(&Inputs, FileArgs[i]);
+		free(FileArgs);
+		int nOk = -1;
+		if(!Ok)                 Report(NULL, "Out of memory");
+		else if(!Inputs.n)     Report(NULL, "No input files");
+		else if(SharedPalettes) nOk = ProcessShared(&Opt, &Inputs, OutDir, TileMapFile, CharsFile, PaletteFile, nThreads, Stats);
+		else                    nOk = ProcessBatch (&Opt, &Inputs, OutDir, TileMapFile, CharsFile, PaletteFile, UseMapFile, nJobs, nThreads, Stats);
+		if(nOk >= 0) {
+			PrintPeakMemory();
+			if(Stats) PrintStageStats(Stats, StatsMode == 2);
+			Report(NULL, "Processed %d of %d images", nOk, Inputs.n);
+			if(nOk == Inputs.n) Report(NULL, "Ok");
+		}
+		InputList_Destroy(&Inputs);
+		return (nOk > 0 && nOk == Inputs.n) ? 0 : -1;
 	}
 
+	//! Process image
+	//! NOTE: If the thread pool can't be created, we just run single-threaded
+	struct BGRAf_t RMSE;
+	struct ImageFiles_t Files = {
+		.Input    = FileArgs[0],
+		.Output   = FileArgs[1],
+		.TileMap  = TileMapFile,
+		.Chars    = CharsFile,
+		.Palette  = PaletteFile,
+		.TilePals = UseMapFile,
+	};
+	struct ThreadPool_t *Pool = ThreadPool_Create(nThreads);
+	int Ok = ProcessImage(&Opt, &Files, Pool, NULL, Stats, &RMSE, NULL);
+	ThreadPool_Destroy(Pool);
+	free(FileArgs);
+	if(!Ok) return -1;
+	PrintPSNR(NULL, RMSE);
+	PrintPeakMemory();
+	if(Stats) PrintStageStats(Stats, StatsMode == 2);
+
 	//! Success
-	BmpCtx_Destroy(&Image);
-	printf("Ok\n");
+	Report(NULL, "Ok");
 	return 0;
 }
 
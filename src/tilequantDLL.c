@@ -2,12 +2,120 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 /**************************************/
+#include "Arena.h"
 #include "Bitmap.h"
 #include "Qualetize.h"
+#include "Stats.h"
+#include "Threads.h"
 #include "Tiles.h"
 /**************************************/
 
+//! Store the tilemap, tile palette indices and palette of a processed image
+//! (see QualetizeImage() for the layout of each)
+//! NOTE: Palette[] holds the final BGRA palette, and may alias DstPal[].
+static void QualetizeImage_StoreOutputs(
+	const struct TilesData_t *TilesData,
+	const uint8_t *DstPxIdx,
+	const struct BGRA8_t *Palette,
+	      uint8_t *DstPal,
+	int      nPalettes,
+	int      nColoursPerPalette,
+	int      OutputPaletteIs24bitRGB,
+	int32_t *TilePalIdx,
+	int32_t *TileMap,
+	struct Arena_t *Arena
+) {
+	int i, nTiles = TilesData->TilesX * TilesData->TilesY;
+
+	//! Store tilemap
+	if(TileMap) {
+		struct TileMapEntry_t *Map = Arena_Alloc(Arena, nTiles * sizeof(struct TileMapEntry_t));
+		if(Map && TilesData_BuildTileMap(TilesData, DstPxIdx, nColoursPerPalette, Map) >= 0) {
+			for(i=0;i<nTiles;i++) {
+				*TileMap++ = Map[i].TileIdx;
+				*TileMap++ = Map[i].Flip;
+				*TileMap++ = Map[i].PalIdx;
+			}
+		} else for(i=0;i<nTiles*3;i++) *TileMap++ = -1;
+		Arena_Free(Arena, Map);
+	}
+
+	//! Store tile palette indices
+	if(TilePalIdx) {
+		      int32_t *Dst = TilePalIdx;
+		const int32_t *Src = TilesData->TilePalIdx;
+		for(i=0;i<nTiles;i++) *Dst++ = *Src++;
+	}
+
+	//! Store palette, converting to RRGGBB if needed
+	//! NOTE: Pointer aliasing, but target format is never larger than the source
+	int nCol = nPalettes * nColoursPerPalette;
+	uint8_t *Dst = DstPal;
+	const struct BGRA8_t *Src = Palette;
+	if(nCol) do {
+		struct BGRA8_t x = *Src++;
+		if(OutputPaletteIs24bitRGB) {
+			*Dst++ = x.r;
+			*Dst++ = x.g;
+			*Dst++ = x.b;
+		} else {
+			*Dst++ = x.b;
+			*Dst++ = x.g;
+			*Dst++ = x.r;
+			*Dst++ = x.a;
+		}
+	} while(--nCol);
+}
+
+/**************************************/
+
+//! Processing options
+//! These are the options that were added after QualetizeFromRawImage()
+//! was first published. Set every member to 0 (or pass Options=NULL) for
+//! the default behaviour, which gives the same output as that function.
+//!   Size = sizeof(struct QualetizeOptions_t):
+//!    Members beyond Size are taken as 0, so that callers built against
+//!    an older (smaller) version of this structure keep working.
+//!   TileClusterStop, ColourClusterStop:
+//!    Early termination of clustering passes: {StopChangeRatio, StopDistortionDrop}.
+//!    Refinement stops when fewer than StopChangeRatio of the points change cluster,
+//!    or distortion drops by less than StopDistortionDrop (relative) in a pass.
+//!    Zero disables either criterion.
+//!   MiniBatchSize    = 0 (disabled) or number of points sampled per clustering pass
+//!   MiniBatchSeed    = Seed for the mini-batch sampling
+//!   ClusterHistogram = Collapse identical colours before clustering (much faster
+//!    after range reduction, but results differ slightly; see QuantCluster_Params_t)
+//!   CompactPixels    = Store tile pixels compactly (4 bytes/pixel instead of 16)
+//!   DedupTiles       = Cluster and remap duplicate (and flipped) tiles only once,
+//!    weighted by their number of copies (faster on tiled maps, but results
+//!    differ slightly, as with ClusterHistogram)
+//! NOTE: New members are only ever added at the end.
+struct QualetizeOptions_t {
+	uint32_t Size;
+	float    TileClusterStop[2];
+	float    ColourClusterStop[2];
+	int      MiniBatchSize;
+	uint32_t MiniBatchSeed;
+	int      ClusterHistogram;
+	int      CompactPixels;
+	int      DedupTiles;
+};
+
+//! Get options, filling in defaults for any that were not given
+static struct QualetizeOptions_t QualetizeOptions_Get(const struct QualetizeOptions_t *Options) {
+	struct QualetizeOptions_t x;
+	memset(&x, 0, sizeof(x));
+	if(Options) memcpy(&x, Options, (Options->Size < sizeof(x)) ? Options->Size : sizeof(x));
+	x.Size = sizeof(x);
+	return x;
+}
+
+/**************************************/
+
+//! Process an image, using the given threads and scratch memory
+//! (either of which may be NULL).
 //! Pointer arguments:
 //!  For BGRA images:
 //!   SrcPxData = (struct BGRA8_t)[Width*Height]
@@ -21,12 +129,23 @@
 //!    NOTE: DstPal must have enough space to accomodate:
 //!     (struct BGRAf_t)[nPalettes * nColoursPerPalette]
 //!   TilePalIdx  = NULL or int32_t[(Width*Height) / (TileW*TileH)]
-//!   DitherMode  = Dither mode to use: 0 = DITHER_NONE, -1 = DITHER_FLOYDSTEINBERG, n = DITHER_ORDERED(n)
+//!   DitherMode  = Dither mode to use: 0 = DITHER_NONE, -1 = DITHER_FLOYDSTEINBERG, -2 = DITHER_FLOYDSTEINBERG_TILE, n = DITHER_ORDERED(n)
 //!   DitherLevel = Scale of the dither (0.0 = No dither, 1.0 = Full dither)
+//!   Options     = NULL or struct QualetizeOptions_t (NULL = defaults)
+//!   TileMap     = NULL or int32_t[(Width*Height) / (TileW*TileH) * 3]:
+//!    Receives the tilemap, as {TileIdx, Flip (1 = H, 2 = V), PalIdx} for
+//!    every tile. Identical (and flipped) tiles share the same TileIdx.
+//!   Stats       = NULL or struct Stats_t (see Stats.h):
+//!    Receives the time, peak memory growth (see Stats.h for its limits)
+//!    and work of every stage. The load and write stages are left
+//!    empty (no files are involved).
 //! OutputPaletteIs24bitRGB outputs RGB (byte order: {RR, GG, BB})
 //! colours without an alpha channel; the default is to output to
 //! BGRA (byte order: {BB, GG, RR, AA}).
-DECLSPEC int QualetizeFromRawImage(
+static int QualetizeImage(
+	struct ThreadPool_t *Pool,
+	struct Arena_t      *Arena,
+
 	//! Image specification
 	int ImgWidth,
 	int ImgHeight,
@@ -47,8 +166,13 @@ DECLSPEC int QualetizeFromRawImage(
 	int      nColourClusterPasses,
 	const uint8_t BitRange[4],
 	int           DitherMode,
-	float         DitherLevel
+	float         DitherLevel,
+	const struct QualetizeOptions_t *Options,
+	int32_t      *TileMap,
+	struct Stats_t *Stats
 ) {
+	struct QualetizeOptions_t Opt = QualetizeOptions_Get(Options);
+
 	//! Create image context
 	//! NOTE: 'const' violations in image data, but not modified so this is safe
 	struct BmpCtx_t Ctx;
@@ -61,8 +185,30 @@ DECLSPEC int QualetizeFromRawImage(
 	//! Do processing
 	//! NOTE: Do NOT allow image replacing, or things will go
 	//! very wrong when Qualetize() tries to free the pointers.
-	struct TilesData_t *TilesData = TilesData_FromBitmap(&Ctx, TileW, TileH, (const struct BGRA8_t*)BitRange, DitherMode, DitherLevel);
+	int PxStorage = Opt.CompactPixels ? TILESDATA_STORAGE_BGRA8 : TILESDATA_STORAGE_FLOAT;
+	Stats_Init(Stats);
+	struct TilesData_t *TilesData = TilesData_FromBitmap(&Ctx, TileW, TileH, (const struct BGRA8_t*)BitRange, DitherMode, DitherLevel, PxStorage, Opt.DedupTiles, Pool, Stats, Arena);
 	if(!TilesData) return 0;
+	struct QuantCluster_Params_t TileClusterParams = {
+		.nPasses            = nTileClusterPasses,
+		.Pool               = Pool,
+		.Arena              = Arena,
+		.StopChangeRatio    = Opt.TileClusterStop[0],
+		.StopDistortionDrop = Opt.TileClusterStop[1],
+		.Histogram          = Opt.ClusterHistogram,
+		.BatchSize          = Opt.MiniBatchSize,
+		.BatchSeed          = Opt.MiniBatchSeed,
+	};
+	struct QuantCluster_Params_t ColourClusterParams = {
+		.nPasses            = nColourClusterPasses,
+		.Pool               = Pool,
+		.Arena              = Arena,
+		.StopChangeRatio    = Opt.ColourClusterStop[0],
+		.StopDistortionDrop = Opt.ColourClusterStop[1],
+		.Histogram          = Opt.ClusterHistogram,
+		.BatchSize          = Opt.MiniBatchSize,
+		.BatchSeed          = Opt.MiniBatchSeed,
+	};
 	(void)Qualetize(
 		&Ctx, TilesData,
 		DstPxIdx,
@@ -70,39 +216,502 @@ DECLSPEC int QualetizeFromRawImage(
 		nPalettes,
 		nColoursPerPalette,
 		nUnusedColoursPerPalette,
-		nTileClusterPasses,
-		nColourClusterPasses,
+		&TileClusterParams,
+		&ColourClusterParams,
 		(const struct BGRA8_t*)BitRange,
 		DitherMode,
 		DitherLevel,
 		0
 	);
 
-	//! Store tile palette indices
-	if(TilePalIdx) {
-		int i;
-		      int32_t *Dst = TilePalIdx;
-		const int32_t *Src = TilesData->TilePalIdx;
-		for(i=0;i<(ImgWidth*ImgHeight)/(TileW*TileH);i++) *Dst++ = *Src++;
+	//! Store tilemap, tile palette indices and palette
+	QualetizeImage_StoreOutputs(TilesData, DstPxIdx, (const struct BGRA8_t*)DstPal, DstPal, nPalettes, nColoursPerPalette, OutputPaletteIs24bitRGB, TilePalIdx, TileMap, Arena);
+
+	//! Destroy tiling context, and all done
+	Arena_Free(Arena, TilesData);
+	return 1;
+}
+
+/**************************************/
+
+//! Process an image
+//! Arguments are as per QualetizeImage().
+//! NOTE: This is the original interface, and its arguments must not
+//! change; QualetizeFromRawImageEx() takes the newer options.
+//! NOTE: This uses one thread per CPU (or none on failure), and
+//! allocates all memory as needed; see QualetizeWithContext() to
+//! reuse these across calls.
+//! NOTE: Clustering results do not depend on the number of threads.
+DECLSPEC int QualetizeFromRawImage(
+	//! Image specification
+	int ImgWidth,
+	int ImgHeight,
+	const uint8_t *SrcPxData,
+	const uint8_t *SrcPxPal,
+	      uint8_t *DstPxIdx,
+	      uint8_t *DstPal,
+	      int      nUnusedColoursPerPalette,
+	      int      OutputPaletteIs24bitRGB,
+
+	//! Quantization control
+	int      nPalettes,
+	int      nColoursPerPalette,
+	int      TileW,
+	int      TileH,
+	int32_t *TilePalIdx,
+	int      nTileClusterPasses,
+	int      nColourClusterPasses,
+	const uint8_t BitRange[4],
+	int           DitherMode,
+	float         DitherLevel
+) {
+	struct ThreadPool_t *Pool = ThreadPool_Create(0);
+	int Result = QualetizeImage(
+		Pool,
+		NULL,
+		ImgWidth,
+		ImgHeight,
+		SrcPxData,
+		SrcPxPal,
+		DstPxIdx,
+		DstPal,
+		nUnusedColoursPerPalette,
+		OutputPaletteIs24bitRGB,
+		nPalettes,
+		nColoursPerPalette,
+		TileW,
+		TileH,
+		TilePalIdx,
+		nTileClusterPasses,
+		nColourClusterPasses,
+		BitRange,
+		DitherMode,
+		DitherLevel,
+		NULL,
+		NULL,
+		NULL
+	);
+	ThreadPool_Destroy(Pool);
+	return Result;
+}
+
+//! Process an image with options
+//! Arguments are as per QualetizeImage().
+DECLSPEC int QualetizeFromRawImageEx(
+	//! Image specification
+	int ImgWidth,
+	int ImgHeight,
+	const uint8_t *SrcPxData,
+	const uint8_t *SrcPxPal,
+	      uint8_t *DstPxIdx,
+	      uint8_t *DstPal,
+	      int      nUnusedColoursPerPalette,
+	      int      OutputPaletteIs24bitRGB,
+
+	//! Quantization control
+	int      nPalettes,
+	int      nColoursPerPalette,
+	int      TileW,
+	int      TileH,
+	int32_t *TilePalIdx,
+	int      nTileClusterPasses,
+	int      nColourClusterPasses,
+	const uint8_t BitRange[4],
+	int           DitherMode,
+	float         DitherLevel,
+	const struct QualetizeOptions_t *Options,
+	int32_t      *TileMap,
+	struct Stats_t *Stats
+) {
+	struct ThreadPool_t *Pool = ThreadPool_Create(0);
+	int Result = QualetizeImage(
+		Pool,
+		NULL,
+		ImgWidth,
+		ImgHeight,
+		SrcPxData,
+		SrcPxPal,
+		DstPxIdx,
+		DstPal,
+		nUnusedColoursPerPalette,
+		OutputPaletteIs24bitRGB,
+		nPalettes,
+		nColoursPerPalette,
+		TileW,
+		TileH,
+		TilePalIdx,
+		nTileClusterPasses,
+		nColourClusterPasses,
+		BitRange,
+		DitherMode,
+		DitherLevel,
+		Options,
+		TileMap,
+		Stats
+	);
+	ThreadPool_Destroy(Pool);
+	return Result;
+}
+
+/**************************************/
+
+//! Quantization context
+//! This owns the worker threads and the memory used for processing,
+//! which are then reused by every call to QualetizeWithContext().
+struct QualetizeContext_t {
+	struct ThreadPool_t *Pool;
+	struct Arena_t      *Arena;
+};
+
+//! Create quantization context
+//! Pass nThreads=0 to use one thread per CPU, and ArenaSize=0 to
+//! let the arena grow as needed (ArenaSize only sets its initial size).
+//! Returns NULL on failure (out of memory).
+DECLSPEC struct QualetizeContext_t *QualetizeContext_Create(int nThreads, size_t ArenaSize) {
+	struct QualetizeContext_t *Context = malloc(sizeof(struct QualetizeContext_t));
+	if(!Context) return NULL;
+	Context->Pool  = ThreadPool_Create(nThreads);
+	Context->Arena = Arena_Create(ArenaSize);
+	if(!Context->Arena) {
+		ThreadPool_Destroy(Context->Pool);
+		free(Context);
+		return NULL;
 	}
+	return Context;
+}
 
-	//! Convert palette to RRGGBB if needed
-	//! NOTE: Pointer aliasing, but target format is smaller than the source
-	if(OutputPaletteIs24bitRGB) {
-		int nCol = nPalettes * nColoursPerPalette;
-		uint8_t *Dst = DstPal;
-		const struct BGRA8_t *Src = (const struct BGRA8_t*)DstPal;
-		if(nCol) do {
-			struct BGRA8_t x = *Src++;
-			*Dst++ = x.r;
-			*Dst++ = x.g;
-			*Dst++ = x.b;
-		} while(--nCol);
+//! Destroy quantization context
+DECLSPEC void QualetizeContext_Destroy(struct QualetizeContext_t *Context) {
+	if(!Context) return;
+	ThreadPool_Destroy(Context->Pool);
+	Arena_Destroy(Context->Arena);
+	free(Context);
+}
+
+//! Process an image with a quantization context
+//! Arguments are as per QualetizeImage().
+//! NOTE: Once the arena has grown to fit the largest image processed,
+//! calls on images of up to that size don't touch the allocator at all.
+//! NOTE: A context must not be used by several calls at once.
+DECLSPEC int QualetizeWithContext(
+	struct QualetizeContext_t *Context,
+
+	//! Image specification
+	int ImgWidth,
+	int ImgHeight,
+	const uint8_t *SrcPxData,
+	const uint8_t *SrcPxPal,
+	      uint8_t *DstPxIdx,
+	      uint8_t *DstPal,
+	      int      nUnusedColoursPerPalette,
+	      int      OutputPaletteIs24bitRGB,
+
+	//! Quantization control
+	int      nPalettes,
+	int      nColoursPerPalette,
+	int      TileW,
+	int      TileH,
+	int32_t *TilePalIdx,
+	int      nTileClusterPasses,
+	int      nColourClusterPasses,
+	const uint8_t BitRange[4],
+	int           DitherMode,
+	float         DitherLevel,
+	const struct QualetizeOptions_t *Options,
+	int32_t      *TileMap,
+	struct Stats_t *Stats
+) {
+	int Result = QualetizeImage(
+		Context->Pool,
+		Context->Arena,
+		ImgWidth,
+		ImgHeight,
+		SrcPxData,
+		SrcPxPal,
+		DstPxIdx,
+		DstPal,
+		nUnusedColoursPerPalette,
+		OutputPaletteIs24bitRGB,
+		nPalettes,
+		nColoursPerPalette,
+		TileW,
+		TileH,
+		TilePalIdx,
+		nTileClusterPasses,
+		nColourClusterPasses,
+		BitRange,
+		DitherMode,
+		DitherLevel,
+		Options,
+		TileMap,
+		Stats
+	);
+	Arena_Reset(Context->Arena);
+	return Result;
+}
+
+/**************************************/
+
+//! Batch of images to process
+struct QualetizeBatch_t {
+	struct Arena_t **Arenas; //! [nThreads]
+
+	//! Image specification
+	const int *ImgWidth;
+	const int *ImgHeight;
+	const uint8_t *const *SrcPxData;
+	const uint8_t *const *SrcPxPal;
+	      uint8_t *const *DstPxIdx;
+	      uint8_t *const *DstPal;
+	      int      nUnusedColoursPerPalette;
+	      int      OutputPaletteIs24bitRGB;
+
+	//! Quantization control
+	int      nPalettes;
+	int      nColoursPerPalette;
+	int      TileW;
+	int      TileH;
+	int32_t *const *TilePalIdx;
+	int      nTileClusterPasses;
+	int      nColourClusterPasses;
+	const uint8_t *BitRange;
+	int           DitherMode;
+	float         DitherLevel;
+	struct QualetizeOptions_t Options;
+	int32_t *const *TileMap;
+	struct Stats_t *Stats;
+
+	int *Results;
+};
+
+//! Process one image of a batch
+static void QualetizeBatch_Task(void *Arg, int TaskIdx, int ThreadIdx) {
+	const struct QualetizeBatch_t *Batch = Arg;
+	struct Arena_t *Arena = Batch->Arenas[ThreadIdx];
+	Batch->Results[TaskIdx] = QualetizeImage(
+		NULL,
+		Arena,
+		Batch->ImgWidth[TaskIdx],
+		Batch->ImgHeight[TaskIdx],
+		Batch->SrcPxData[TaskIdx],
+		Batch->SrcPxPal ? Batch->SrcPxPal[TaskIdx] : NULL,
+		Batch->DstPxIdx[TaskIdx],
+		Batch->DstPal[TaskIdx],
+		Batch->nUnusedColoursPerPalette,
+		Batch->OutputPaletteIs24bitRGB,
+		Batch->nPalettes,
+		Batch->nColoursPerPalette,
+		Batch->TileW,
+		Batch->TileH,
+		Batch->TilePalIdx ? Batch->TilePalIdx[TaskIdx] : NULL,
+		Batch->nTileClusterPasses,
+		Batch->nColourClusterPasses,
+		Batch->BitRange,
+		Batch->DitherMode,
+		Batch->DitherLevel,
+		&Batch->Options,
+		Batch->TileMap ? Batch->TileMap[TaskIdx] : NULL,
+		Batch->Stats ? &Batch->Stats[TaskIdx] : NULL
+	);
+	Arena_Reset(Arena);
+}
+
+//! Process several images
+//! Arguments are as per QualetizeImage(), except that image
+//! data are arrays of nImages elements (one for each image):
+//!   ImgWidth, ImgHeight = int[nImages]
+//!   SrcPxData, DstPxIdx, DstPal = (pointer)[nImages]
+//!   SrcPxPal, TilePalIdx, TileMap = NULL or (pointer)[nImages]
+//!    (individual elements may also be NULL)
+//!   Stats   = NULL or (struct Stats_t)[nImages]
+//!   Results = NULL or int[nImages]: Receives the result of every image
+//! Returns the number of images processed successfully.
+//! NOTE: Up to nJobs images (pass nJobs=0 for one per CPU) are processed
+//! at once, each on a single thread with scratch memory that is reused
+//! for every image that thread processes. Threads take the next image
+//! as soon as they become idle, so differing image sizes balance out.
+//! NOTE: Results are the same as for QualetizeFromRawImageEx().
+DECLSPEC int QualetizeBatch(
+	int nImages,
+	int nJobs,
+
+	//! Image specification
+	const int *ImgWidth,
+	const int *ImgHeight,
+	const uint8_t *const *SrcPxData,
+	const uint8_t *const *SrcPxPal,
+	      uint8_t *const *DstPxIdx,
+	      uint8_t *const *DstPal,
+	      int      nUnusedColoursPerPalette,
+	      int      OutputPaletteIs24bitRGB,
+
+	//! Quantization control
+	int      nPalettes,
+	int      nColoursPerPalette,
+	int      TileW,
+	int      TileH,
+	int32_t *const *TilePalIdx,
+	int      nTileClusterPasses,
+	int      nColourClusterPasses,
+	const uint8_t BitRange[4],
+	int           DitherMode,
+	float         DitherLevel,
+	const struct QualetizeOptions_t *Options,
+	int32_t *const *TileMap,
+	struct Stats_t *Stats,
+	int            *Results
+) {
+	int i, nOk = 0;
+	if(nImages <= 0) return 0;
+
+	//! Create threads and their scratch memory
+	//! NOTE: If an arena can't be created, that thread just allocates as needed.
+	struct ThreadPool_t *Pool = ThreadPool_Create(nJobs);
+	int nThreads = ThreadPool_GetThreadCount(Pool);
+	struct Arena_t **Arenas = malloc(nThreads * sizeof(struct Arena_t*));
+	int *ResultBuffer = Results ? Results : malloc(nImages * sizeof(int));
+	if(!Arenas || !ResultBuffer) {
+		if(ResultBuffer != Results) free(ResultBuffer);
+		free(Arenas);
+		ThreadPool_Destroy(Pool);
+		return 0;
 	}
+	for(i=0;i<nThreads;i++) Arenas[i] = Arena_Create(0);
 
-	//! Destroy tiling context, and all done
-	free(TilesData);
-	return 1;
+	//! Process images
+	struct QualetizeBatch_t Batch = {
+		.Arenas                   = Arenas,
+		.ImgWidth                 = ImgWidth,
+		.ImgHeight                = ImgHeight,
+		.SrcPxData                = SrcPxData,
+		.SrcPxPal                 = SrcPxPal,
+		.DstPxIdx                 = DstPxIdx,
+		.DstPal                   = DstPal,
+		.nUnusedColoursPerPalette = nUnusedColoursPerPalette,
+		.OutputPaletteIs24bitRGB  = OutputPaletteIs24bitRGB,
+		.nPalettes                = nPalettes,
+		.nColoursPerPalette       = nColoursPerPalette,
+		.TileW                    = TileW,
+		.TileH                    = TileH,
+		.TilePalIdx               = TilePalIdx,
+		.nTileClusterPasses       = nTileClusterPasses,
+		.nColourClusterPasses     = nColourClusterPasses,
+		.BitRange                 = BitRange,
+		.DitherMode               = DitherMode,
+		.DitherLevel              = DitherLevel,
+		.Options                  = QualetizeOptions_Get(Options),
+		.TileMap                  = TileMap,
+		.Stats                    = Stats,
+		.Results                  = ResultBuffer,
+	};
+	ThreadPool_Run(Pool, QualetizeBatch_Task, &Batch, nImages);
+	for(i=0;i<nImages;i++) nOk += (ResultBuffer[i] != 0);
+
+	//! Clean up
+	for(i=0;i<nThreads;i++) Arena_Destroy(Arenas[i]);
+	if(ResultBuffer != Results) free(ResultBuffer);
+	free(Arenas);
+	ThreadPool_Destroy(Pool);
+	return nOk;
+}
+
+/**************************************/
+
+//! Process an image with given palettes
+//! This skips clustering entirely, and only remaps the image (see
+//! QualetizeWithPalettes() in Qualetize.h), which is much faster when
+//! palettes are reused (eg. for animation frames).
+//! Arguments are as per QualetizeImage(), except:
+//!   Context       = NULL, or a quantization context to use (NULL = one
+//!    thread per CPU, allocating memory as needed)
+//!   SrcPalettes   = (struct BGRA8_t)[nPalettes * nColoursPerPalette]:
+//!    The palettes to use; colours are reduced to BitRange.
+//!   SrcTilePalIdx = NULL or int32_t[(Width*Height) / (TileW*TileH)]:
+//!    The palette of every tile. When NULL, every tile is given the
+//!    palette that remaps it with the least error.
+//!   DstPal        = (struct BGRA8_t)[nPalettes * nColoursPerPalette]
+//!    (no further space is needed)
+//!   Options       = As per QualetizeImage(); options that only affect
+//!    clustering are ignored.
+//! Returns 0 on failure (out of memory, or palette indices out of range).
+DECLSPEC int QualetizeFromPalettes(
+	struct QualetizeContext_t *Context,
+
+	//! Image specification
+	int ImgWidth,
+	int ImgHeight,
+	const uint8_t *SrcPxData,
+	const uint8_t *SrcPxPal,
+	      uint8_t *DstPxIdx,
+	      uint8_t *DstPal,
+	      int      nUnusedColoursPerPalette,
+	      int      OutputPaletteIs24bitRGB,
+
+	//! Remapping control
+	const uint8_t *SrcPalettes,
+	int      nPalettes,
+	int      nColoursPerPalette,
+	int      TileW,
+	int      TileH,
+	const int32_t *SrcTilePalIdx,
+	int32_t *TilePalIdx,
+	const uint8_t BitRange[4],
+	int           DitherMode,
+	float         DitherLevel,
+	const struct QualetizeOptions_t *Options,
+	int32_t      *TileMap,
+	struct Stats_t *Stats
+) {
+	if(nPalettes*nColoursPerPalette > BMP_PALETTE_COLOURS) return 0;
+	struct QualetizeOptions_t Opt = QualetizeOptions_Get(Options);
+	struct ThreadPool_t *Pool  = Context ? Context->Pool  : ThreadPool_Create(0);
+	struct Arena_t      *Arena = Context ? Context->Arena : NULL;
+
+	//! Create image context
+	//! NOTE: 'const' violations in image data, but not modified so this is safe
+	struct BmpCtx_t Ctx;
+	Ctx.Width  = ImgWidth;
+	Ctx.Height = ImgHeight;
+	Ctx.ColPal = (struct BGRA8_t*)SrcPxPal;
+	if(SrcPxPal) Ctx.PxIdx = (       uint8_t*)SrcPxData;
+	else         Ctx.PxBGR = (struct BGRA8_t*)SrcPxData;
+
+	//! Do processing
+	//! NOTE: The palette is processed in its own buffer, as this
+	//! needs more space than DstPal[] is required to have.
+	int Result = 0;
+	int PxStorage = Opt.CompactPixels ? TILESDATA_STORAGE_BGRA8 : TILESDATA_STORAGE_FLOAT;
+	struct BGRAf_t Palette[BMP_PALETTE_COLOURS] = {{0,0,0,0}};
+	struct BGRAf_t RMSE;
+	Stats_Init(Stats);
+	struct TilesData_t *TilesData = TilesData_FromBitmap(&Ctx, TileW, TileH, (const struct BGRA8_t*)BitRange, DitherMode, DitherLevel, PxStorage, Opt.DedupTiles, Pool, Stats, Arena);
+	if(TilesData) Result = QualetizeWithPalettes(
+		&Ctx, TilesData,
+		DstPxIdx,
+		Palette,
+		(const struct BGRA8_t*)SrcPalettes,
+		SrcTilePalIdx,
+		nPalettes,
+		nColoursPerPalette,
+		nUnusedColoursPerPalette,
+		(const struct BGRA8_t*)BitRange,
+		DitherMode,
+		DitherLevel,
+		0,
+		Pool,
+		&RMSE
+	);
+
+	//! Store outputs
+	if(Result) {
+		QualetizeImage_StoreOutputs(TilesData, DstPxIdx, (const struct BGRA8_t*)Palette, DstPal, nPalettes, nColoursPerPalette, OutputPaletteIs24bitRGB, TilePalIdx, TileMap, Arena);
+	}
+
+	//! Clean up
+	Arena_Free(Arena, TilesData);
+	if(Context) Arena_Reset(Arena);
+	else ThreadPool_Destroy(Pool);
+	return Result;
 }
 
 /**************************************/